@@ -37,38 +37,131 @@ THE SOFTWARE.
 
 */
 
+/* The atom table is a chained hash table keyed with SipHash and a
+   random seed, so that chains stay short even when an attacker controls
+   the strings being interned.  The table doubles when the load factor
+   exceeds ATOM_LOAD_FACTOR; rather than rehashing everything at once,
+   a few buckets of the old table are moved on every call to internAtomN.
+   While this is happening, buckets of the old table below
+   atomRehashIndex have already been moved and are empty. */
+
+#define ATOM_LOAD_FACTOR 2
+#define ATOM_REHASH_STEP 4
+#define MAX_LOG2_ATOM_HASH_TABLE_SIZE 24
+
 static AtomPtr *atomHashTable;
+static int log2AtomHashTableSize;
+static AtomPtr *oldAtomHashTable = NULL;
+static int log2OldAtomHashTableSize;
+static int atomRehashIndex;
+static unsigned long long atomHashKey[2];
 int used_atoms;
+unsigned long atomLookups = 0, atomChainSteps = 0;
 
 void
 initAtoms()
 {
-    atomHashTable = calloc((1 << LOG2_ATOM_HASH_TABLE_SIZE),
-                           sizeof(AtomPtr));
+    log2AtomHashTableSize = LOG2_ATOM_HASH_TABLE_SIZE;
+    atomHashTable = calloc((1 << log2AtomHashTableSize), sizeof(AtomPtr));
 
     if(atomHashTable == NULL) {
         do_log(L_ERROR, "Couldn't allocate atom hash table.\n");
         exit(1);
     }
+    randomBytes(atomHashKey, sizeof(atomHashKey));
     used_atoms = 0;
 }
 
+static inline unsigned int
+atomHash(const char *string, int n)
+{
+    return (unsigned int)sipHash(atomHashKey, string, n);
+}
+
+static AtomPtr *
+atomBucket(unsigned int h)
+{
+    if(oldAtomHashTable) {
+        int i = h & ((1 << log2OldAtomHashTableSize) - 1);
+        if(i >= atomRehashIndex)
+            return &oldAtomHashTable[i];
+    }
+    return &atomHashTable[h & ((1 << log2AtomHashTableSize) - 1)];
+}
+
+static void
+atomRehashStep(int n)
+{
+    AtomPtr atom, next;
+    unsigned int h;
+
+    while(n > 0 && atomRehashIndex < (1 << log2OldAtomHashTableSize)) {
+        atom = oldAtomHashTable[atomRehashIndex];
+        while(atom) {
+            next = atom->next;
+            h = atomHash(atom->string, atom->length) &
+                ((1 << log2AtomHashTableSize) - 1);
+            atom->next = atomHashTable[h];
+            atomHashTable[h] = atom;
+            atom = next;
+        }
+        oldAtomHashTable[atomRehashIndex] = NULL;
+        atomRehashIndex++;
+        n--;
+    }
+
+    if(atomRehashIndex >= (1 << log2OldAtomHashTableSize)) {
+        free(oldAtomHashTable);
+        oldAtomHashTable = NULL;
+    }
+}
+
+static void
+maybeGrowAtomTable()
+{
+    AtomPtr *table;
+
+    if(oldAtomHashTable) {
+        atomRehashStep(ATOM_REHASH_STEP);
+        return;
+    }
+
+    if(used_atoms < ATOM_LOAD_FACTOR << log2AtomHashTableSize ||
+       log2AtomHashTableSize >= MAX_LOG2_ATOM_HASH_TABLE_SIZE)
+        return;
+
+    table = calloc((1 << (log2AtomHashTableSize + 1)), sizeof(AtomPtr));
+    if(table == NULL) {
+        /* Not fatal -- chains will just get longer. */
+        do_log(L_WARN, "Couldn't grow atom hash table.\n");
+        return;
+    }
+    oldAtomHashTable = atomHashTable;
+    log2OldAtomHashTableSize = log2AtomHashTableSize;
+    atomRehashIndex = 0;
+    atomHashTable = table;
+    log2AtomHashTableSize++;
+}
+
 AtomPtr
 internAtomN(const char *string, int n)
 {
-    AtomPtr atom;
-    int h;
+    AtomPtr atom, *bucket;
 
     if(n < 0 || n >= (1 << (8 * sizeof(unsigned short))))
         return NULL;
 
-    h = hash(0, string, n, LOG2_ATOM_HASH_TABLE_SIZE);
-    atom = atomHashTable[h];
+    maybeGrowAtomTable();
+
+    bucket = atomBucket(atomHash(string, n));
+    atom = *bucket;
+    atomLookups++;
     while(atom) {
         if(atom->length == n &&
            (n == 0 || memcmp(atom->string, string, n) == 0))
             break;
         atom = atom->next;
+        atomChainSteps++;
     }
 
     if(!atom) {
@@ -83,8 +176,8 @@ internAtomN(const char *string, int n)
            NUL-terminated. */
         memcpy(atom->string, string, n);
         atom->string[n] = '\0';
-        atom->next = atomHashTable[h];
-        atomHashTable[h] = atom;
+        atom->next = *bucket;
+        *bucket = atom;
         used_atoms++;
     }
     do_log(D_ATOM_REFCOUNT, "A 0x%lx %d++\n",
@@ -93,6 +186,33 @@ internAtomN(const char *string, int n)
     return atom;
 }
 
+/* Return the number of buckets and the length of the longest chain. */
+void
+atomTableStatistics(int *buckets, int *longest)
+{
+    AtomPtr atom;
+    int i, n, max = 0;
+
+    for(i = 0; i < (1 << log2AtomHashTableSize); i++) {
+        n = 0;
+        for(atom = atomHashTable[i]; atom; atom = atom->next)
+            n++;
+        if(n > max)
+            max = n;
+    }
+    if(oldAtomHashTable) {
+        for(i = atomRehashIndex; i < (1 << log2OldAtomHashTableSize); i++) {
+            n = 0;
+            for(atom = oldAtomHashTable[i]; atom; atom = atom->next)
+                n++;
+            if(n > max)
+                max = n;
+        }
+    }
+    *buckets = 1 << log2AtomHashTableSize;
+    *longest = max;
+}
+
 AtomPtr
 internAtom(const char *string)
 {
@@ -189,14 +309,14 @@ releaseAtom(AtomPtr atom)
     atom->refcount--;
 
     if(atom->refcount == 0) {
-        int h = hash(0, atom->string, atom->length, LOG2_ATOM_HASH_TABLE_SIZE);
-        assert(atomHashTable[h] != NULL);
+        AtomPtr *bucket = atomBucket(atomHash(atom->string, atom->length));
+        assert(*bucket != NULL);
 
-        if(atom == atomHashTable[h]) {
-            atomHashTable[h] = atom->next;
+        if(atom == *bucket) {
+            *bucket = atom->next;
             free(atom);
         } else {
-            AtomPtr previous = atomHashTable[h];
+            AtomPtr previous = *bucket;
             while(previous->next) {
                 if(previous->next == atom)
                     break;
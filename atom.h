@@ -37,8 +37,10 @@ typedef struct _AtomList {
 #define LARGE_ATOM_REFCOUNT 0xFFFFFF00U
 
 extern int used_atoms;
+extern unsigned long atomLookups, atomChainSteps;
 
 void initAtoms(void);
+void atomTableStatistics(int *buckets, int *longest);
 AtomPtr internAtom(const char *string);
 AtomPtr internAtomN(const char *string, int n);
 AtomPtr internAtomLowerN(const char *string, int n);
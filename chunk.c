@@ -27,6 +27,22 @@ int chunkLowMark = 0,
     chunkCriticalMark = 0,
     chunkHighMark = 0;
 
+#if !defined(MALLOC_CHUNKS) && defined(HAVE_HUGE_PAGES) && \
+    defined(MADV_HUGEPAGE)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#else
+#undef HAVE_HUGE_PAGES
+#endif
+
+#ifdef HAVE_HUGE_PAGES
+int chunkHugePages = 0;
+#endif
+
+/* The marks as configured; the actual marks may be lowered at runtime
+   when the system is short on memory. */
+static int configuredHighMark, configuredLowMark, configuredCriticalMark;
+int memoryPressurePeriod = 0;
+
 void
 preinitChunks()
 {
@@ -36,6 +52,14 @@ preinitChunks()
                     "Critical mark for chunk memory (0 = auto).");
     CONFIG_VARIABLE(chunkHighMark, CONFIG_INT,
                     "High mark for chunk memory.");
+#ifdef __linux
+    CONFIG_VARIABLE(memoryPressurePeriod, CONFIG_TIME,
+                    "How often to adapt chunk marks to memory pressure.");
+#endif
+#ifdef HAVE_HUGE_PAGES
+    CONFIG_VARIABLE(chunkHugePages, CONFIG_TRISTATE,
+                    "Use huge pages for chunk memory (maybe = transparent).");
+#endif
 }
 
 static void
@@ -90,6 +114,10 @@ initChunksCommon()
                       "setting to %d.\n", chunkCriticalMark);
     }
 #undef ROUND_CHUNKS
+
+    configuredHighMark = chunkHighMark;
+    configuredLowMark = chunkLowMark;
+    configuredCriticalMark = chunkCriticalMark;
 }
 
 
@@ -112,6 +140,189 @@ maybe_free_chunks(int arenas, int force)
             objectExpiryScheduled = 1;
     }
 }
+
+/* Scale the chunk marks so that the high mark becomes high, and
+   release memory if we're now above it. */
+static void
+setChunkMarks(int high)
+{
+    high = (high / CHUNK_SIZE) * CHUNK_SIZE;
+    high = MAX(high, 8 * CHUNK_SIZE);
+    high = MIN(high, configuredHighMark);
+    if(high == chunkHighMark)
+        return;
+
+    if(high < chunkHighMark)
+        do_log(L_WARN, "Reducing chunk memory to %d kB.\n", high / 1024);
+    else
+        do_log(L_INFO, "Increasing chunk memory to %d kB.\n", high / 1024);
+
+    chunkHighMark = high;
+    chunkLowMark = (int)((double)configuredLowMark * high /
+                         configuredHighMark / CHUNK_SIZE) * CHUNK_SIZE;
+    chunkLowMark = MIN(MAX(chunkLowMark, 4 * CHUNK_SIZE),
+                       high - 4 * CHUNK_SIZE);
+    chunkCriticalMark = (int)((double)configuredCriticalMark * high /
+                              configuredHighMark / CHUNK_SIZE) * CHUNK_SIZE;
+    chunkCriticalMark = MIN(MAX(chunkCriticalMark,
+                                chunkLowMark + 2 * CHUNK_SIZE),
+                            high - 2 * CHUNK_SIZE);
+
+    if(used_chunks >= CHUNKS(chunkLowMark))
+        maybe_free_chunks(1, 0);
+}
+
+#ifdef __linux
+
+/* The cgroup v2 directory of this process, or NULL. */
+static char *cgroupDirectory = NULL;
+
+static long long
+readCgroupValue(const char *name)
+{
+    char buf[512], value[32];
+    FILE *f;
+    int rc;
+
+    rc = snprintf(buf, 512, "%s/%s", cgroupDirectory, name);
+    if(rc < 0 || rc >= 512)
+        return -1;
+    f = fopen(buf, "r");
+    if(f == NULL)
+        return -1;
+    rc = fscanf(f, "%31s", value);
+    fclose(f);
+    if(rc != 1 || strcmp(value, "max") == 0)
+        return -1;
+    return atoll(value);
+}
+
+/* Returns the percentage of time some tasks were stalled on memory
+   over the last ten seconds, or -1. */
+static double
+readMemoryPressure()
+{
+    char buf[512];
+    FILE *f = NULL;
+    double avg10 = -1.0;
+    int rc;
+
+    if(cgroupDirectory) {
+        rc = snprintf(buf, 512, "%s/memory.pressure", cgroupDirectory);
+        if(rc > 0 && rc < 512)
+            f = fopen(buf, "r");
+    }
+    if(f == NULL)
+        f = fopen("/proc/pressure/memory", "r");
+    if(f == NULL)
+        return -1.0;
+    while(fgets(buf, 512, f)) {
+        if(sscanf(buf, "some avg10=%lf", &avg10) == 1)
+            break;
+    }
+    fclose(f);
+    return avg10;
+}
+
+static int
+memoryPressureHandler(TimeEventHandlerPtr event)
+{
+    long long current = -1, max = -1;
+    double pressure;
+    int target;
+
+    if(cgroupDirectory) {
+        current = readCgroupValue("memory.current");
+        max = readCgroupValue("memory.max");
+    }
+    pressure = readMemoryPressure();
+
+    target = configuredHighMark;
+    if(current >= 0 && max > 0) {
+        /* Leave one eighth of the cgroup's limit to everyone else, and
+           don't count our own chunks against us. */
+        long long room;
+        room = max - max / 8 - (current - totalChunkArenaSize());
+        if(room < target)
+            target = MAX(room, 0);
+    }
+    if(pressure >= 10.0) {
+        target = MIN(target, chunkHighMark / 4 * 3);
+    } else if(pressure >= 1.0) {
+        target = MIN(target, chunkHighMark);
+    } else {
+        /* Grow back slowly, to avoid oscillating. */
+        target = MIN(target, chunkHighMark + configuredHighMark / 8);
+    }
+
+    setChunkMarks(target);
+
+    if(!scheduleTimeEvent(memoryPressurePeriod, memoryPressureHandler,
+                          0, NULL))
+        do_log(L_ERROR, "Couldn't schedule memory pressure check.\n");
+    return 1;
+}
+
+void
+initMemoryPressure()
+{
+    char buf[512];
+    FILE *f;
+
+    if(memoryPressurePeriod <= 0)
+        return;
+
+    f = fopen("/proc/self/cgroup", "r");
+    if(f) {
+        while(fgets(buf, 512, f)) {
+            /* The unified hierarchy is listed as 0::/path */
+            if(strncmp(buf, "0::", 3) == 0) {
+                char *p = buf + 3;
+                int n = strlen(p);
+                if(n > 0 && p[n - 1] == '\n')
+                    p[--n] = '\0';
+                /* Avoid a double slash for the root cgroup. */
+                if(strcmp(p, "/") == 0)
+                    p = "";
+                cgroupDirectory = malloc(strlen(p) + 32);
+                if(cgroupDirectory) {
+                    sprintf(cgroupDirectory, "/sys/fs/cgroup%s", p);
+                    if(readCgroupValue("memory.current") < 0) {
+                        /* Hybrid hierarchy */
+                        sprintf(cgroupDirectory,
+                                "/sys/fs/cgroup/unified%s", p);
+                        if(readCgroupValue("memory.current") < 0) {
+                            free(cgroupDirectory);
+                            cgroupDirectory = NULL;
+                        }
+                    }
+                }
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    if(cgroupDirectory == NULL && readMemoryPressure() < 0) {
+        do_log(L_WARN, "Neither cgroup v2 nor memory pressure "
+               "information is available.\n");
+        return;
+    }
+
+    if(!scheduleTimeEvent(memoryPressurePeriod, memoryPressureHandler,
+                          0, NULL))
+        do_log(L_ERROR, "Couldn't schedule memory pressure check.\n");
+}
+
+#else
+
+void
+initMemoryPressure()
+{
+    return;
+}
+
+#endif
     
 
 
@@ -171,6 +382,18 @@ dispose_chunk(void *chunk)
     used_chunks--;
 }
 
+void *
+get_small_chunk(int size)
+{
+    return NULL;
+}
+
+int
+chunk_capacity(void *chunk)
+{
+    return CHUNK_SIZE;
+}
+
 void
 free_chunks()
 {
@@ -184,13 +407,32 @@ totalChunkArenaSize()
 }
 #else
 
+/* Arenas are aligned on their size, so that the arena containing a
+   chunk can be found by masking the chunk's address. */
+
 #ifdef WIN32 /*MINGW*/
 #define MAP_FAILED NULL
 #define getpagesize() (64 * 1024)
 static void *
 alloc_arena(size_t size)
 {
-    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    char *p, *q;
+    int i;
+
+    /* VirtualAlloc cannot release part of a region, so we reserve
+       twice the space, release it, and hope nobody races us into the
+       aligned part. */
+    for(i = 0; i < 4; i++) {
+        p = VirtualAlloc(NULL, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
+        if(p == NULL)
+            return NULL;
+        q = (char*)(((unsigned long)p + size - 1) & ~(size - 1));
+        VirtualFree(p, 0, MEM_RELEASE);
+        p = VirtualAlloc(q, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if(p != NULL)
+            return p;
+    }
+    return NULL;
 }
 static int
 free_arena(void *addr, size_t size)
@@ -208,8 +450,39 @@ free_arena(void *addr, size_t size)
 static void *
 alloc_arena(size_t size)
 {
-    return mmap(NULL, size, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *p, *q;
+
+#if defined(HAVE_HUGE_PAGES) && defined(MAP_HUGETLB)
+    if(chunkHugePages == 2) {
+        /* Explicit huge pages are naturally aligned. */
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED)
+            return p;
+        do_log_error(L_WARN, errno,
+                     "Couldn't allocate huge pages, "
+                     "falling back to transparent huge pages");
+        chunkHugePages = 1;
+    }
+#endif
+
+    p = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return p;
+    q = (char*)(((unsigned long)p + size - 1) & ~(size - 1));
+    if(q > p)
+        munmap(p, q - p);
+    if(q + size < p + 2 * size)
+        munmap(q + size, p + 2 * size - (q + size));
+
+#ifdef HAVE_HUGE_PAGES
+    if(chunkHugePages) {
+        /* Failure is harmless -- we just get small pages. */
+        madvise(q, size, MADV_HUGEPAGE);
+    }
+#endif
+    return q;
 }
 static int
 free_arena(void *addr, size_t size)
@@ -280,18 +553,51 @@ typedef unsigned long long ChunkBitmap;
 
 #endif
 
-#define ARENA_CHUNKS ((unsigned)sizeof(ChunkBitmap) * 8)
+#define BITMAP_BITS ((unsigned)sizeof(ChunkBitmap) * 8)
 #define EMPTY_BITMAP (~(ChunkBitmap)0)
 #define BITMAP_BIT(i) (((ChunkBitmap)1) << (i))
 
+/* With huge pages, an arena fills exactly one huge page, and its
+   bitmap is made of multiple words. */
+#ifdef HAVE_HUGE_PAGES
+#define ARENA_WORDS \
+    (HUGE_PAGE_SIZE / CHUNK_SIZE > BITMAP_BITS ? \
+     HUGE_PAGE_SIZE / CHUNK_SIZE / BITMAP_BITS : 1)
+#else
+#define ARENA_WORDS 1
+#endif
+#define ARENA_CHUNKS (ARENA_WORDS * BITMAP_BITS)
+
+#define ARENA_SIZE (ARENA_CHUNKS * CHUNK_SIZE)
+#define ARENA_BASE(chunk) \
+    ((char*)((unsigned long)(chunk) & ~((unsigned long)ARENA_SIZE - 1)))
+
 static int pagesize;
+/* Small buffers are carved out of chunks, called slabs, each of which
+   holds buffers of a single size class. */
+#define SMALL_CLASSES 4
+#define SMALL_SIZE(class) (CHUNK_SIZE >> ((class) + 1))
+#define SMALL_SLOTS(class) (2 << (class))
+
+typedef struct _ChunkSlab {
+    char *chunk;
+    unsigned short bitmap;
+    unsigned short class;
+    struct _ChunkSlab *next, *previous;
+} ChunkSlabRec, *ChunkSlabPtr;
+
 typedef struct _ChunkArena {
-    ChunkBitmap bitmap;
+    unsigned int free;
+    ChunkBitmap bitmap[ARENA_WORDS];
     char *chunks;
+    ChunkSlabPtr *slabs;
 } ChunkArenaRec, *ChunkArenaPtr;
 
+/* Slabs with at least one free buffer. */
+static ChunkSlabPtr partialSlabs[SMALL_CLASSES];
+
 static ChunkArenaPtr chunkArenas, currentArena;
-static int numArenas;
+static int numArenas, mappedArenas;
 #define CHUNK_IN_ARENA(chunk, arena)                                    \
     ((arena)->chunks &&                                                 \
      (char*)(chunk) >= (arena)->chunks &&                               \
@@ -301,13 +607,114 @@ static int numArenas;
     ((unsigned)((unsigned long)(((char*)(chunk) - (arena)->chunks)) /   \
                 CHUNK_SIZE))
 
+/* Mapped arenas are indexed by address in an open-addressing hash
+   table of arena numbers, with -1 marking empty slots. */
+static int *arenaTable;
+static unsigned arenaTableMask;
+
+/* Arenas with at least one free chunk (including unmapped arenas) are
+   marked in freeArenas, and non-empty words of freeArenas are marked
+   in freeArenasSummary. */
+static ChunkBitmap *freeArenas, *freeArenasSummary;
+static int freeArenasWords, freeArenasSummaryWords;
+
+static unsigned
+arenaHash(char *chunks)
+{
+    unsigned long h = (unsigned long)chunks / ARENA_SIZE;
+    h ^= h >> 16;
+    return (unsigned)(h * 0x9E3779B1UL) & arenaTableMask;
+}
+
+static void
+arenaTableInsert(int n)
+{
+    unsigned h = arenaHash(chunkArenas[n].chunks);
+    while(arenaTable[h] >= 0)
+        h = (h + 1) & arenaTableMask;
+    arenaTable[h] = n;
+}
+
+static void
+arenaTableRemove(int n)
+{
+    unsigned h = arenaHash(chunkArenas[n].chunks), i, j;
+
+    while(arenaTable[h] != n) {
+        assert(arenaTable[h] >= 0);
+        h = (h + 1) & arenaTableMask;
+    }
+
+    /* Shift back any entries that would become unreachable. */
+    i = h;
+    j = h;
+    while(1) {
+        unsigned k;
+        j = (j + 1) & arenaTableMask;
+        if(arenaTable[j] < 0)
+            break;
+        k = arenaHash(chunkArenas[arenaTable[j]].chunks);
+        if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            arenaTable[i] = arenaTable[j];
+            i = j;
+        }
+    }
+    arenaTable[i] = -1;
+}
+
+static ChunkArenaPtr
+arenaTableFind(void *chunk)
+{
+    char *base = ARENA_BASE(chunk);
+    unsigned h = arenaHash(base);
+
+    while(1) {
+        assert(arenaTable[h] >= 0);
+        if(chunkArenas[arenaTable[h]].chunks == base)
+            return &chunkArenas[arenaTable[h]];
+        h = (h + 1) & arenaTableMask;
+    }
+}
+
+static void
+markArenaFree(int n, int free)
+{
+    int w = n / BITMAP_BITS;
+    if(free) {
+        freeArenas[w] |= BITMAP_BIT(n % BITMAP_BITS);
+        freeArenasSummary[w / BITMAP_BITS] |= BITMAP_BIT(w % BITMAP_BITS);
+    } else {
+        freeArenas[w] &= ~BITMAP_BIT(n % BITMAP_BITS);
+        if(freeArenas[w] == 0)
+            freeArenasSummary[w / BITMAP_BITS] &=
+                ~BITMAP_BIT(w % BITMAP_BITS);
+    }
+}
+
 void
 initChunks(void)
 {
-    int i;
+    int i, j;
     used_chunks = 0;
     initChunksCommon();
     pagesize = getpagesize();
+#ifdef HAVE_HUGE_PAGES
+    if(chunkHugePages) {
+        FILE *f;
+        long size = 0;
+        f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+        if(f) {
+            if(fscanf(f, "%ld", &size) != 1)
+                size = 0;
+            fclose(f);
+        }
+        if(size != 0 && size != HUGE_PAGE_SIZE) {
+            do_log(L_WARN, "Huge pages are %ld bytes, not %d; "
+                   "disabling chunkHugePages.\n", size, HUGE_PAGE_SIZE);
+            chunkHugePages = 0;
+        }
+    }
+#endif
     if((CHUNK_SIZE * ARENA_CHUNKS) % pagesize != 0) {
         do_log(L_ERROR,
                "The arena size %d (%d x %d) "
@@ -318,32 +725,51 @@ initChunks(void)
     numArenas = 
         (CHUNKS(chunkHighMark) + (ARENA_CHUNKS - 1)) / ARENA_CHUNKS;
     chunkArenas = malloc(numArenas * sizeof(ChunkArenaRec));
-    if(chunkArenas == NULL) {
+    arenaTableMask = (1 << log2_ceil(2 * numArenas)) - 1;
+    arenaTable = malloc((arenaTableMask + 1) * sizeof(int));
+    freeArenasWords = (numArenas + BITMAP_BITS - 1) / BITMAP_BITS;
+    freeArenasSummaryWords =
+        (freeArenasWords + BITMAP_BITS - 1) / BITMAP_BITS;
+    freeArenas = calloc(freeArenasWords, sizeof(ChunkBitmap));
+    freeArenasSummary = calloc(freeArenasSummaryWords, sizeof(ChunkBitmap));
+    if(chunkArenas == NULL || arenaTable == NULL ||
+       freeArenas == NULL || freeArenasSummary == NULL) {
         do_log(L_ERROR, "Couldn't allocate chunk arenas.\n");
         exit (1);
     }
     for(i = 0; i < numArenas; i++) {
-        chunkArenas[i].bitmap = EMPTY_BITMAP;
+        chunkArenas[i].free = ARENA_CHUNKS;
+        for(j = 0; j < ARENA_WORDS; j++)
+            chunkArenas[i].bitmap[j] = EMPTY_BITMAP;
         chunkArenas[i].chunks = NULL;
+        chunkArenas[i].slabs = NULL;
+        markArenaFree(i, 1);
     }
+    for(i = 0; i <= arenaTableMask; i++)
+        arenaTable[i] = -1;
+    mappedArenas = 0;
     currentArena = NULL;
 }
 
+/* Returns the lowest-numbered arena with a free chunk, which keeps
+   the high arenas empty so that they can be released. */
 static ChunkArenaPtr
 findArena()
 {
     ChunkArenaPtr arena = NULL;
-    int i;
+    int i, w;
 
-    for(i = 0; i < numArenas; i++) {
-        arena = &(chunkArenas[i]);
-        if(arena->bitmap != 0)
+    for(i = 0; i < freeArenasSummaryWords; i++) {
+        if(freeArenasSummary[i] != 0)
             break;
-        else
-            arena = NULL;
     }
 
-    assert(arena != NULL);
+    assert(i < freeArenasSummaryWords);
+
+    w = i * BITMAP_BITS + BITMAP_FFS(freeArenasSummary[i]) - 1;
+    i = w * BITMAP_BITS + BITMAP_FFS(freeArenas[w]) - 1;
+    arena = &(chunkArenas[i]);
+    assert(arena->free > 0);
 
     if(!arena->chunks) {
         void *p;
@@ -354,17 +780,35 @@ findArena()
             return NULL;
         }
         arena->chunks = p;
+        arenaTableInsert(i);
+        mappedArenas++;
     }
     return arena;
 }
 
+static void *
+arena_get_chunk(ChunkArenaPtr arena)
+{
+    unsigned i, j;
+
+    for(j = 0; j < ARENA_WORDS - 1; j++)
+        if(arena->bitmap[j] != 0)
+            break;
+    i = BITMAP_FFS(arena->bitmap[j]) - 1;
+    arena->bitmap[j] &= ~BITMAP_BIT(i);
+    arena->free--;
+    if(arena->free == 0)
+        markArenaFree(arena - chunkArenas, 0);
+    used_chunks++;
+    return arena->chunks + CHUNK_SIZE * (j * BITMAP_BITS + i);
+}
+
 void *
 get_chunk()
 {
-    unsigned i;
     ChunkArenaPtr arena = NULL;
 
-    if(currentArena && currentArena->bitmap != 0) {
+    if(currentArena && currentArena->free > 0) {
         arena = currentArena;
     } else {
         if(used_chunks >= CHUNKS(chunkHighMark))
@@ -378,19 +822,15 @@ get_chunk()
             return NULL;
         currentArena = arena;
     }
-    i = BITMAP_FFS(arena->bitmap) - 1;
-    arena->bitmap &= ~BITMAP_BIT(i);
-    used_chunks++;
-    return arena->chunks + CHUNK_SIZE * i;
+    return arena_get_chunk(arena);
 }
 
 void *
 maybe_get_chunk()
 {
-    unsigned i;
     ChunkArenaPtr arena = NULL;
 
-    if(currentArena && currentArena->bitmap != 0) {
+    if(currentArena && currentArena->free > 0) {
         arena = currentArena;
     } else {
         if(used_chunks >= CHUNKS(chunkHighMark))
@@ -401,12 +841,12 @@ maybe_get_chunk()
             return NULL;
         currentArena = arena;
     }
-    i = BITMAP_FFS(arena->bitmap) - 1;
-    arena->bitmap &= ~BITMAP_BIT(i);
-    used_chunks++;
-    return arena->chunks + CHUNK_SIZE * i;
+    return arena_get_chunk(arena);
 }
 
+static void dispose_small_chunk(ChunkArenaPtr arena, ChunkSlabPtr slab,
+                                void *chunk);
+
 void
 dispose_chunk(void *chunk)
 {
@@ -418,17 +858,20 @@ dispose_chunk(void *chunk)
     if(currentArena && CHUNK_IN_ARENA(chunk, currentArena)) {
         arena = currentArena;
     } else {
-        for(i = 0; i < numArenas; i++) {
-            arena = &(chunkArenas[i]);
-            if(CHUNK_IN_ARENA(chunk, arena))
-                break;
-        }
-        assert(arena != NULL);
+        arena = arenaTableFind(chunk);
         currentArena = arena;
     }
 
     i = CHUNK_ARENA_INDEX(chunk, arena);
-    arena->bitmap |= BITMAP_BIT(i);
+    if(arena->slabs && arena->slabs[i]) {
+        dispose_small_chunk(arena, arena->slabs[i], chunk);
+        return;
+    }
+    assert(!(arena->bitmap[i / BITMAP_BITS] & BITMAP_BIT(i % BITMAP_BITS)));
+    if(arena->free == 0)
+        markArenaFree(arena - chunkArenas, 1);
+    arena->bitmap[i / BITMAP_BITS] |= BITMAP_BIT(i % BITMAP_BITS);
+    arena->free++;
     used_chunks--;
 }
 
@@ -440,30 +883,135 @@ free_chunk_arenas()
 
     for(i = 0; i < numArenas; i++) {
         arena = &(chunkArenas[i]);
-        if(arena->bitmap == EMPTY_BITMAP && arena->chunks) {
+        if(arena->free == ARENA_CHUNKS && arena->chunks) {
+            arenaTableRemove(i);
             rc = free_arena(arena->chunks, CHUNK_SIZE * ARENA_CHUNKS);
             if(rc < 0) {
                 do_log_error(L_ERROR, errno, "Couldn't unmap memory");
+                arenaTableInsert(i);
                 continue;
             }
             arena->chunks = NULL;
+            mappedArenas--;
+            if(arena->slabs) {
+                free(arena->slabs);
+                arena->slabs = NULL;
+            }
         }
     }
     if(currentArena && currentArena->chunks == NULL)
         currentArena = NULL;
 }
 
-int
-totalChunkArenaSize()
+static void
+unlink_slab(ChunkSlabPtr slab)
+{
+    if(slab->previous)
+        slab->previous->next = slab->next;
+    else
+        partialSlabs[slab->class] = slab->next;
+    if(slab->next)
+        slab->next->previous = slab->previous;
+    slab->next = slab->previous = NULL;
+}
+
+static void
+link_slab(ChunkSlabPtr slab)
+{
+    slab->previous = NULL;
+    slab->next = partialSlabs[slab->class];
+    if(slab->next)
+        slab->next->previous = slab;
+    partialSlabs[slab->class] = slab;
+}
+
+/* Returns a buffer of at least size bytes, or NULL if size is more than
+   half a chunk or we're out of memory, in which case the caller should
+   just keep using a full chunk. */
+void *
+get_small_chunk(int size)
 {
     ChunkArenaPtr arena;
-    int i, size = 0;
+    ChunkSlabPtr slab;
+    int class, i;
 
-    for(i = 0; i < numArenas; i++) {
-        arena = &(chunkArenas[i]);
-        if(arena->chunks)
-            size += (CHUNK_SIZE * ARENA_CHUNKS);
+    if(size > SMALL_SIZE(0))
+        return NULL;
+
+    class = 0;
+    while(class < SMALL_CLASSES - 1 && size <= SMALL_SIZE(class + 1))
+        class++;
+
+    slab = partialSlabs[class];
+    if(slab == NULL) {
+        char *chunk;
+        chunk = maybe_get_chunk();
+        if(chunk == NULL)
+            return NULL;
+        arena = arenaTableFind(chunk);
+        if(arena->slabs == NULL) {
+            arena->slabs = calloc(ARENA_CHUNKS, sizeof(ChunkSlabPtr));
+            if(arena->slabs == NULL) {
+                dispose_chunk(chunk);
+                return NULL;
+            }
+        }
+        slab = malloc(sizeof(ChunkSlabRec));
+        if(slab == NULL) {
+            dispose_chunk(chunk);
+            return NULL;
+        }
+        slab->chunk = chunk;
+        slab->class = class;
+        slab->bitmap = (1 << SMALL_SLOTS(class)) - 1;
+        arena->slabs[CHUNK_ARENA_INDEX(chunk, arena)] = slab;
+        link_slab(slab);
     }
-    return size;
+
+    i = BITMAP_FFS((ChunkBitmap)slab->bitmap) - 1;
+    slab->bitmap &= ~(1 << i);
+    if(slab->bitmap == 0)
+        unlink_slab(slab);
+    return slab->chunk + i * SMALL_SIZE(class);
+}
+
+static void
+dispose_small_chunk(ChunkArenaPtr arena, ChunkSlabPtr slab, void *chunk)
+{
+    int i = ((char*)chunk - slab->chunk) / SMALL_SIZE(slab->class);
+
+    assert(!(slab->bitmap & (1 << i)));
+    if(slab->bitmap == 0)
+        link_slab(slab);
+    slab->bitmap |= (1 << i);
+
+    if(slab->bitmap == (1 << SMALL_SLOTS(slab->class)) - 1) {
+        unlink_slab(slab);
+        arena->slabs[CHUNK_ARENA_INDEX(slab->chunk, arena)] = NULL;
+        dispose_chunk(slab->chunk);
+        free(slab);
+    }
+}
+
+int
+chunk_capacity(void *chunk)
+{
+    ChunkArenaPtr arena;
+    ChunkSlabPtr slab;
+
+    if(currentArena && CHUNK_IN_ARENA(chunk, currentArena))
+        arena = currentArena;
+    else
+        arena = arenaTableFind(chunk);
+    if(arena->slabs == NULL)
+        return CHUNK_SIZE;
+    slab = arena->slabs[CHUNK_ARENA_INDEX(chunk, arena)];
+    return slab ? SMALL_SIZE(slab->class) : CHUNK_SIZE;
+}
+
+int
+totalChunkArenaSize()
+{
+    return mappedArenas * CHUNK_SIZE * ARENA_CHUNKS;
 }
 #endif
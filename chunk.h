@@ -43,9 +43,12 @@ extern int used_chunks;
 
 void preinitChunks(void);
 void initChunks(void);
+void initMemoryPressure(void);
 void *get_chunk(void) ATTRIBUTE ((malloc));
 void *maybe_get_chunk(void) ATTRIBUTE ((malloc));
 
 void dispose_chunk(void *chunk);
+void *get_small_chunk(int size) ATTRIBUTE ((malloc));
+int chunk_capacity(void *chunk);
 void free_chunk_arenas(void);
 int totalChunkArenaSize(void);
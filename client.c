@@ -98,7 +98,7 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
                                 sizeof(connection), &connection);
     if(!timeout) {
         CLOSE(fd);
-        free(connection);
+        httpFreeConnection(connection);
         return 0;
     }
 
@@ -279,7 +279,7 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
             lingeringClose(connection->fd);
     }
     connection->fd = -1;
-    free(connection);
+    httpFreeConnection(connection);
 }
 
 /* Extremely baroque implementation of close: we need to synchronise
@@ -908,7 +908,10 @@ httpClientRequestContinue(int forbidden_code, AtomPtr url,
             object->flags |= OBJECT_LINEAR;
     } else {
         object = findObject(OBJECT_HTTP, url->string, url->length);
-        if(!object)
+        objectLookups++;
+        if(object)
+            objectHits++;
+        else
             object = makeObject(OBJECT_HTTP, url->string, url->length, 1, 1,
                                 requestfn, NULL);
     }
@@ -1081,7 +1084,7 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     int serveNow = (request == connection->request);
     int validate = 0;
     int conditional = 0;
-    int local, haveData;
+    int local, haveData, onDisk;
     int rc;
 
     assert(!request->chandler);
@@ -1133,8 +1136,11 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     }
 
     local = urlIsLocal(object->key, object->key_size);
-    objectFillFromDisk(object, request->from,
-                       request->method == METHOD_HEAD ? 0 : 1);
+    /* Don't read the data if it will be sent straight from disk. */
+    objectFillFromDisk(object, request->from, 0);
+    onDisk = request->method != METHOD_HEAD && diskEntryMaySendfile(object);
+    if(request->method != METHOD_HEAD && !onDisk)
+        objectFillFromDisk(object, request->from, 1);
 
     /* The spec doesn't strictly forbid 206 for non-200 instances, but doing
        that breaks some client software. */
@@ -1159,7 +1165,7 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     if(request->method == METHOD_HEAD)
         haveData = !(request->object->flags & OBJECT_INITIAL);
     else
-        haveData = 
+        haveData = onDisk ||
             (request->object->length >= 0 && 
              request->object->length <= request->from) ||
             (objectHoleSize(request->object, request->from) == 0);
@@ -1177,7 +1183,7 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
             !(object->flags & OBJECT_INPROGRESS) &&
             !relaxTransparency)
         validate = 1;
-    else if(request->method != METHOD_HEAD &&
+    else if(request->method != METHOD_HEAD && !onDisk &&
             !objectHasData(object, request->from, request->to) &&
             !(object->flags & OBJECT_INPROGRESS))
         validate = 1;
@@ -1631,7 +1637,8 @@ httpServeObject(HTTPConnectionPtr connection)
 
     objectFillFromDisk(object, request->from,
                        (request->method == METHOD_HEAD ||
-                        condition_result != CONDITION_MATCH) ? 0 : 1);
+                        condition_result != CONDITION_MATCH ||
+                        diskEntryMaySendfile(object)) ? 0 : 1);
 
     if(((object->flags & OBJECT_LINEAR) &&
         (object->requestor != connection->request)) ||
@@ -1871,6 +1878,107 @@ httpServeObjectFinishHandler(int status,
     return 1;
 }
 
+#ifdef HAVE_SENDFILE
+
+/* The most data sent in one go, so that other clients get to run. */
+#define SENDFILE_MAX (256 * 1024)
+
+typedef struct _SendfileRequest {
+    HTTPConnectionPtr connection;
+    int fd;
+    off_t position;
+    int to;
+} SendfileRequestRec, *SendfileRequestPtr;
+
+static int
+httpServeObjectSendfileHandler(int status, FdEventHandlerPtr event)
+{
+    SendfileRequestPtr srequest = (SendfileRequestPtr)&event->data;
+    HTTPConnectionPtr connection = srequest->connection;
+    int rc;
+
+    if(status == 0) {
+        do {
+            rc = sendfile(connection->fd, srequest->fd, &srequest->position,
+                          MIN(srequest->to - connection->offset,
+                              SENDFILE_MAX));
+        } while(rc < 0 && errno == EINTR);
+        if(rc > 0) {
+            connection->offset += rc;
+            httpSetTimeout(connection, clientTimeout);
+            if(connection->offset < srequest->to)
+                return 0;
+        } else if(rc < 0 && errno == EAGAIN) {
+            return 0;
+        } else if(rc == 0) {
+            do_log(L_ERROR, "Disk entry shorter than expected.\n");
+            status = -EIO;
+        } else {
+            status = errno == EPIPE ? 1 : -errno;
+        }
+    }
+
+    close(srequest->fd);
+    httpSetTimeout(connection, -1);
+
+    if(status) {
+        if(status < 0) {
+            do_log_error(status == -ECONNRESET ? D_IO : L_ERROR,
+                         -status, "Couldn't write to client");
+            if(status == -EIO || status == -ESHUTDOWN)
+                httpClientFinish(connection, 2);
+            else
+                httpClientFinish(connection, 1);
+        } else {
+            do_log(D_IO, "Couldn't write to client: short write.\n");
+            httpClientFinish(connection, 2);
+        }
+        return 1;
+    }
+
+    connection->request->flags &= ~REQUEST_REQUESTED;
+    httpClientFinish(connection, 0);
+    return 1;
+}
+
+/* Send the rest of an object that is complete on disk straight from
+   its file, without going through chunk memory.  Returns 0 if the
+   object should be served from chunks. */
+static int
+httpServeChunkSendfile(HTTPConnectionPtr connection, int to)
+{
+    HTTPRequestPtr request = connection->request;
+    ObjectPtr object = request->object;
+    SendfileRequestRec srequest;
+
+    srequest.fd = diskEntrySendfileFd(object, connection->offset,
+                                      &srequest.position);
+    if(srequest.fd < 0)
+        return 0;
+    srequest.connection = connection;
+    srequest.to = to;
+
+    if(registerFdEvent(connection->fd, POLLOUT,
+                       httpServeObjectSendfileHandler,
+                       sizeof(srequest), &srequest) == NULL) {
+        close(srequest.fd);
+        return 0;
+    }
+
+    if(request->chandler) {
+        unregisterConditionHandler(request->chandler);
+        request->chandler = NULL;
+    }
+    unlockChunk(object, connection->offset / CHUNK_SIZE);
+    httpSetTimeout(connection, clientTimeout);
+    do_log(D_CLIENT_DATA, "Sending on 0x%lx for 0x%lx: offset %d len %d\n",
+           (unsigned long)connection, (unsigned long)object,
+           connection->offset, to - connection->offset);
+    return 1;
+}
+
+#endif
+
 int
 httpServeChunk(HTTPConnectionPtr connection)
 {
@@ -1902,7 +2010,13 @@ httpServeChunk(HTTPConnectionPtr connection)
 
     if(request->method != METHOD_HEAD && 
        len < CHUNK_SIZE && connection->offset + len < to) {
-        objectFillFromDisk(object, connection->offset + len, 2);
+#ifdef HAVE_SENDFILE
+        /* Don't bring data that is not in memory into chunks. */
+        if(j + len < CHUNK_SIZE && connection->te != TE_CHUNKED &&
+           httpServeChunkSendfile(connection, to))
+            return 1;
+#endif
+        objectFillFromDiskAsync(object, connection->offset + len, 2);
         len = object->chunks[i].size - j;
     }
 
@@ -1938,6 +2052,9 @@ httpServeChunk(HTTPConnectionPtr connection)
                     goto fail;
                 }
             }
+            /* A disk thread will notify us. */
+            if(object->flags & OBJECT_DISK_READING)
+                return 1;
             if(!(object->flags & OBJECT_INPROGRESS)) {
                 if(object->flags & OBJECT_SUPERSEDED) {
                     goto fail;
@@ -1952,8 +2069,8 @@ httpServeChunk(HTTPConnectionPtr connection)
         }
     } else {
         /* len > 0 */
-        if(request->method != METHOD_HEAD)
-            objectFillFromDisk(object, (i + 1) * CHUNK_SIZE, 1);
+        if(request->method != METHOD_HEAD && !diskEntryMaySendfile(object))
+            objectFillFromDiskAsync(object, (i + 1) * CHUNK_SIZE, 1);
         if(request->chandler) {
             unregisterConditionHandler(request->chandler);
             request->chandler = NULL;
@@ -1972,8 +2089,9 @@ httpServeChunk(HTTPConnectionPtr connection)
             end = 1;
         else
             end = 0;
-        /* Prefetch */
-        if(!(object->flags & OBJECT_INPROGRESS) && !REQUEST_SIDE(request)) {
+        /* Prefetch, unless the data is coming from disk */
+        if(!(object->flags & (OBJECT_INPROGRESS | OBJECT_DISK_READING)) &&
+           !REQUEST_SIDE(request)) {
             if(object->chunks[i].size < CHUNK_SIZE &&
                to >= 0 && connection->offset + len + 1 < to)
                 object->request(object, request->method,
@@ -39,6 +39,7 @@ int numDiskEntries = 0;
 int diskCacheDirectoryPermissions = 0700;
 int diskCacheFilePermissions = 0600;
 int diskCacheWriteoutOnClose = (64 * 1024);
+int diskCacheReadAhead = (64 * 1024);
 
 int maxDiskCacheEntrySize = -1;
 
@@ -47,6 +48,20 @@ int diskCacheTruncateTime = 4 * 24 * 60 * 60 + 12 * 60 * 60;
 int diskCacheTruncateSize =  1024 * 1024;
 int preciseExpiry = 0;
 
+int diskCacheSegments = 0;
+int diskCacheSegmentSize = 8 * 1024 * 1024;
+int maxSegmentEntrySize = 64 * 1024;
+int diskCacheIndex = 0;
+#ifdef HAVE_DISK_THREADS
+int diskReadThreads = 0;
+#endif
+#ifdef HAVE_SENDFILE
+int diskCacheSendfileSize = 256 * 1024;
+#endif
+
+/* The largest number of chunks transferred in a single system call. */
+#define DISK_IOV 64
+
 static DiskCacheEntryRec negativeEntry = {
     NULL, NULL,
     -1, -1, -1, -1, 0, 0, NULL, NULL
@@ -63,6 +78,12 @@ static DiskCacheEntryRec negativeEntry = {
 static int maxDiskEntriesSetter(ConfigVariablePtr, void*);
 static int atomSetterFlush(ConfigVariablePtr, void*);
 static int reallyWriteoutToDisk(ObjectPtr object, int upto, int max);
+static int diskIndexReady(void);
+static int isInternalPath(const char *path);
+static int diskIndexMayHaveFile(ObjectPtr object);
+static void diskIndexNoteFile(ObjectPtr object, int size);
+static int diskReadStart(ObjectPtr object, DiskCacheEntryPtr entry,
+                         int offset, int chunks);
 
 void 
 preinitDiskcache()
@@ -79,6 +100,9 @@ preinitDiskcache()
     CONFIG_VARIABLE_SETTABLE(diskCacheWriteoutOnClose, CONFIG_INT,
                              configIntSetter,
                              "Number of bytes to write out eagerly.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheReadAhead, CONFIG_INT,
+                             configIntSetter,
+                             "Number of bytes to read from disk at a time.");
     CONFIG_VARIABLE_SETTABLE(diskCacheRoot, CONFIG_ATOM, atomSetterFlush,
                              "Root of the disk cache.");
     CONFIG_VARIABLE_SETTABLE(localDocumentRoot, CONFIG_ATOM, atomSetterFlush,
@@ -96,6 +120,23 @@ preinitDiskcache()
     CONFIG_VARIABLE_SETTABLE(maxDiskCacheEntrySize, CONFIG_INT,
                              configIntSetter,
                              "Maximum size of objects cached on disk.");
+    CONFIG_VARIABLE(diskCacheSegments, CONFIG_INT,
+                    "Number of segment files for small objects.");
+    CONFIG_VARIABLE(diskCacheSegmentSize, CONFIG_INT,
+                    "Size of a disk cache segment.");
+    CONFIG_VARIABLE(maxSegmentEntrySize, CONFIG_INT,
+                    "Maximum size of objects stored in segments.");
+    CONFIG_VARIABLE(diskCacheIndex, CONFIG_BOOLEAN,
+                    "Whether to keep track of on-disk files in an index.");
+#ifdef HAVE_DISK_THREADS
+    CONFIG_VARIABLE(diskReadThreads, CONFIG_INT,
+                    "Number of threads reading from the on-disk cache.");
+#endif
+#ifdef HAVE_SENDFILE
+    CONFIG_VARIABLE_SETTABLE(diskCacheSendfileSize, CONFIG_INT,
+                             configIntSetter,
+                             "Minimum size of instances sent with sendfile.");
+#endif
 }
 
 static int
@@ -198,6 +239,8 @@ initDiskcache()
         releaseAtom(localDocumentRoot);
         localDocumentRoot = NULL;
     }
+
+    diskIndexReady();
 }
 
 #ifdef DEBUG_DISK_CACHE
@@ -288,6 +331,58 @@ entrySeek(DiskCacheEntryPtr entry, off_t offset)
     return 1;
 }
 
+/* Read or write a run of chunks at the given position in the file.
+   With preadv and pwritev, this doesn't move the file position, so
+   entry->offset remains valid. */
+
+static int
+entryReadv(DiskCacheEntryPtr entry, struct iovec *iov, int n, off_t offset)
+{
+    int rc;
+#ifdef HAVE_PREADV
+    do {
+        rc = preadv(entry->fd, iov, n, offset);
+    } while(rc < 0 && errno == EINTR);
+    return rc;
+#else
+    rc = entrySeek(entry, offset);
+    if(rc < 0)
+        return -1;
+    do {
+        rc = READV(entry->fd, iov, n);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0)
+        entry->offset = -1;
+    else
+        entry->offset += rc;
+    return rc;
+#endif
+}
+
+static int
+entryWritev(DiskCacheEntryPtr entry, struct iovec *iov, int n, off_t offset)
+{
+    int rc;
+#ifdef HAVE_PREADV
+    do {
+        rc = pwritev(entry->fd, iov, n, offset);
+    } while(rc < 0 && errno == EINTR);
+    return rc;
+#else
+    rc = entrySeek(entry, offset);
+    if(rc < 0)
+        return -1;
+    do {
+        rc = WRITEV(entry->fd, iov, n);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0)
+        entry->offset = -1;
+    else
+        entry->offset += rc;
+    return rc;
+#endif
+}
+
 /* Given a local URL, constructs the filename where it can be found. */
 
 int
@@ -561,6 +656,36 @@ chooseBodyOffset(int n, ObjectPtr object)
     return body_offset;
 }
  
+/* Format the headers of a disk entry into buf, without the final
+   blank line.  Returns -1 if buf is too small. */
+static int
+formatEntryHeaders(char *buf, int bufsize, ObjectPtr object)
+{
+    int n;
+
+    n = snnprintf(buf, 0, bufsize, "HTTP/1.1 %3d %s",
+                  object->code, object->message->string);
+
+    n = httpWriteObjectHeaders(buf, n, bufsize, object, 0, -1);
+    if(n < 0)
+        return -1;
+
+    n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Location: ");
+    n = snnprint_n(buf, n, bufsize, object->key, object->key_size);
+
+    if(object->age >= 0 && object->age != object->date) {
+        n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Date: ");
+        n = format_time(buf, n, bufsize, object->age);
+    }
+
+    if(object->atime >= 0) {
+        n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Access: ");
+        n = format_time(buf, n, bufsize, object->atime);
+    }
+
+    return n;
+}
+
 /* Assumes the file descriptor is at offset 0.  Returns -1 on failure,
    otherwise the offset at which the file descriptor is left. */
 /* If chunk is not null, it should be the first chunk of the object,
@@ -596,26 +721,7 @@ writeHeaders(int fd, int *body_offset_return,
     }
 
  format_again:
-    n = snnprintf(buf, 0, bufsize, "HTTP/1.1 %3d %s",
-                  object->code, object->message->string);
-
-    n = httpWriteObjectHeaders(buf, n, bufsize, object, 0, -1);
-    if(n < 0)
-        goto overflow;
-
-    n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Location: ");
-    n = snnprint_n(buf, n, bufsize, object->key, object->key_size);
-
-    if(object->age >= 0 && object->age != object->date) {
-        n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Date: ");
-        n = format_time(buf, n, bufsize, object->age);
-    }
-
-    if(object->atime >= 0) {
-        n = snnprintf(buf, n, bufsize, "\r\nX-Polipo-Access: ");
-        n = format_time(buf, n, bufsize, object->atime);
-    }
-
+    n = formatEntryHeaders(buf, bufsize, object);
     if(n < 0)
         goto overflow;
 
@@ -841,22 +947,18 @@ validateLocalEntry(ObjectPtr object, int fd,
     return 0;
 }
 
-/* Assumes fd is at offset 0.
-   Returns -1 if not valid, 1 if metadata should be written out, 0
-   otherwise. */
-int
-validateEntry(ObjectPtr object, int fd, 
-              int *body_offset_return, off_t *offset_return)
+/* Parse the headers of a disk entry, which take the first n bytes of
+   buf, and merge them into object.  Returns -1 if not valid, 1 if
+   metadata should be written out, 0 otherwise. */
+static int
+parseEntryHeaders(ObjectPtr object, char *buf, int n, int *body_offset_return)
 {
-    char *buf;
-    int buf_is_chunk, bufsize;
-    int rc, n;
+    int rc;
     int dummy;
     int code;
     AtomPtr headers;
     time_t date, last_modified, expires, polipo_age, polipo_access;
     int length;
-    off_t offset = -1;
     int body_offset;
     char *etag;
     AtomPtr via;
@@ -865,78 +967,15 @@ validateEntry(ObjectPtr object, int fd,
     AtomPtr message;
     int dirty = 0;
 
-    if(object->flags & OBJECT_LOCAL)
-        return validateLocalEntry(object, fd,
-                                  body_offset_return, offset_return);
-
-    if(!(object->flags & OBJECT_PUBLIC) && (object->flags & OBJECT_INITIAL))
-        return 0;
-
-    /* get_chunk might trigger object expiry */
-    bufsize = CHUNK_SIZE;
-    buf_is_chunk = 1;
-    buf = maybe_get_chunk();
-    if(!buf) {
-        bufsize = 2048;
-        buf_is_chunk = 0;
-        buf = malloc(2048);
-        if(buf == NULL) {
-            do_log(L_ERROR, "Couldn't allocate buffer.\n");
-            return -1;
-        }
-    }
-
- again:
-    rc = read(fd, buf, bufsize);
-    if(rc < 0) {
-        if(errno == EINTR)
-            goto again;
-        do_log_error(L_ERROR, errno, "Couldn't read disk entry");
-        goto fail;
-    }
-    offset = rc;
-
- parse_again:
-    n = findEndOfHeaders(buf, 0, rc, &dummy);
-    if(n < 0) {
-        char *oldbuf = buf;
-        if(bufsize < bigBufferSize) {
-            buf = malloc(bigBufferSize);
-            if(!buf) {
-                do_log(L_ERROR, "Couldn't allocate big buffer.\n");
-                goto fail;
-            }
-            bufsize = bigBufferSize;
-            memcpy(buf, oldbuf, offset);
-            if(buf_is_chunk)
-                dispose_chunk(oldbuf);
-            else
-                free(oldbuf);
-            buf_is_chunk = 0;
-        again2:
-            rc = read(fd, buf + offset, bufsize - offset);
-            if(rc < 0) {
-                if(errno == EINTR)
-                    goto again2;
-                do_log_error(L_ERROR, errno, "Couldn't read disk entry");
-                goto fail;
-            }
-            offset += rc;
-            goto parse_again;
-        }
-        do_log(L_ERROR, "Couldn't parse disk entry.\n");
-        goto fail;
-    }
-
     rc = httpParseServerFirstLine(buf, &code, &dummy, &message);
     if(rc < 0) {
         do_log(L_ERROR, "Couldn't parse disk entry.\n");
-        goto fail;
+        return -1;
     }
 
     if(object->code != 0 && object->code != code) {
         releaseAtom(message);
-        goto fail;
+        return -1;
     }
 
     rc = httpParseHeaders(0, NULL, buf, rc, NULL,
@@ -947,7 +986,7 @@ validateEntry(ObjectPtr object, int fd,
                           NULL, NULL, &location, &via, NULL);
     if(rc < 0) {
         releaseAtom(message);
-        goto fail;
+        return -1;
     }
     if(body_offset < 0)
         body_offset = n;
@@ -1058,26 +1097,10 @@ validateEntry(ObjectPtr object, int fd,
 
     if(object->flags & OBJECT_INITIAL) object->via = via;
     object->flags &= ~OBJECT_INITIAL;
-    if(offset > body_offset) {
-        /* We need to make sure we don't invoke object expiry recursively */
-        objectSetChunks(object, 1);
-        if(object->numchunks >= 1) {
-            if(object->chunks[0].data == NULL)
-                object->chunks[0].data = maybe_get_chunk();
-            if(object->chunks[0].data)
-                objectAddData(object, buf + body_offset,
-                              0, MIN(offset - body_offset, CHUNK_SIZE));
-        }
-    }
 
     httpTweakCachability(object);
 
-    if(buf_is_chunk)
-        dispose_chunk(buf);
-    else
-        free(buf);
-    if(body_offset_return) *body_offset_return = body_offset;
-    if(offset_return) *offset_return = offset;
+    *body_offset_return = body_offset;
     return dirty;
 
  invalid:
@@ -1085,47 +1108,150 @@ validateEntry(ObjectPtr object, int fd,
     if(etag) free(etag);
     if(location) free(location);
     if(via) releaseAtom(via);
-    /* fall through */
-
- fail:
-    if(buf_is_chunk)
-        dispose_chunk(buf);
-    else
-        free(buf);
     return -1;
 }
 
-void
-dirtyDiskEntry(ObjectPtr object)
-{
-    DiskCacheEntryPtr entry = object->disk_entry;
-    if(entry && entry != &negativeEntry) entry->metadataDirty = 1;
-}
-
+/* Assumes fd is at offset 0.
+   Returns -1 if not valid, 1 if metadata should be written out, 0
+   otherwise. */
 int
-revalidateDiskEntry(ObjectPtr object)
+validateEntry(ObjectPtr object, int fd, 
+              int *body_offset_return, off_t *offset_return)
 {
-    DiskCacheEntryPtr entry = object->disk_entry;
-    int rc;
+    char *buf;
+    int buf_is_chunk, bufsize;
+    int rc, n;
+    int dummy;
+    off_t offset = -1;
     int body_offset;
+    int dirty;
 
-    if(!entry || entry == &negativeEntry)
-        return 1;
-
-    CHECK_ENTRY(entry);
-    rc = entrySeek(entry, 0);
-    if(rc < 0) return 0;
+    if(object->flags & OBJECT_LOCAL)
+        return validateLocalEntry(object, fd,
+                                  body_offset_return, offset_return);
 
-    rc = validateEntry(object, entry->fd, &body_offset, &entry->offset);
-    if(rc < 0) {
-        destroyDiskEntry(object, 0);
+    if(!(object->flags & OBJECT_PUBLIC) && (object->flags & OBJECT_INITIAL))
         return 0;
+
+    /* get_chunk might trigger object expiry */
+    bufsize = CHUNK_SIZE;
+    buf_is_chunk = 1;
+    buf = maybe_get_chunk();
+    if(!buf) {
+        bufsize = 2048;
+        buf_is_chunk = 0;
+        buf = malloc(2048);
+        if(buf == NULL) {
+            do_log(L_ERROR, "Couldn't allocate buffer.\n");
+            return -1;
+        }
     }
-    if(body_offset != entry->body_offset) {
-        do_log(L_WARN, "Inconsistent body offset (%d != %d).\n",
-               body_offset, entry->body_offset);
-        destroyDiskEntry(object, 0);
-        return 0;
+
+ again:
+    rc = read(fd, buf, bufsize);
+    if(rc < 0) {
+        if(errno == EINTR)
+            goto again;
+        do_log_error(L_ERROR, errno, "Couldn't read disk entry");
+        goto fail;
+    }
+    offset = rc;
+
+ parse_again:
+    n = findEndOfHeaders(buf, 0, rc, &dummy);
+    if(n < 0) {
+        char *oldbuf = buf;
+        if(bufsize < bigBufferSize) {
+            buf = malloc(bigBufferSize);
+            if(!buf) {
+                do_log(L_ERROR, "Couldn't allocate big buffer.\n");
+                goto fail;
+            }
+            bufsize = bigBufferSize;
+            memcpy(buf, oldbuf, offset);
+            if(buf_is_chunk)
+                dispose_chunk(oldbuf);
+            else
+                free(oldbuf);
+            buf_is_chunk = 0;
+        again2:
+            rc = read(fd, buf + offset, bufsize - offset);
+            if(rc < 0) {
+                if(errno == EINTR)
+                    goto again2;
+                do_log_error(L_ERROR, errno, "Couldn't read disk entry");
+                goto fail;
+            }
+            offset += rc;
+            goto parse_again;
+        }
+        do_log(L_ERROR, "Couldn't parse disk entry.\n");
+        goto fail;
+    }
+
+    dirty = parseEntryHeaders(object, buf, n, &body_offset);
+    if(dirty < 0)
+        goto fail;
+
+    if(offset > body_offset) {
+        /* We need to make sure we don't invoke object expiry recursively */
+        objectSetChunks(object, 1);
+        if(object->numchunks >= 1) {
+            if(object->chunks[0].data == NULL)
+                object->chunks[0].data = maybe_get_chunk();
+            if(object->chunks[0].data)
+                objectAddData(object, buf + body_offset,
+                              0, MIN(offset - body_offset, CHUNK_SIZE));
+        }
+    }
+
+    if(buf_is_chunk)
+        dispose_chunk(buf);
+    else
+        free(buf);
+    if(body_offset_return) *body_offset_return = body_offset;
+    if(offset_return) *offset_return = offset;
+    return dirty;
+
+ fail:
+    if(buf_is_chunk)
+        dispose_chunk(buf);
+    else
+        free(buf);
+    return -1;
+}
+
+void
+dirtyDiskEntry(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    if(entry && entry != &negativeEntry) entry->metadataDirty = 1;
+}
+
+int
+revalidateDiskEntry(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int rc;
+    int body_offset;
+
+    if(!entry || entry == &negativeEntry)
+        return 1;
+
+    CHECK_ENTRY(entry);
+    rc = entrySeek(entry, 0);
+    if(rc < 0) return 0;
+
+    rc = validateEntry(object, entry->fd, &body_offset, &entry->offset);
+    if(rc < 0) {
+        destroyDiskEntry(object, 0);
+        return 0;
+    }
+    if(body_offset != entry->body_offset) {
+        do_log(L_WARN, "Inconsistent body offset (%d != %d).\n",
+               body_offset, entry->body_offset);
+        destroyDiskEntry(object, 0);
+        return 0;
     }
 
     entry->metadataDirty |= !!rc;
@@ -1199,7 +1325,7 @@ makeDiskEntry(ObjectPtr object, int create)
             return NULL;
         name_len = urlFilename(buf, 1024, object->key, object->key_size);
         if(name_len < 0) return NULL;
-        if(!negative)
+        if(!negative && diskIndexMayHaveFile(object))
             fd = open(buf, O_RDWR | O_BINARY);
         if(fd >= 0) {
             rc = validateEntry(object, fd, &body_offset, &offset);
@@ -1217,6 +1343,8 @@ makeDiskEntry(ObjectPtr object, int create)
                 }
             }
         }
+        if(fd < 0)
+            diskIndexNoteFile(object, -1);
 
         if(fd < 0 && create && name_len > 0 && 
            !(object->flags & OBJECT_INITIAL)) {
@@ -1246,6 +1374,7 @@ makeDiskEntry(ObjectPtr object, int create)
                 size = rc - body_offset;
                 offset = rc;
                 dirty = 0;
+                diskIndexNoteFile(object, size);
             }
         }
     } else {
@@ -1399,238 +1528,1976 @@ rewriteEntry(ObjectPtr object)
     return 1;
 }
             
-int
-destroyDiskEntry(ObjectPtr object, int d)
-{
-    DiskCacheEntryPtr entry = object->disk_entry;
-    int rc, urc = 1;
+/* The disk index maps the hash of a URL to the place where its
+   instance is stored: a record in a segment (see below) or, if
+   diskCacheIndex is true, a file of its own.  It also holds the
+   metadata needed to list and purge the on-disk cache, and for files
+   the URL, so that neither requires reading the cache itself.
+
+   The index is kept in the file .index under diskCacheRoot, which is
+   mapped into memory and locked while in use.  It is rebuilt from the
+   segments and files when it is missing, inconsistent, or was not
+   closed cleanly.  If it cannot be mapped, an index of the segments
+   alone is kept in memory.  Entries are kept in an open-addressed
+   table, followed by a heap holding the URLs of files. */
+
+#define DISK_INDEX_MAGIC 0x31494C50
+#define DISK_INDEX_FILE 0xFFFF
+#define DISK_INDEX_TIME(t) ((t) < 0 ? 0 : (unsigned int)(t))
+#define DISK_INDEX_UNTIME(t) ((t) == 0 ? (time_t)-1 : (time_t)(t))
+
+typedef struct _DiskIndexHeader {
+    unsigned int magic;
+    unsigned int clean;
+    unsigned int files;
+    unsigned int segments;
+    unsigned int segment_size;
+    unsigned int capacity;
+    unsigned int count;
+    unsigned int heap_size;
+    unsigned int heap_used;
+    unsigned int heap_garbage;
+    unsigned long long key[2];
+} DiskIndexHeaderRec, *DiskIndexHeaderPtr;
+
+typedef struct _DiskIndexEntry {
+    unsigned long long hash;    /* 0 if the slot is free */
+    unsigned int offset;        /* of the record, or of the URL in the heap */
+    unsigned int size;          /* of the record, or of the body on disk */
+    unsigned short segment;     /* or DISK_INDEX_FILE */
+    unsigned short key_size;    /* of the URL of a file */
+    int length;
+    unsigned int date;
+    unsigned int last_modified;
+    unsigned int expires;
+    unsigned int access;
+    unsigned int headers;       /* hash of a record's headers */
+    unsigned int reserved;
+} DiskIndexEntryRec, *DiskIndexEntryPtr;
+
+/* The segment store.  Objects no larger than maxSegmentEntrySize are
+   appended to a fixed number of large preallocated files rather than
+   being stored one per file.  A record consists of a header, the key
+   and an image of what would otherwise be the cache file: the
+   headers, a blank line and the body. */
+
+#define SEGMENT_LIVE 0x31534C50
+#define SEGMENT_DEAD 0x30534C50
+#define SEGMENT_ALIGN(n) (((n) + 7) & ~7)
+
+typedef struct _SegmentRecordHeader {
+    unsigned int magic;
+    unsigned int size;          /* of the whole record, aligned */
+    unsigned int key_size;
+    unsigned int data_size;
+} SegmentRecordHeaderRec, *SegmentRecordHeaderPtr;
+
+#define SEGMENT_HEADER_SIZE ((int)sizeof(SegmentRecordHeaderRec))
+
+typedef struct _Segment {
+    int fd;
+    unsigned int used;
+    unsigned int live;
+} SegmentRec, *SegmentPtr;
 
-    assert(!entry || !entry->local || !d);
+static DiskIndexHeaderPtr diskIndex = NULL;
+static DiskIndexEntryPtr diskIndexEntries = NULL;
+static char *diskIndexHeap = NULL;
+static size_t diskIndexMapSize = 0;
+static int diskIndexFd = -1;
+static int diskIndexFiles = 0;
+static AtomPtr diskIndexRoot = NULL;
 
-    if(d && !entry)
-        entry = makeDiskEntry(object, 0);
+static SegmentPtr segments = NULL;
+static int numSegments = 0, headSegment = -1;
 
-    CHECK_ENTRY(entry);
+static int
+readAt(int fd, void *buf, int n, unsigned int offset)
+{
+    int rc, done = 0;
 
-    if(!entry || entry == &negativeEntry) {
-        return 1;
+#ifndef HAVE_PREADV
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+#endif
+    while(done < n) {
+#ifdef HAVE_PREADV
+        rc = pread(fd, (char*)buf + done, n - done, offset + done);
+#else
+        rc = read(fd, (char*)buf + done, n - done);
+#endif
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(rc == 0)
+            break;
+        done += rc;
     }
+    return done;
+}
 
-    assert(entry->object == object);
+static int
+writeAt(int fd, const void *buf, int n, unsigned int offset)
+{
+    int rc, done = 0;
 
-    if(maxDiskCacheEntrySize >= 0 && object->size > maxDiskCacheEntrySize) {
-        /* See writeoutToDisk */
-        d = 1;
+#ifndef HAVE_PREADV
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+#endif
+    while(done < n) {
+#ifdef HAVE_PREADV
+        rc = pwrite(fd, (const char*)buf + done, n - done, offset + done);
+#else
+        rc = write(fd, (const char*)buf + done, n - done);
+#endif
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += rc;
     }
+    return done;
+}
 
-    if(d) {
-        entry->object->flags &= ~OBJECT_DISK_ENTRY_COMPLETE;
-        if(entry->filename) {
-            urc = unlink(entry->filename);
-            if(urc < 0)
-                do_log_error(L_WARN, errno, 
-                             "Couldn't unlink %s", scrub(entry->filename));
-        }
-    } else {
-        if(entry && entry->metadataDirty)
-            writeoutMetadata(object);
-        makeDiskEntry(object, 0);
-        /* rewriteDiskEntry may change the disk entry */
-        entry = object->disk_entry;
-        if(entry == NULL || entry == &negativeEntry)
-            return 0;
-        if(diskCacheWriteoutOnClose > 0) {
-            reallyWriteoutToDisk(object, -1, diskCacheWriteoutOnClose);
-            entry = object->disk_entry;
-            if(entry == NULL || entry == &negativeEntry)
-                return 0;
+static unsigned long long
+diskIndexHash(const char *key, int key_size)
+{
+    unsigned long long hash = sipHash(diskIndex->key, key, key_size);
+    return hash == 0 ? 1 : hash;
+}
+
+/* The hash of the headers of a record, not counting the access time,
+   which is kept in the index. */
+static unsigned int
+headersHash(const char *buf, int n)
+{
+    static const char access[] = "\r\nX-Polipo-Access: ";
+    int i;
+
+    for(i = n - (int)sizeof(access) + 1; i >= 0; i--) {
+        if(memcmp(buf + i, access, sizeof(access) - 1) == 0) {
+            n = i;
+            break;
         }
     }
- again:
-    rc = close(entry->fd);
-    if(rc < 0 && errno == EINTR)
-        goto again;
-
-    entry->fd = -1;
+    return (unsigned int)sipHash(diskIndex->key, buf, n);
+}
 
-    if(entry->filename)
-        free(entry->filename);
-    entry->filename = NULL;
+static unsigned int
+diskIndexSlot(unsigned long long hash)
+{
+    unsigned int mask = diskIndex->capacity - 1;
+    unsigned int i = hash & mask;
 
-    if(entry->previous)
-        entry->previous->next = entry->next;
-    else
-        diskEntries = entry->next;
-    if(entry->next)
-        entry->next->previous = entry->previous;
-    else
-        diskEntriesLast = entry->previous;
+    while(diskIndexEntries[i].hash != 0 && diskIndexEntries[i].hash != hash)
+        i = (i + 1) & mask;
+    return i;
+}
 
-    numDiskEntries--;
-    assert(numDiskEntries >= 0);
+static int
+diskIndexFind(unsigned long long hash)
+{
+    unsigned int i;
 
-    free(entry);
-    object->disk_entry = NULL;
-    if(urc < 0)
+    if(diskIndex == NULL)
         return -1;
+    i = diskIndexSlot(hash);
+    return diskIndexEntries[i].hash == hash ? (int)i : -1;
+}
+
+static void
+diskIndexUnmap()
+{
+    if(diskIndex == NULL)
+        return;
+#ifndef WIN32 /*MINGW*/
+    if(diskIndexFd >= 0)
+        munmap(diskIndex, diskIndexMapSize);
     else
-        return 1;
+#endif
+        free(diskIndex);
+    diskIndex = NULL;
+    diskIndexEntries = NULL;
+    diskIndexHeap = NULL;
+    diskIndexMapSize = 0;
 }
 
-ObjectPtr 
-objectGetFromDisk(ObjectPtr object)
+static int
+diskIndexMap(size_t size)
 {
-    DiskCacheEntryPtr entry = makeDiskEntry(object, 0);
-    if(!entry) return NULL;
-    return object;
+    void *p;
+
+    diskIndexUnmap();
+#ifndef WIN32 /*MINGW*/
+    if(diskIndexFd >= 0) {
+        if(ftruncate(diskIndexFd, size) < 0)
+            return -1;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 diskIndexFd, 0);
+        if(p == MAP_FAILED)
+            return -1;
+    } else
+#endif
+    {
+        p = calloc(size, 1);
+        if(p == NULL)
+            return -1;
+    }
+    diskIndex = p;
+    diskIndexMapSize = size;
+    diskIndexEntries = (DiskIndexEntryPtr)(diskIndex + 1);
+    return 1;
 }
 
+static void closeDiskIndex(void);
 
-int 
-objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+/* Reinsert all entries into a table of the given capacity followed by
+   a heap of the given size, which also compacts the heap. */
+static int
+diskIndexResize(unsigned int capacity, unsigned int heap_size)
 {
-    DiskCacheEntryPtr entry;
-    int rc, result;
-    int i, j, k;
-    int complete;
+    DiskIndexHeaderRec header;
+    DiskIndexEntryPtr old = NULL;
+    char *oldheap = NULL;
+    unsigned int i, j, n = 0;
+    int rc;
 
-    if(object->type != OBJECT_HTTP)
-        return 0;
+    if(diskIndex) {
+        header = *diskIndex;
+        n = header.capacity;
+        old = malloc(n * sizeof(DiskIndexEntryRec));
+        oldheap = malloc(header.heap_used + 1);
+        if(old == NULL || oldheap == NULL) {
+            do_log(L_ERROR, "Couldn't allocate disk cache index.\n");
+            free(old);
+            free(oldheap);
+            return -1;
+        }
+        memcpy(old, diskIndexEntries, n * sizeof(DiskIndexEntryRec));
+        memcpy(oldheap, diskIndexHeap, header.heap_used);
+    } else {
+        memset(&header, 0, sizeof(header));
+        header.magic = DISK_INDEX_MAGIC;
+        header.files = diskIndexFiles;
+        header.segments = numSegments;
+        header.segment_size = diskCacheSegmentSize;
+        randomBytes(header.key, sizeof(header.key));
+    }
 
-    if(object->flags & OBJECT_LINEAR)
-        return 0;
+    rc = diskIndexMap(sizeof(DiskIndexHeaderRec) +
+                      (size_t)capacity * sizeof(DiskIndexEntryRec) +
+                      heap_size);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't map disk cache index");
+        free(old);
+        free(oldheap);
+        closeDiskIndex();
+        return -1;
+    }
 
-    if(object->length >= 0) {
-        chunks = MIN(chunks, 
-                     (object->length - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    header.capacity = capacity;
+    header.count = 0;
+    header.heap_size = heap_size;
+    header.heap_used = 0;
+    header.heap_garbage = 0;
+    *diskIndex = header;
+    diskIndexHeap = (char*)(diskIndexEntries + capacity);
+    memset(diskIndexEntries, 0,
+           (size_t)capacity * sizeof(DiskIndexEntryRec) + heap_size);
+
+    for(i = 0; i < n; i++) {
+        if(old[i].hash == 0)
+            continue;
+        j = diskIndexSlot(old[i].hash);
+        diskIndexEntries[j] = old[i];
+        if(old[i].segment == DISK_INDEX_FILE) {
+            memcpy(diskIndexHeap + diskIndex->heap_used,
+                   oldheap + old[i].offset, old[i].key_size);
+            diskIndexEntries[j].offset = diskIndex->heap_used;
+            diskIndex->heap_used += old[i].key_size;
+        }
+        diskIndex->count++;
     }
+    free(old);
+    free(oldheap);
+    return 1;
+}
 
-    rc = objectSetChunks(object, offset / CHUNK_SIZE + chunks);
-    if(rc < 0)
-        return 0;
+/* Make sure that an entry can be added without resizing the index. */
+static int
+diskIndexReserve(int key_size)
+{
+    unsigned int capacity, heap_size, live;
 
-    complete = 1;
-    if(object->flags & OBJECT_INITIAL) {
-        complete = 0;
-    } else if((object->length < 0 || object->size < object->length) &&
-              object->size < (offset / CHUNK_SIZE + chunks) * CHUNK_SIZE) {
-        complete = 0;
-    } else {
-        for(k = 0; k < chunks; k++) {
-            int s;
-            i = offset / CHUNK_SIZE + k;
-            s = MIN(CHUNK_SIZE, object->size - i * CHUNK_SIZE);
-            if(object->chunks[i].size < s) {
-                complete = 0;
+    if(diskIndex == NULL || key_size > 0xFFFF)
+        return -1;
+
+    capacity = diskIndex->capacity;
+    if((diskIndex->count + 1) * 4 > capacity * 3)
+        capacity *= 2;
+    heap_size = diskIndex->heap_size;
+    live = diskIndex->heap_used - diskIndex->heap_garbage;
+    while(heap_size < (live + key_size) * 2)
+        heap_size *= 2;
+
+    if(capacity != diskIndex->capacity ||
+       heap_size != diskIndex->heap_size ||
+       diskIndex->heap_used + key_size > diskIndex->heap_size)
+        return diskIndexResize(capacity, heap_size);
+    return 1;
+}
+
+/* Add an entry, which must not already be present; space must have
+   been reserved. */
+static int
+diskIndexAdd(unsigned long long hash, int segment,
+             const char *key, int key_size)
+{
+    unsigned int i = diskIndexSlot(hash);
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+
+    assert(entry->hash == 0);
+    memset(entry, 0, sizeof(DiskIndexEntryRec));
+    entry->hash = hash;
+    entry->segment = segment;
+    entry->length = -1;
+    if(segment == DISK_INDEX_FILE) {
+        assert(diskIndex->heap_used + key_size <= diskIndex->heap_size);
+        entry->offset = diskIndex->heap_used;
+        entry->key_size = key_size;
+        memcpy(diskIndexHeap + diskIndex->heap_used, key, key_size);
+        diskIndex->heap_used += key_size;
+    }
+    diskIndex->count++;
+    return i;
+}
+
+/* Remove an entry, shifting back any entries that follow it. */
+static void
+diskIndexRemove(unsigned int i)
+{
+    unsigned int mask = diskIndex->capacity - 1;
+    unsigned int j, k;
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+
+    if(entry->segment == DISK_INDEX_FILE)
+        diskIndex->heap_garbage += entry->key_size;
+    else if(entry->segment < numSegments)
+        segments[entry->segment].live -= entry->size;
+
+    j = i;
+    while(1) {
+        j = (j + 1) & mask;
+        if(diskIndexEntries[j].hash == 0)
+            break;
+        k = diskIndexEntries[j].hash & mask;
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        diskIndexEntries[i] = diskIndexEntries[j];
+        i = j;
+    }
+    memset(&diskIndexEntries[i], 0, sizeof(DiskIndexEntryRec));
+    diskIndex->count--;
+}
+
+static void
+diskIndexNote(int i, ObjectPtr object)
+{
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+    time_t t = object->atime;
+
+    if(t < 0) t = object->age;
+    if(t < 0) t = object->date;
+    entry->length = object->length;
+    entry->date = DISK_INDEX_TIME(object->date);
+    entry->last_modified = DISK_INDEX_TIME(object->last_modified);
+    entry->expires = DISK_INDEX_TIME(object->expires);
+    if(DISK_INDEX_TIME(t) > entry->access)
+        entry->access = DISK_INDEX_TIME(t);
+}
+
+/* Fill in an entry from the headers of a record or file. */
+static void
+diskIndexNoteHeaders(int i, const char *buf, int n)
+{
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+    int rc, dummy, code, length, body_offset;
+    time_t date, last_modified, expires, age, atime;
+
+    rc = httpParseServerFirstLine(buf, &code, &dummy, NULL);
+    if(rc < 0)
+        return;
+    rc = httpParseHeaders(0, NULL, buf, rc, NULL,
+                          NULL, &length, NULL, NULL, NULL,
+                          &date, &last_modified, &expires, &age,
+                          &atime, &body_offset, NULL,
+                          NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    if(rc < 0)
+        return;
+    if(atime < 0) atime = age;
+    if(atime < 0) atime = date;
+    entry->length = length;
+    entry->date = DISK_INDEX_TIME(date);
+    entry->last_modified = DISK_INDEX_TIME(last_modified);
+    entry->expires = DISK_INDEX_TIME(expires);
+    entry->access = DISK_INDEX_TIME(atime);
+    entry->headers = headersHash(buf, n);
+}
+
+static int
+segmentTerminate(int i, unsigned int offset)
+{
+    SegmentRecordHeaderRec header;
+
+    if(offset + SEGMENT_HEADER_SIZE > (unsigned)diskCacheSegmentSize)
+        return 0;
+    memset(&header, 0, sizeof(header));
+    return writeAt(segments[i].fd, &header, sizeof(header), offset);
+}
+
+/* Mark a record as dead on disk and forget about it. */
+static void
+segmentKill(int i)
+{
+    unsigned int magic = SEGMENT_DEAD;
+    int rc;
+
+    rc = writeAt(segments[diskIndexEntries[i].segment].fd,
+                 &magic, sizeof(magic), diskIndexEntries[i].offset);
+    if(rc < 0)
+        do_log_error(L_ERROR, errno, "Couldn't kill segment record");
+    diskIndexRemove(i);
+}
+
+static void
+scanSegment(int i)
+{
+    SegmentRecordHeaderPtr header;
+    SegmentRecordHeaderRec h;
+    unsigned int offset = 0;
+    unsigned int size = diskCacheSegmentSize;
+    unsigned long long hash;
+    char *buf = NULL, *image;
+    int rc, n, dummy, slot;
+
+    while(offset + SEGMENT_HEADER_SIZE <= size) {
+        rc = readAt(segments[i].fd, &h, sizeof(h), offset);
+        if(rc < SEGMENT_HEADER_SIZE)
+            break;
+        if(h.magic != SEGMENT_LIVE && h.magic != SEGMENT_DEAD)
+            break;
+        if(h.size > size - offset || h.size % 8 != 0 ||
+           h.key_size > h.size || h.data_size > h.size ||
+           SEGMENT_HEADER_SIZE + h.key_size + h.data_size > h.size) {
+            do_log(L_WARN, "Corrupt record in disk cache segment %d "
+                   "at offset %u.\n", i, offset);
+            break;
+        }
+        if(h.magic == SEGMENT_LIVE) {
+            buf = malloc(h.size);
+            if(buf == NULL)
+                break;
+            rc = readAt(segments[i].fd, buf, h.size, offset);
+            if(rc < (int)h.size)
+                break;
+            header = (SegmentRecordHeaderPtr)buf;
+            hash = diskIndexHash(buf + SEGMENT_HEADER_SIZE, header->key_size);
+            if(diskIndexReserve(0) < 0) {
+                /* The index has been closed. */
+                free(buf);
+                return;
+            }
+            slot = diskIndexFind(hash);
+            if(slot >= 0 && diskIndexEntries[slot].segment != DISK_INDEX_FILE)
+                /* Duplicate, left over from an interrupted compaction. */
+                segmentKill(slot);
+            else if(slot >= 0)
+                diskIndexRemove(slot);
+            slot = diskIndexAdd(hash, i, NULL, 0);
+            diskIndexEntries[slot].offset = offset;
+            diskIndexEntries[slot].size = h.size;
+            segments[i].live += h.size;
+            image = buf + SEGMENT_HEADER_SIZE + header->key_size;
+            n = findEndOfHeaders(image, 0, header->data_size, &dummy);
+            if(n >= 4)
+                diskIndexNoteHeaders(slot, image, n - 4);
+            free(buf);
+            buf = NULL;
+        }
+        offset += h.size;
+    }
+    free(buf);
+    segments[i].used = offset;
+}
+
+static void
+closeSegments()
+{
+    int i;
+
+    for(i = 0; i < numSegments; i++)
+        close(segments[i].fd);
+    free(segments);
+    segments = NULL;
+    numSegments = 0;
+    headSegment = -1;
+}
+
+static void
+openSegments()
+{
+    char buf[1024];
+    struct stat ss;
+    int i, n, fd, rc;
+
+    if(diskCacheSegments > 0xFFFE || diskCacheSegmentSize < 1024 * 1024 ||
+       diskCacheSegmentSize > 1024 * 1024 * 1024) {
+        do_log(L_ERROR, "Disabling disk cache segments: "
+               "inconsistent segment configuration.\n");
+        return;
+    }
+
+    if(maxSegmentEntrySize > diskCacheSegmentSize / 8) {
+        do_log(L_WARN, "Reducing maxSegmentEntrySize to %d.\n",
+               diskCacheSegmentSize / 8);
+        maxSegmentEntrySize = diskCacheSegmentSize / 8;
+    }
+
+    n = snnprintf(buf, 0, 1024, "%s.slab", diskCacheRoot->string);
+    if(n < 0)
+        return;
+    rc = mkdir(buf, diskCacheDirectoryPermissions);
+    if(rc < 0 && errno != EEXIST) {
+        do_log_error(L_ERROR, errno, "Couldn't create directory %s", buf);
+        return;
+    }
+
+    segments = calloc(diskCacheSegments, sizeof(SegmentRec));
+    if(segments == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segments.\n");
+        return;
+    }
+
+    for(i = 0; i < diskCacheSegments; i++) {
+        rc = snnprintf(buf, n, 1024, "/segment-%03d", i);
+        if(rc < 0)
+            break;
+        fd = open(buf, O_RDWR | O_CREAT | O_BINARY, diskCacheFilePermissions);
+        if(fd < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+            break;
+        }
+        rc = fstat(fd, &ss);
+        if(rc >= 0 && ss.st_size != diskCacheSegmentSize)
+            rc = ftruncate(fd, diskCacheSegmentSize);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't size segment %s", buf);
+            close(fd);
+            break;
+        }
+        segments[i].fd = fd;
+        numSegments++;
+    }
+
+    if(numSegments == 0) {
+        free(segments);
+        segments = NULL;
+    }
+}
+
+/* Map an existing index.  Returns 0 if it cannot be trusted. */
+static int
+loadDiskIndex()
+{
+    DiskIndexHeaderRec header;
+    DiskIndexEntryPtr entry;
+    struct stat ss;
+    unsigned int i, n = 0;
+    int rc;
+
+    rc = fstat(diskIndexFd, &ss);
+    if(rc < 0 || ss.st_size < (off_t)sizeof(header))
+        return 0;
+    rc = readAt(diskIndexFd, &header, sizeof(header), 0);
+    if(rc != (int)sizeof(header) ||
+       header.magic != DISK_INDEX_MAGIC || !header.clean ||
+       header.files != diskIndexFiles || header.segments != numSegments ||
+       header.segment_size != (unsigned)diskCacheSegmentSize ||
+       header.capacity < 1024 || (header.capacity & (header.capacity - 1)) ||
+       header.count > header.capacity ||
+       header.heap_used > header.heap_size ||
+       ss.st_size != (off_t)(sizeof(header) +
+                             (size_t)header.capacity *
+                             sizeof(DiskIndexEntryRec) +
+                             header.heap_size))
+        return 0;
+
+    rc = diskIndexMap(ss.st_size);
+    if(rc < 0)
+        return 0;
+    diskIndexHeap = (char*)(diskIndexEntries + diskIndex->capacity);
+
+    for(i = 0; i < diskIndex->capacity; i++) {
+        entry = &diskIndexEntries[i];
+        if(entry->hash == 0)
+            continue;
+        n++;
+        if(entry->segment == DISK_INDEX_FILE) {
+            if(!diskIndexFiles ||
+               entry->offset + entry->key_size > diskIndex->heap_used)
+                goto fail;
+        } else {
+            if(entry->segment >= numSegments ||
+               entry->offset > (unsigned)diskCacheSegmentSize ||
+               entry->size > diskCacheSegmentSize - entry->offset)
+                goto fail;
+            segments[entry->segment].live += entry->size;
+            segments[entry->segment].used =
+                MAX(segments[entry->segment].used,
+                    entry->offset + entry->size);
+        }
+    }
+    if(n != diskIndex->count)
+        goto fail;
+    return 1;
+
+ fail:
+    for(i = 0; i < numSegments; i++)
+        segments[i].live = segments[i].used = 0;
+    diskIndexUnmap();
+    return 0;
+}
+
+static void
+indexFiles()
+{
+    char *fts_argv[2];
+    FTS *fts;
+    FTSENT *fe;
+    DiskObjectPtr dobject;
+    unsigned long long hash;
+    int i, n;
+
+    fts_argv[0] = diskCacheRoot->string;
+    fts_argv[1] = NULL;
+    fts = fts_open(fts_argv, FTS_LOGICAL, NULL);
+    if(fts == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't fts_open disk cache");
+        return;
+    }
+    while(1) {
+        fe = fts_read(fts);
+        if(!fe) break;
+        if(fe->fts_info != FTS_F || isInternalPath(fe->fts_path))
+            continue;
+        dobject = readDiskObject(fe->fts_path, fe->fts_statp);
+        if(dobject == NULL)
+            continue;
+        n = strlen(dobject->location);
+        hash = diskIndexHash(dobject->location, n);
+        if(diskIndexFind(hash) < 0 && diskIndexReserve(n) >= 0) {
+            i = diskIndexAdd(hash, DISK_INDEX_FILE, dobject->location, n);
+            diskIndexEntries[i].size = dobject->size;
+            diskIndexEntries[i].length = dobject->length;
+            diskIndexEntries[i].date = DISK_INDEX_TIME(dobject->date);
+            diskIndexEntries[i].last_modified =
+                DISK_INDEX_TIME(dobject->last_modified);
+            diskIndexEntries[i].expires = DISK_INDEX_TIME(dobject->expires);
+            if(dobject->access >= 0)
+                diskIndexEntries[i].access = DISK_INDEX_TIME(dobject->access);
+            else if(dobject->age >= 0)
+                diskIndexEntries[i].access = DISK_INDEX_TIME(dobject->age);
+            else
+                diskIndexEntries[i].access = DISK_INDEX_TIME(dobject->date);
+        }
+        free(dobject->location);
+        free(dobject->filename);
+        free(dobject);
+        if(diskIndex == NULL)
+            break;
+    }
+    fts_close(fts);
+}
+
+static void
+rebuildDiskIndex()
+{
+    unsigned int capacity = 4096;
+    int i;
+
+    diskIndexUnmap();
+    while(capacity < numSegments * (diskCacheSegmentSize / 4096))
+        capacity *= 2;
+    if(diskIndexResize(capacity, 64 * 1024) < 0)
+        return;
+
+    do_log(L_INFO, "Rebuilding disk cache index.\n");
+    for(i = 0; i < numSegments && diskIndex; i++)
+        scanSegment(i);
+    if(diskIndexFiles && diskIndex)
+        indexFiles();
+}
+
+static void
+closeDiskIndex()
+{
+    if(diskIndex && diskIndexFd >= 0)
+        diskIndex->clean = 1;
+    diskIndexUnmap();
+    if(diskIndexFd >= 0)
+        close(diskIndexFd);
+    diskIndexFd = -1;
+    diskIndexFiles = 0;
+    closeSegments();
+}
+
+static void
+openDiskIndex()
+{
+    char buf[1024];
+    int i, n, rc;
+
+    closeDiskIndex();
+    if(diskIndexRoot)
+        releaseAtom(diskIndexRoot);
+    diskIndexRoot = retainAtom(diskCacheRoot);
+
+    if(diskCacheRoot == NULL || diskCacheRoot->length <= 0 ||
+       (diskCacheSegments <= 0 && !diskCacheIndex))
+        return;
+
+    /* Workers would each have their own copy of the index. */
+    if(numWorkers > 1) {
+        do_log(L_WARN, "Disabling disk cache index and segments: "
+               "not supported with multiple workers.\n");
+        return;
+    }
+
+#ifndef WIN32 /*MINGW*/
+    n = snnprintf(buf, 0, 1024, "%s.index", diskCacheRoot->string);
+    if(n >= 0) {
+        diskIndexFd = open(buf, O_RDWR | O_CREAT | O_BINARY,
+                           diskCacheFilePermissions);
+        if(diskIndexFd < 0) {
+            do_log_error(L_WARN, errno, "Couldn't open %s", buf);
+        } else if(flock(diskIndexFd, LOCK_EX | LOCK_NB) < 0) {
+            do_log_error(L_WARN, errno,
+                         "Couldn't lock %s, disabling disk cache index "
+                         "and segments", buf);
+            close(diskIndexFd);
+            diskIndexFd = -1;
+            return;
+        }
+    }
+#endif
+
+    if(diskCacheSegments > 0)
+        openSegments();
+    diskIndexFiles = diskCacheIndex && diskIndexFd >= 0;
+    if(!diskIndexFiles && numSegments == 0) {
+        closeDiskIndex();
+        return;
+    }
+
+    rc = 0;
+    if(diskIndexFd >= 0)
+        rc = loadDiskIndex();
+    if(rc <= 0)
+        rebuildDiskIndex();
+    if(diskIndex == NULL) {
+        closeDiskIndex();
+        return;
+    }
+    diskIndex->clean = 0;
+
+    headSegment = 0;
+    for(i = 0; i < numSegments; i++) {
+        if(segments[i].used < segments[headSegment].used)
+            headSegment = i;
+    }
+
+    do_log(L_INFO, "Disk cache index: %d entries, %d segments.\n",
+           diskIndex->count, numSegments);
+}
+
+static int
+diskIndexReady()
+{
+    if(diskCacheSegments <= 0 && !diskCacheIndex)
+        return 0;
+    if(diskIndexRoot != diskCacheRoot)
+        openDiskIndex();
+    return diskIndex != NULL;
+}
+
+void
+closeDiskcache()
+{
+    closeDiskIndex();
+}
+
+static int
+isInternalPath(const char *path)
+{
+    int n;
+
+    if(!diskCacheRoot || diskCacheRoot->length <= 0 ||
+       strncmp(path, diskCacheRoot->string, diskCacheRoot->length) != 0)
+        return 0;
+    path += diskCacheRoot->length;
+    if(strncmp(path, ".slab", 5) == 0)
+        n = 5;
+    else if(strncmp(path, ".index", 6) == 0)
+        n = 6;
+    else
+        return 0;
+    return path[n] == '\0' || path[n] == '/';
+}
+
+/* Returns 0 if the index knows that object has no file. */
+static int
+diskIndexMayHaveFile(ObjectPtr object)
+{
+    int i;
+
+    if(!diskIndexReady() || !diskIndexFiles)
+        return 1;
+    i = diskIndexFind(diskIndexHash(object->key, object->key_size));
+    return i >= 0 && diskIndexEntries[i].segment == DISK_INDEX_FILE;
+}
+
+/* Called when the file for object has been created, written to or,
+   if size is negative, removed. */
+static void
+diskIndexNoteFile(ObjectPtr object, int size)
+{
+    unsigned long long hash;
+    int i;
+
+    if(!diskIndexReady() || !diskIndexFiles)
+        return;
+
+    hash = diskIndexHash(object->key, object->key_size);
+    i = diskIndexFind(hash);
+    if(i >= 0 && diskIndexEntries[i].segment != DISK_INDEX_FILE)
+        return;
+    if(size < 0) {
+        if(i >= 0)
+            diskIndexRemove(i);
+        return;
+    }
+    if(i < 0) {
+        if(diskIndexReserve(object->key_size) < 0)
+            return;
+        i = diskIndexAdd(hash, DISK_INDEX_FILE,
+                         object->key, object->key_size);
+    }
+    diskIndexEntries[i].size = size;
+    diskIndexNote(i, object);
+}
+
+static int
+segmentLookup(ObjectPtr object)
+{
+    int i;
+
+    if((object->flags & OBJECT_LOCAL) || !(object->flags & OBJECT_PUBLIC))
+        return -1;
+    if(!diskIndexReady() || numSegments == 0)
+        return -1;
+    i = diskIndexFind(diskIndexHash(object->key, object->key_size));
+    if(i < 0 || diskIndexEntries[i].segment == DISK_INDEX_FILE)
+        return -1;
+    return i;
+}
+
+static void
+segmentDelete(ObjectPtr object)
+{
+    int i = segmentLookup(object);
+    if(i >= 0)
+        segmentKill(i);
+}
+
+typedef struct _SegmentMove {
+    unsigned long long hash;
+    unsigned int offset;
+    unsigned int size;
+} SegmentMoveRec, *SegmentMovePtr;
+
+static int
+segmentMoveCmp(const void *a, const void *b)
+{
+    unsigned int oa = ((SegmentMovePtr)a)->offset;
+    unsigned int ob = ((SegmentMovePtr)b)->offset;
+    return oa < ob ? -1 : oa > ob ? 1 : 0;
+}
+
+/* Make segment i empty, either by compacting it or, if most of it is
+   live, by dropping its contents. */
+static int
+reclaimSegment(int i)
+{
+    SegmentMovePtr moves;
+    unsigned int offset = 0, maxsize = 0;
+    char *buf = NULL;
+    int j, k, n = 0, rc;
+    int drop = segments[i].live > (unsigned)diskCacheSegmentSize / 4 * 3;
+
+    moves = malloc((diskIndex->count + 1) * sizeof(SegmentMoveRec));
+    if(moves == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segment moves.\n");
+        return -1;
+    }
+
+    for(j = 0; j < (int)diskIndex->capacity; j++) {
+        if(diskIndexEntries[j].hash != 0 &&
+           diskIndexEntries[j].segment == i) {
+            moves[n].hash = diskIndexEntries[j].hash;
+            moves[n].offset = diskIndexEntries[j].offset;
+            moves[n].size = diskIndexEntries[j].size;
+            maxsize = MAX(maxsize, moves[n].size);
+            n++;
+        }
+    }
+
+    if(n > 0 && !drop) {
+        buf = malloc(maxsize);
+        if(buf == NULL)
+            drop = 1;
+    }
+
+    qsort(moves, n, sizeof(SegmentMoveRec), segmentMoveCmp);
+    for(j = 0; j < n; j++) {
+        k = diskIndexFind(moves[j].hash);
+        assert(k >= 0);
+        if(!drop && moves[j].offset != offset) {
+            rc = readAt(segments[i].fd, buf, moves[j].size, moves[j].offset);
+            if(rc == (int)moves[j].size)
+                rc = writeAt(segments[i].fd, buf, moves[j].size, offset);
+            if(rc != (int)moves[j].size) {
+                do_log_error(L_ERROR, errno, "Couldn't compact segment %d", i);
+                drop = 1;
+            }
+        }
+        if(drop) {
+            diskIndexRemove(k);
+        } else {
+            diskIndexEntries[k].offset = offset;
+            offset += moves[j].size;
+        }
+    }
+
+    free(buf);
+    free(moves);
+    segments[i].used = offset;
+    rc = segmentTerminate(i, offset);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write to segment %d", i);
+        return -1;
+    }
+    return 1;
+}
+
+/* Make sure that the head segment has room for size bytes. */
+static int
+segmentMakeRoom(unsigned int size)
+{
+    int i, victim = 0;
+    int rc;
+
+    if(segments[headSegment].used + size <= (unsigned)diskCacheSegmentSize)
+        return 1;
+
+    for(i = 1; i < numSegments; i++)
+        if(segments[i].live < segments[victim].live)
+            victim = i;
+
+    rc = reclaimSegment(victim);
+    if(rc < 0)
+        return -1;
+    headSegment = victim;
+    if(segments[headSegment].used + size > (unsigned)diskCacheSegmentSize)
+        return -1;
+    return 1;
+}
+
+/* Read the record i for object into a freshly allocated buffer, and
+   check that it is consistent.  Returns the buffer, or NULL. */
+static char *
+segmentReadRecord(ObjectPtr object, int i,
+                  char **image_return, int *n_return, int *len_return)
+{
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+    SegmentRecordHeaderPtr header;
+    char *buf, *image;
+    int rc, n, dummy;
+
+    buf = malloc(entry->size);
+    if(buf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segment buffer.\n");
+        return NULL;
+    }
+
+    rc = readAt(segments[entry->segment].fd, buf, entry->size, entry->offset);
+    if(rc != (int)entry->size) {
+        if(rc < 0)
+            do_log_error(L_ERROR, errno, "Couldn't read segment record");
+        goto fail;
+    }
+
+    header = (SegmentRecordHeaderPtr)buf;
+    if(header->magic != SEGMENT_LIVE || header->size != entry->size ||
+       header->key_size != object->key_size ||
+       SEGMENT_HEADER_SIZE + header->key_size + header->data_size >
+       entry->size ||
+       memcmp(buf + SEGMENT_HEADER_SIZE, object->key, object->key_size) != 0)
+        goto fail;
+
+    image = buf + SEGMENT_HEADER_SIZE + header->key_size;
+    n = findEndOfHeaders(image, 0, header->data_size, &dummy);
+    if(n < 0)
+        goto fail;
+
+    *image_return = image;
+    *n_return = n;
+    *len_return = header->data_size;
+    return buf;
+
+ fail:
+    free(buf);
+    segmentKill(i);
+    return NULL;
+}
+
+/* Called when an object is created.  Returns 1 if object was found in
+   the segment store. */
+static int
+segmentGet(ObjectPtr object)
+{
+    char *buf, *image;
+    int i, n, len, body_offset, rc;
+    time_t access;
+
+    if(!(object->flags & OBJECT_INITIAL))
+        return 0;
+
+    i = segmentLookup(object);
+    if(i < 0)
+        return 0;
+
+    buf = segmentReadRecord(object, i, &image, &n, &len);
+    if(buf == NULL)
+        return 0;
+
+    rc = parseEntryHeaders(object, image, n, &body_offset);
+    if(rc < 0 || object->length != len - body_offset) {
+        free(buf);
+        segmentKill(i);
+        return 0;
+    }
+
+    /* The access time in the record may be older than the index's. */
+    access = DISK_INDEX_UNTIME(diskIndexEntries[i].access);
+    if(access > object->atime)
+        object->atime = access;
+
+    object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+
+    if(len > body_offset) {
+        /* Like validateEntry, avoid invoking object expiry here */
+        objectSetChunks(object, 1);
+        if(object->numchunks >= 1) {
+            if(object->chunks[0].data == NULL)
+                object->chunks[0].data = maybe_get_chunk();
+            if(object->chunks[0].data)
+                objectAddData(object, image + body_offset,
+                              0, MIN(len - body_offset, CHUNK_SIZE));
+        }
+    }
+
+    free(buf);
+    return 1;
+}
+
+/* Returns -1 if object is not in the segment store, otherwise 1 if
+   some data was read. */
+static int
+segmentFill(ObjectPtr object, int offset, int chunks)
+{
+    char *buf = NULL, *image, *body;
+    int n, len, body_offset, rc, result = -1;
+    int i, k, o, m;
+
+    if(segmentLookup(object) < 0)
+        return -1;
+
+    for(k = 0; k < chunks; k++) {
+        i = offset / CHUNK_SIZE + k;
+        if(expandChunk(object, i) < 0) {
+            chunks = k;
+            break;
+        }
+        lockChunk(object, i);
+    }
+
+    /* expandChunk may have caused the segment to be compacted */
+    i = segmentLookup(object);
+    if(i < 0)
+        goto done;
+
+    buf = segmentReadRecord(object, i, &image, &n, &len);
+    if(buf == NULL)
+        goto done;
+
+    /* A record is only ever written from the public object with the
+       same key, so there is nothing to validate unless we don't know
+       anything about the object yet. */
+    if(object->flags & OBJECT_INITIAL) {
+        rc = parseEntryHeaders(object, image, n, &body_offset);
+        if(rc < 0) {
+            segmentKill(i);
+            goto done;
+        }
+    } else {
+        body_offset = n;
+    }
+    if(object->length != len - body_offset) {
+        segmentKill(i);
+        goto done;
+    }
+    object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+
+    body = image + body_offset;
+    len -= body_offset;
+    result = 0;
+    for(k = 0; k < chunks; k++) {
+        i = offset / CHUNK_SIZE + k;
+        o = i * CHUNK_SIZE;
+        if(o >= len)
+            break;
+        m = MIN(CHUNK_SIZE, len - o);
+        if(object->chunks[i].size >= m)
+            continue;
+        memcpy(object->chunks[i].data + object->chunks[i].size,
+               body + o + object->chunks[i].size,
+               m - object->chunks[i].size);
+        object->chunks[i].size = m;
+        if(object->size < o + m)
+            object->size = o + m;
+        result = 1;
+    }
+
+ done:
+    for(k = 0; k < chunks; k++)
+        unlockChunk(object, offset / CHUNK_SIZE + k);
+    free(buf);
+    if(result > 0)
+        notifyObject(object);
+    return result;
+}
+
+static int
+segmentEligible(ObjectPtr object)
+{
+    if(object->length < 0 || object->length > maxSegmentEntrySize)
+        return 0;
+    /* Records are written whole, so partial objects go to a file. */
+    if(object->size < object->length)
+        return 0;
+    /* An object that already lives in its own file stays there. */
+    if(object->disk_entry && object->disk_entry != &negativeEntry)
+        return 0;
+    return (object->flags & OBJECT_PUBLIC) && diskIndexReady() &&
+        numSegments > 0;
+}
+
+/* Write out a complete object as a single record, superseding any
+   previous record.  Data that is no longer in memory is taken from
+   the previous record. */
+static int
+segmentWriteout(ObjectPtr object)
+{
+    SegmentRecordHeaderPtr header;
+    char *buf = NULL, *oldbuf = NULL, *oldimage = NULL, *body;
+    unsigned long long hash;
+    unsigned int headers = 0;
+    int bufsize, hsize, n, oldn, oldlen;
+    int i, o, m, size, old, rc;
+
+    if(object->flags & OBJECT_DISK_ENTRY_COMPLETE)
+        return 0;
+
+    /* Partial objects are not stored; objectAddData will dirty the
+       object again when more data arrives. */
+    if(object->size < object->length)
+        return 0;
+
+    hsize = 2048;
+ again:
+    bufsize = SEGMENT_HEADER_SIZE + object->key_size + hsize +
+        object->length + 8 + SEGMENT_HEADER_SIZE;
+    buf = malloc(bufsize);
+    if(buf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segment buffer.\n");
+        return 0;
+    }
+    body = buf + SEGMENT_HEADER_SIZE + object->key_size;
+    n = formatEntryHeaders(body, hsize, object);
+    if(n >= 0)
+        headers = headersHash(body, n);
+    if(n >= 0)
+        n = snnprintf(body, n, hsize, "\r\n\r\n");
+    if(n < 0) {
+        free(buf);
+        buf = NULL;
+        if(hsize < bigBufferSize) {
+            hsize = bigBufferSize;
+            goto again;
+        }
+        do_log(L_ERROR, "Couldn't write segment record "
+               "(headers too long).\n");
+        goto fail;
+    }
+
+    /* Serving an object changes nothing but its access time, which
+       is kept in the index. */
+    old = segmentLookup(object);
+    if(old >= 0 && diskIndexEntries[old].headers == headers &&
+       diskIndexEntries[old].length == object->length) {
+        diskIndexNote(old, object);
+        free(buf);
+        object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+        return 0;
+    }
+
+    for(i = 0; i * CHUNK_SIZE < object->length; i++) {
+        m = MIN(CHUNK_SIZE, object->length - i * CHUNK_SIZE);
+        if(i >= object->numchunks || object->chunks[i].size < m)
+            break;
+    }
+    if(i * CHUNK_SIZE < object->length) {
+        if(old < 0)
+            goto fail;
+        oldbuf = segmentReadRecord(object, old, &oldimage, &oldn, &oldlen);
+        if(oldbuf == NULL)
+            goto fail;
+        if(oldlen - oldn != object->length)
+            goto fail;
+        oldimage += oldn;
+    }
+
+    memcpy(buf + SEGMENT_HEADER_SIZE, object->key, object->key_size);
+    body += n;
+    for(i = 0; i * CHUNK_SIZE < object->length; i++) {
+        o = i * CHUNK_SIZE;
+        m = MIN(CHUNK_SIZE, object->length - o);
+        if(i < object->numchunks && object->chunks[i].size >= m)
+            memcpy(body + o, object->chunks[i].data, m);
+        else
+            memcpy(body + o, oldimage + o, m);
+    }
+    free(oldbuf);
+    oldbuf = NULL;
+
+    size = SEGMENT_ALIGN(SEGMENT_HEADER_SIZE + object->key_size +
+                         n + object->length);
+    if(size + SEGMENT_HEADER_SIZE > diskCacheSegmentSize / 4) {
+        do_log(L_WARN, "Couldn't write segment record (too large).\n");
+        goto fail;
+    }
+    header = (SegmentRecordHeaderPtr)buf;
+    header->magic = SEGMENT_LIVE;
+    header->size = size;
+    header->key_size = object->key_size;
+    header->data_size = n + object->length;
+    memset(buf + SEGMENT_HEADER_SIZE + object->key_size +
+           n + object->length, 0,
+           size - (SEGMENT_HEADER_SIZE + object->key_size +
+                   n + object->length) + SEGMENT_HEADER_SIZE);
+
+    /* The old record goes away before making room, which may move
+       records around. */
+    old = segmentLookup(object);
+    if(old >= 0) {
+        segmentKill(old);
+    } else if(object->disk_entry == NULL) {
+        /* There may be a file left over from before the object was
+           written to the segments.  For newly fetched objects, the
+           negative entry tells us that there is none. */
+        destroyDiskEntry(object, 1);
+    }
+    if(object->disk_entry == &negativeEntry)
+        object->disk_entry = NULL;
+
+    if(diskIndexReserve(0) < 0 || numSegments == 0)
+        goto fail;
+    if(segmentMakeRoom(size + SEGMENT_HEADER_SIZE) < 0)
+        goto fail;
+
+    o = segments[headSegment].used;
+    rc = writeAt(segments[headSegment].fd, buf, size + SEGMENT_HEADER_SIZE, o);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write segment record");
+        goto fail;
+    }
+    free(buf);
+
+    hash = diskIndexHash(object->key, object->key_size);
+    i = diskIndexAdd(hash, headSegment, NULL, 0);
+    diskIndexEntries[i].offset = o;
+    diskIndexEntries[i].size = size;
+    diskIndexEntries[i].headers = headers;
+    diskIndexNote(i, object);
+    segments[headSegment].used += size;
+    segments[headSegment].live += size;
+
+    object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+    return object->length;
+
+ fail:
+    old = segmentLookup(object);
+    if(old >= 0)
+        segmentKill(old);
+    free(oldbuf);
+    free(buf);
+    return 0;
+}
+
+int
+destroyDiskEntry(ObjectPtr object, int d)
+{
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int rc, urc = 1;
+
+    assert(!entry || !entry->local || !d);
+
+    if(d)
+        segmentDelete(object);
+
+    if(d && !entry)
+        entry = makeDiskEntry(object, 0);
+
+    CHECK_ENTRY(entry);
+
+    if(!entry || entry == &negativeEntry) {
+        return 1;
+    }
+
+    assert(entry->object == object);
+
+    if(maxDiskCacheEntrySize >= 0 && object->size > maxDiskCacheEntrySize) {
+        /* See writeoutToDisk */
+        d = 1;
+    }
+
+    if(d) {
+        entry->object->flags &= ~OBJECT_DISK_ENTRY_COMPLETE;
+        if(entry->filename) {
+            urc = unlink(entry->filename);
+            if(urc < 0)
+                do_log_error(L_WARN, errno, 
+                             "Couldn't unlink %s", scrub(entry->filename));
+            else
+                diskIndexNoteFile(object, -1);
+        }
+    } else {
+        if(entry && entry->metadataDirty)
+            writeoutMetadata(object);
+        makeDiskEntry(object, 0);
+        /* rewriteDiskEntry may change the disk entry */
+        entry = object->disk_entry;
+        if(entry == NULL || entry == &negativeEntry)
+            return 0;
+        if(diskCacheWriteoutOnClose > 0) {
+            reallyWriteoutToDisk(object, -1, diskCacheWriteoutOnClose);
+            entry = object->disk_entry;
+            if(entry == NULL || entry == &negativeEntry)
+                return 0;
+        }
+    }
+ again:
+    rc = close(entry->fd);
+    if(rc < 0 && errno == EINTR)
+        goto again;
+
+    entry->fd = -1;
+
+    if(entry->filename)
+        free(entry->filename);
+    entry->filename = NULL;
+
+    if(entry->previous)
+        entry->previous->next = entry->next;
+    else
+        diskEntries = entry->next;
+    if(entry->next)
+        entry->next->previous = entry->previous;
+    else
+        diskEntriesLast = entry->previous;
+
+    numDiskEntries--;
+    assert(numDiskEntries >= 0);
+
+    free(entry);
+    object->disk_entry = NULL;
+    if(urc < 0)
+        return -1;
+    else
+        return 1;
+}
+
+ObjectPtr 
+objectGetFromDisk(ObjectPtr object)
+{
+    DiskCacheEntryPtr entry;
+    if(segmentGet(object) > 0)
+        return object;
+    entry = makeDiskEntry(object, 0);
+    if(!entry) return NULL;
+    return object;
+}
+
+
+static int
+reallyObjectFillFromDisk(ObjectPtr object, int offset, int chunks, int async)
+{
+    DiskCacheEntryPtr entry;
+    int rc, result;
+    int i, j, k, n;
+    int complete;
+
+    if(object->type != OBJECT_HTTP)
+        return 0;
+
+    if(object->flags & OBJECT_LINEAR)
+        return 0;
+
+    if(object->length >= 0) {
+        chunks = MIN(chunks, 
+                     (object->length - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+
+    rc = objectSetChunks(object, offset / CHUNK_SIZE + chunks);
+    if(rc < 0)
+        return 0;
+
+    complete = 1;
+    if(object->flags & OBJECT_INITIAL) {
+        complete = 0;
+    } else if((object->length < 0 || object->size < object->length) &&
+              object->size < (offset / CHUNK_SIZE + chunks) * CHUNK_SIZE) {
+        complete = 0;
+    } else {
+        for(k = 0; k < chunks; k++) {
+            int s;
+            i = offset / CHUNK_SIZE + k;
+            s = MIN(CHUNK_SIZE, object->size - i * CHUNK_SIZE);
+            if(object->chunks[i].size < s) {
+                complete = 0;
                 break;
             }
         }
     }
 
-    if(complete)
-        return 1;
+    if(complete)
+        return 1;
+
+    /* We will be notified when the data arrives. */
+    if(async && (object->flags & OBJECT_DISK_READING))
+        return 0;
+
+    rc = segmentFill(object, offset, chunks);
+    if(rc >= 0)
+        return rc;
+
+    /* This has the side-effect of revalidating the entry, which is
+       what makes HEAD requests work. */
+    entry = makeDiskEntry(object, 0);
+    if(!entry)
+        return 0;
+
+    /* Since we need to go to disk anyway, read a little more. */
+    n = chunks > 0 ? MAX(chunks, CHUNKS(MAX(diskCacheReadAhead, 0))) : 0;
+    if(object->length >= 0)
+        n = MIN(n, (object->length - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    if(entry->size >= 0)
+        n = MIN(n, (entry->size - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    if(n > chunks && objectSetChunks(object, offset / CHUNK_SIZE + n) >= 0)
+        chunks = n;
+
+    if(async && diskReadStart(object, entry, offset, chunks) >= 0)
+        return 0;
+                
+    for(k = 0; k < chunks; k++) {
+        i = offset / CHUNK_SIZE + k;
+        if(expandChunk(object, i) < 0) {
+            chunks = k;
+            break;
+        }
+        lockChunk(object, i);
+    }
+
+    result = 0;
+
+    k = 0;
+    while(k < chunks) {
+        struct iovec iov[DISK_IOV];
+        int o, m, left, len = 0;
+        i = offset / CHUNK_SIZE + k;
+        j = object->chunks[i].size;
+        o = i * CHUNK_SIZE + j;
+
+        if(j == CHUNK_SIZE) {
+            k++;
+            continue;
+        }
+
+        if(entry->size >= 0 && entry->size <= o)
+            break;
+
+        /* Read into this chunk and any empty chunks that follow it. */
+        n = 0;
+        do {
+            iov[n].iov_base = object->chunks[i + n].data +
+                object->chunks[i + n].size;
+            iov[n].iov_len = CHUNK_SIZE - object->chunks[i + n].size;
+            len += iov[n].iov_len;
+            n++;
+        } while(k + n < chunks && n < DISK_IOV &&
+                object->chunks[i + n].size == 0);
+
+        CHECK_ENTRY(entry);
+        rc = entryReadv(entry, iov, n, entry->body_offset + o);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't read");
+            break;
+        }
+
+        left = rc;
+        for(m = 0; m < n && left > 0; m++) {
+            int s = MIN(left, (int)iov[m].iov_len);
+            object->chunks[i + m].size += s;
+            o += s;
+            left -= s;
+        }
+        if(object->size < o)
+            object->size = o;
+        if(rc > 0)
+            result = 1;
+
+        if(object->length >= 0 && entry->size < 0 && o == object->length)
+            entry->size = object->length;
+
+        if(rc < len) {
+            /* Paranoia: the read may have been interrupted half-way. */
+            if(entry->size < 0) {
+                if(rc == 0 ||
+                   (object->length >= 0 && object->length == o))
+                    entry->size = o;
+            } else if(entry->size != o) {
+                if(rc == 0 || entry->size < o) {
+                    do_log(L_WARN,
+                           "Disk entry size changed behind our back: "
+                           "%ld -> %ld (%d).\n",
+                           (long)entry->size, (long)o, object->size);
+                    entry->size = -1;
+                }
+            }
+            break;
+        }
+
+        k += n;
+    }
+
+    CHECK_ENTRY(object->disk_entry);
+    for(k = 0; k < chunks; k++) {
+        i = offset / CHUNK_SIZE + k;
+        unlockChunk(object, i);
+    }
+
+    if(result > 0) {
+        notifyObject(object);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+int
+objectFillFromDisk(ObjectPtr object, int offset, int chunks)
+{
+    long long start = eventProbeStart();
+    int rc = reallyObjectFillFromDisk(object, offset, chunks, 0);
+    eventProbeEnd(start, (void*)objectFillFromDisk, "objectFillFromDisk",
+                  EVENT_PROBE_FUNCTION);
+    return rc;
+}
+
+/* Like objectFillFromDisk, but the data may be read by a disk thread,
+   in which case OBJECT_DISK_READING is set until it has arrived and
+   the object has been notified. */
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+    long long start = eventProbeStart();
+    int rc = reallyObjectFillFromDisk(object, offset, chunks, 1);
+    eventProbeEnd(start, (void*)objectFillFromDiskAsync,
+                  "objectFillFromDiskAsync", EVENT_PROBE_FUNCTION);
+    return rc;
+}
+
+/* Whether the body of object should be sent to clients straight from
+   its file in the on-disk cache rather than through chunk memory. */
+int
+diskEntryMaySendfile(ObjectPtr object)
+{
+#ifdef HAVE_SENDFILE
+    if(diskCacheSendfileSize < 0 || object->type != OBJECT_HTTP)
+        return 0;
+    if(object->flags & (OBJECT_LOCAL | OBJECT_LINEAR))
+        return 0;
+    if(object->length < 0 || object->length < diskCacheSendfileSize)
+        return 0;
+    /* An entry that has just been opened doesn't know its size yet. */
+    if(!(object->flags & OBJECT_DISK_ENTRY_COMPLETE) &&
+       diskEntrySize(object) < object->length)
+        return 0;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Returns a private descriptor for the file holding object, and sets
+   position to the place of offset within it, or returns -1.  The
+   descriptor remains valid if the entry is closed or the file is
+   replaced while the caller is using it. */
+int
+diskEntrySendfileFd(ObjectPtr object, int offset, off_t *position)
+{
+    DiskCacheEntryPtr entry;
+    int fd;
+
+    if(!diskEntryMaySendfile(object))
+        return -1;
+
+    /* Small objects live in segments, and are best served from memory. */
+    if(segmentLookup(object) >= 0)
+        return -1;
+
+    entry = makeDiskEntry(object, 0);
+    if(entry == NULL || entry == &negativeEntry || entry->local)
+        return -1;
+    if(entry->size >= 0 && entry->size < object->length)
+        return -1;
+
+    fd = dup(entry->fd);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't duplicate file descriptor");
+        return -1;
+    }
+    *position = entry->body_offset + offset;
+    return fd;
+}
+
+#ifdef HAVE_DISK_THREADS
+
+/* Reads for serving objects may be performed by a pool of threads, so
+   that a slow disk doesn't stall the event loop.  The threads do
+   nothing but pread into a buffer owned by the request and close a
+   private copy of the file descriptor; everything else happens in the
+   main thread once the completion has been noticed. */
+
+typedef struct _DiskRead {
+    ObjectPtr object;
+    DiskCacheEntryPtr entry;
+    int fd;
+    off_t position;             /* in the file */
+    int offset;                 /* in the object */
+    int chunk;
+    int chunks;                 /* locked, at most DISK_IOV */
+    int sizes[DISK_IOV];        /* of the chunks when the read was queued */
+    int len;
+    int rc;
+    int error;
+    char *buf;
+    struct _DiskRead *next;
+} DiskReadRec, *DiskReadPtr;
+
+static pthread_mutex_t diskReadMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diskReadCondition = PTHREAD_COND_INITIALIZER;
+static DiskReadPtr diskReadQueue = NULL, diskReadQueueLast = NULL;
+static DiskReadPtr diskReadDone = NULL;
+static int diskReadFds[2] = {-1, -1};
+static int diskReadState = 0;
+
+static void *
+diskReadThread(void *dummy)
+{
+    DiskReadPtr request;
+    int rc, wake;
+
+    while(1) {
+        pthread_mutex_lock(&diskReadMutex);
+        while(diskReadQueue == NULL)
+            pthread_cond_wait(&diskReadCondition, &diskReadMutex);
+        request = diskReadQueue;
+        diskReadQueue = request->next;
+        if(diskReadQueue == NULL)
+            diskReadQueueLast = NULL;
+        pthread_mutex_unlock(&diskReadMutex);
+
+        do {
+            rc = pread(request->fd, request->buf, request->len,
+                       request->position);
+        } while(rc < 0 && errno == EINTR);
+        request->rc = rc;
+        request->error = rc < 0 ? errno : 0;
+        close(request->fd);
+
+        pthread_mutex_lock(&diskReadMutex);
+        wake = diskReadDone == NULL;
+        request->next = diskReadDone;
+        diskReadDone = request;
+        pthread_mutex_unlock(&diskReadMutex);
+
+        if(wake) {
+#ifdef HAVE_EVENTFD
+            uint64_t one = 1;
+            rc = write(diskReadFds[1], &one, sizeof(one));
+#else
+            rc = write(diskReadFds[1], "", 1);
+#endif
+        }
+    }
+    return NULL;
+}
+
+static void
+diskReadFinish(DiskReadPtr request)
+{
+    ObjectPtr object = request->object;
+    DiskCacheEntryPtr entry = object->disk_entry;
+    int rc = request->rc;
+    int i, j, k, m, n = 0;
 
-    /* This has the side-effect of revalidating the entry, which is
-       what makes HEAD requests work. */
-    entry = makeDiskEntry(object, 0);
-    if(!entry)
-        return 0;
-                
-    for(k = 0; k < chunks; k++) {
-        i = offset / CHUNK_SIZE + k;
-        if(!object->chunks[i].data)
-            object->chunks[i].data = get_chunk();
-        if(!object->chunks[i].data) {
-            chunks = k;
-            break;
+    object->flags &= ~OBJECT_DISK_READING;
+
+    if(rc < 0)
+        do_log_error(L_ERROR, request->error, "Couldn't read disk entry");
+
+    /* Don't try again beyond what we could read. */
+    if(entry == request->entry && rc < request->len &&
+       (entry->size < 0 || rc <= 0))
+        entry->size = request->offset + MAX(rc, 0);
+
+    for(k = 0; k < request->chunks; k++) {
+        i = request->chunk + k;
+        j = request->sizes[k];
+        m = MIN(CHUNK_SIZE - j, rc - n);
+        /* The chunk may have been filled in the meantime. */
+        if(m > 0 && object->chunks[i].size == j) {
+            memcpy(object->chunks[i].data + j, request->buf + n, m);
+            object->chunks[i].size += m;
+            if(object->size < i * CHUNK_SIZE + j + m)
+                object->size = i * CHUNK_SIZE + j + m;
         }
-        lockChunk(object, i);
+        n += CHUNK_SIZE - j;
+        unlockChunk(object, i);
     }
 
-    result = 0;
+    if(entry == request->entry && object->length >= 0 && entry->size < 0 &&
+       request->offset + rc == object->length)
+        entry->size = object->length;
 
-    for(k = 0; k < chunks; k++) {
-        int o;
-        i = offset / CHUNK_SIZE + k;
-        j = object->chunks[i].size;
-        o = i * CHUNK_SIZE + j;
+    /* Even if we got nothing, so that the waiters look elsewhere. */
+    notifyObject(object);
+    releaseObject(object);
+    free(request->buf);
+    free(request);
+}
 
-        if(object->chunks[i].size == CHUNK_SIZE)
-            continue;
+static int
+diskReadHandler(int status, FdEventHandlerPtr event)
+{
+    DiskReadPtr request, next;
+    char buf[64];
+    int rc;
 
-        if(entry->size >= 0 && entry->size <= o)
-            break;
+    /* Drain before taking the list, so that no wakeup is lost. */
+    do {
+        rc = read(diskReadFds[0], buf, sizeof(buf));
+    } while(rc > 0 || (rc < 0 && errno == EINTR));
+
+    pthread_mutex_lock(&diskReadMutex);
+    request = diskReadDone;
+    diskReadDone = NULL;
+    pthread_mutex_unlock(&diskReadMutex);
+
+    while(request) {
+        next = request->next;
+        diskReadFinish(request);
+        request = next;
+    }
+    return 0;
+}
 
-        if(entry->offset != entry->body_offset + o) {
-            rc = entrySeek(entry, entry->body_offset + o);
-            if(rc < 0) {
-                result = 0;
-                break;
-            }
-        }
+static int
+startDiskReadThreads()
+{
+    pthread_t thread;
+    sigset_t mask, old;
+    int i, rc;
 
-        CHECK_ENTRY(entry);
-        again:
-        rc = read(entry->fd, object->chunks[i].data + j, CHUNK_SIZE - j);
-        if(rc < 0) {
-            if(errno == EINTR)
-                goto again;
-            entry->offset = -1;
-            do_log_error(L_ERROR, errno, "Couldn't read");
-            break;
-        }
+#ifdef HAVE_EVENTFD
+    diskReadFds[0] = diskReadFds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(diskReadFds[0] < 0)
+        goto fail;
+#else
+    rc = pipe(diskReadFds);
+    if(rc < 0)
+        goto fail;
+    setNonblocking(diskReadFds[0], 1);
+    setNonblocking(diskReadFds[1], 1);
+#endif
 
-        entry->offset += rc;
-        object->chunks[i].size += rc;
-        if(object->size < o + rc)
-            object->size = o + rc;
+    if(registerFdEvent(diskReadFds[0], POLLIN,
+                       diskReadHandler, 0, NULL) == NULL)
+        goto fail;
 
-        if(entry->object->length >= 0 && entry->size < 0 &&
-           entry->offset - entry->body_offset == entry->object->length)
-            entry->size = entry->object->length;
-            
-        if(rc < CHUNK_SIZE - j) {
-            /* Paranoia: the read may have been interrupted half-way. */
-            if(entry->size < 0) {
-                if(rc == 0 ||
-                   (entry->object->length >= 0 &&
-                    entry->object->length == 
-                    entry->offset - entry->body_offset))
-                    entry->size = entry->offset - entry->body_offset;
-                break;
-            } else if(entry->size != entry->offset - entry->body_offset) {
-                if(rc == 0 || 
-                   entry->size < entry->offset - entry->body_offset) {
-                    do_log(L_WARN,
-                           "Disk entry size changed behind our back: "
-                           "%ld -> %ld (%d).\n",
-                           (long)entry->size,
-                           (long)entry->offset - entry->body_offset,
-                           object->size);
-                    entry->size = -1;
-                }
-            }
+    /* Signals must be delivered to the main thread. */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for(i = 0; i < diskReadThreads; i++) {
+        rc = pthread_create(&thread, NULL, diskReadThread, NULL);
+        if(rc != 0) {
+            errno = rc;
             break;
         }
-
-        CHECK_ENTRY(entry);
-        result = 1;
+        pthread_detach(thread);
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    CHECK_ENTRY(object->disk_entry);
+    if(i == 0)
+        goto fail;
+    if(i < diskReadThreads)
+        do_log_error(L_WARN, errno, "Only started %d disk threads", i);
+    return 1;
+
+ fail:
+    do_log_error(L_ERROR, errno, "Couldn't start disk threads");
+    return -1;
+}
+
+/* Queue a read of the data at offset for a run of chunks.  Returns
+   -1 if the data should be read synchronously, if at all. */
+static int
+diskReadStart(ObjectPtr object, DiskCacheEntryPtr entry,
+              int offset, int chunks)
+{
+    DiskReadPtr request;
+    int i, j, k, n, o, len, fd;
+
+    if(diskReadThreads <= 0 || entry->local)
+        return -1;
+
+    /* Threads are started lazily, once any forking has been done. */
+    if(diskReadState == 0)
+        diskReadState = startDiskReadThreads();
+    if(diskReadState < 0)
+        return -1;
+
+    i = offset / CHUNK_SIZE;
     for(k = 0; k < chunks; k++) {
-        i = offset / CHUNK_SIZE + k;
-        unlockChunk(object, i);
+        if(object->chunks[i + k].size < CHUNK_SIZE)
+            break;
+    }
+    if(k >= chunks)
+        return -1;
+    i += k;
+    j = object->chunks[i].size;
+    o = i * CHUNK_SIZE + j;
+
+    /* A single read must be contiguous. */
+    n = 1;
+    while(k + n < chunks && n < DISK_IOV && object->chunks[i + n].size == 0)
+        n++;
+    len = n * CHUNK_SIZE - j;
+    if(object->length >= 0)
+        len = MIN(len, object->length - o);
+    if(entry->size >= 0)
+        len = MIN(len, entry->size - o);
+    if(len <= 0)
+        return -1;
+
+    request = malloc(sizeof(DiskReadRec));
+    if(request == NULL)
+        return -1;
+    request->buf = malloc(len);
+    if(request->buf == NULL) {
+        free(request);
+        return -1;
+    }
+    fd = dup(entry->fd);
+    if(fd < 0) {
+        free(request->buf);
+        free(request);
+        return -1;
     }
 
-    if(result > 0) {
-        notifyObject(object);
-        return 1;
-    } else {
-        return 0;
+    for(k = 0; k < n; k++) {
+        if(expandChunk(object, i + k) < 0)
+            break;
+        lockChunk(object, i + k);
+        request->sizes[k] = object->chunks[i + k].size;
+    }
+    if(k == 0) {
+        close(fd);
+        free(request->buf);
+        free(request);
+        return -1;
     }
+
+    request->object = retainObject(object);
+    request->entry = entry;
+    request->fd = fd;
+    request->position = entry->body_offset + o;
+    request->offset = o;
+    request->chunk = i;
+    request->chunks = k;
+    request->len = MIN(len, k * CHUNK_SIZE - j);
+    request->rc = -1;
+    request->error = 0;
+    request->next = NULL;
+    object->flags |= OBJECT_DISK_READING;
+
+    pthread_mutex_lock(&diskReadMutex);
+    if(diskReadQueueLast)
+        diskReadQueueLast->next = request;
+    else
+        diskReadQueue = request;
+    diskReadQueueLast = request;
+    pthread_cond_signal(&diskReadCondition);
+    pthread_mutex_unlock(&diskReadMutex);
+    return 0;
+}
+
+#else
+
+static int
+diskReadStart(ObjectPtr object, DiskCacheEntryPtr entry,
+              int offset, int chunks)
+{
+    return -1;
 }
 
+#endif
+
 int 
 writeoutToDisk(ObjectPtr object, int upto, int max)
 {
@@ -1663,6 +3530,9 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
     if((object->flags & OBJECT_DISK_ENTRY_COMPLETE) && !object->disk_entry)
         return 0;
 
+    if(segmentEligible(object))
+        return segmentWriteout(object);
+
     entry = makeDiskEntry(object, 1);
     if(!entry) return 0;
 
@@ -1694,40 +3564,49 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
             return 0;
     }
 
-    rc = entrySeek(entry, offset + entry->body_offset);
-    if(rc < 0) return 0;
-
-    do {
-        if(max >= 0 && bytes >= max)
-            break;
+    while(max < 0 || bytes < max) {
+        struct iovec iov[DISK_IOV];
+        int n = 0, len = 0;
         CHECK_ENTRY(entry);
-        assert(entry->offset == offset + entry->body_offset);
         i = offset / CHUNK_SIZE;
         j = offset % CHUNK_SIZE;
-        if(i >= object->numchunks)
-            break;
-        if(object->chunks[i].size <= j)
+
+        /* Gather contiguous data, stopping after a partial chunk. */
+        while(n < DISK_IOV && i + n < object->numchunks) {
+            if(object->chunks[i + n].size <= j)
+                break;
+            if(n > 0 && max >= 0 && bytes + len >= max)
+                break;
+            iov[n].iov_base = object->chunks[i + n].data + j;
+            iov[n].iov_len = object->chunks[i + n].size - j;
+            len += iov[n].iov_len;
+            n++;
+            if(object->chunks[i + n - 1].size < CHUNK_SIZE)
+                break;
+            j = 0;
+        }
+        if(n == 0)
             break;
-    again:
-        rc = write(entry->fd, object->chunks[i].data + j,
-                   object->chunks[i].size - j);
+
+        rc = entryWritev(entry, iov, n, offset + entry->body_offset);
         if(rc < 0) {
-            if(errno == EINTR)
-                goto again;
             do_log_error(L_ERROR, errno, "Couldn't write disk entry");
             break;
         }
-        entry->offset += rc;
         offset += rc;
         bytes += rc;
         if(entry->size < offset)
             entry->size = offset;
-    } while(j + rc >= CHUNK_SIZE);
+        if(rc < len || offset % CHUNK_SIZE != 0)
+            break;
+    }
 
  done:
     CHECK_ENTRY(entry);
     if(entry->metadataDirty)
         writeoutMetadata(object);
+    if(object->disk_entry && object->disk_entry != &negativeEntry)
+        diskIndexNoteFile(object, object->disk_entry->size);
 
     return bytes;
 }
@@ -1760,6 +3639,7 @@ writeoutMetadata(ObjectPtr object)
     if(rc < 0) goto fail;
     entry->offset = rc;
     entry->metadataDirty = 0;
+    diskIndexNoteFile(object, entry->size);
     return 1;
 
  fail:
@@ -1932,6 +3812,9 @@ processObject(DiskObjectPtr dobjects, char *filename, struct stat *sb)
     DiskObjectPtr dobject = NULL;
     int c = 0;
 
+    if(isInternalPath(filename))
+        return dobjects;
+
     dobject = readDiskObject((char*)filename, sb);
     if(dobject == NULL)
         return dobjects;
@@ -2083,6 +3966,152 @@ insertDirs(DiskObjectPtr from)
     return from;
 }
         
+/* Read the URL of the object stored in segment record i. */
+static char *
+segmentReadKey(int i)
+{
+    DiskIndexEntryPtr entry = &diskIndexEntries[i];
+    SegmentRecordHeaderRec header;
+    char *key;
+    int rc;
+
+    rc = readAt(segments[entry->segment].fd, &header, sizeof(header),
+                entry->offset);
+    if(rc != (int)sizeof(header) || header.magic != SEGMENT_LIVE ||
+       header.key_size > entry->size - SEGMENT_HEADER_SIZE)
+        return NULL;
+    key = malloc(header.key_size + 1);
+    if(key == NULL)
+        return NULL;
+    rc = readAt(segments[entry->segment].fd, key, header.key_size,
+                entry->offset + SEGMENT_HEADER_SIZE);
+    if(rc != (int)header.key_size) {
+        free(key);
+        return NULL;
+    }
+    key[header.key_size] = '\0';
+    return key;
+}
+
+static int
+dobjectCmp(const void *a, const void *b)
+{
+    return strcmp((*(DiskObjectPtr*)a)->location,
+                  (*(DiskObjectPtr*)b)->location);
+}
+
+/* Return a sorted list of the objects under root that are known to
+   the disk index.  Unless recursive is true, objects more than one
+   level below root are replaced by the directory just below root. */
+static DiskObjectPtr
+diskIndexObjects(const char *root, int recursive)
+{
+    DiskObjectPtr *array, dobject, dobjects = NULL;
+    DiskIndexEntryPtr entry;
+    char *location, *cp;
+    int i, j, n = 0, start;
+    int rootlen = strlen(root);
+
+    array = malloc((diskIndex->count + 1) * sizeof(DiskObjectPtr));
+    if(array == NULL)
+        return NULL;
+
+    for(i = 0; i < (int)diskIndex->capacity; i++) {
+        entry = &diskIndexEntries[i];
+        if(entry->hash == 0)
+            continue;
+        if(entry->segment == DISK_INDEX_FILE)
+            location = strdup_n(diskIndexHeap + entry->offset,
+                                entry->key_size);
+        else
+            location = segmentReadKey(i);
+        if(location == NULL)
+            continue;
+        if(strncmp(location, root, rootlen) != 0) {
+            free(location);
+            continue;
+        }
+        dobject = malloc(sizeof(DiskObjectRec));
+        if(dobject == NULL) {
+            free(location);
+            break;
+        }
+        dobject->location = location;
+        dobject->filename = NULL;
+        dobject->body_offset = -1;
+        dobject->length = entry->length;
+        dobject->size =
+            entry->segment == DISK_INDEX_FILE ? entry->size : entry->length;
+        dobject->age = -1;
+        dobject->access = DISK_INDEX_UNTIME(entry->access);
+        dobject->date = DISK_INDEX_UNTIME(entry->date);
+        dobject->last_modified = DISK_INDEX_UNTIME(entry->last_modified);
+        dobject->expires = DISK_INDEX_UNTIME(entry->expires);
+        dobject->next = NULL;
+        if(!recursive) {
+            start = rootlen;
+            if(start == 0) {
+                cp = strstr(location, "://");
+                if(cp)
+                    start = cp - location + 3;
+            }
+            cp = strchr(location + start, '/');
+            if(cp && cp[1] != '\0') {
+                cp[1] = '\0';
+                dobject->length = -1;
+                dobject->size = -1;
+                dobject->access = -1;
+                dobject->date = -1;
+                dobject->last_modified = -1;
+                dobject->expires = -1;
+            }
+        }
+        array[n++] = dobject;
+    }
+
+    qsort(array, n, sizeof(DiskObjectPtr), dobjectCmp);
+    for(i = n - 1; i >= 0; i = j) {
+        for(j = i - 1; j >= 0; j--) {
+            if(strcmp(array[j]->location, array[i]->location) != 0)
+                break;
+            mergeDobjects(array[i], array[j]);
+        }
+        array[i]->next = dobjects;
+        dobjects = array[i];
+    }
+    free(array);
+    return dobjects;
+}
+
+/* Merge two sorted lists of disk objects */
+static DiskObjectPtr
+mergeDobjectLists(DiskObjectPtr a, DiskObjectPtr b)
+{
+    DiskObjectRec head;
+    DiskObjectPtr tail = &head, next;
+    int c;
+
+    while(a && b) {
+        c = strcmp(a->location, b->location);
+        if(c == 0) {
+            next = b->next;
+            mergeDobjects(a, b);
+            b = next;
+            continue;
+        }
+        if(c < 0) {
+            tail->next = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
 void
 indexDiskObjects(FILE *out, const char *root, int recursive)
 {
@@ -2093,7 +4122,7 @@ indexDiskObjects(FILE *out, const char *root, int recursive)
     char *fts_argv[2];
     FTS *fts;
     FTSENT *fe;
-    DiskObjectPtr dobjects = NULL;
+    DiskObjectPtr dobjects = NULL, indexed = NULL;
     char *of = root[0] == '\0' ? "" : " of ";
 
     fprintf(out, "<!DOCTYPE HTML PUBLIC "
@@ -2119,6 +4148,13 @@ indexDiskObjects(FILE *out, const char *root, int recursive)
         goto trailer;
     }
 
+    if(diskIndexReady()) {
+        indexed = diskIndexObjects(root, recursive);
+        /* All files are in the index, there is no need to look. */
+        if(diskIndexFiles)
+            goto done;
+    }
+
     if(strlen(root) < 8) {
         memcpy(buf, diskCacheRoot->string, diskCacheRoot->length);
         buf[diskCacheRoot->length] = '\0';
@@ -2160,7 +4196,7 @@ indexDiskObjects(FILE *out, const char *root, int recursive)
                     dobjects = processObject(dobjects, buf, NULL);
                 }
                 closedir(dir);
-            } else {
+            } else if(indexed == NULL) {
                 fprintf(out, "<p>Couldn't open directory: %s (%d).</p>\n",
                         strerror(errno), errno);
                 goto trailer;
@@ -2168,6 +4204,8 @@ indexDiskObjects(FILE *out, const char *root, int recursive)
         }
     }
 
+ done:
+    dobjects = mergeDobjectLists(dobjects, indexed);
     if(dobjects) {
         int entryno;
         dobjects = insertRoot(dobjects, root);
@@ -2429,13 +4467,107 @@ expireDiskObjects()
     FTS *fts;
     FTSENT *fe;
     int files = 0, considered = 0, unlinked = 0, truncated = 0;
-    int dirs = 0, rmdirs = 0;
+    int dirs = 0, rmdirs = 0, records = 0, killed = 0;
     long left = 0, total = 0;
+    DiskIndexEntryPtr entry;
+    unsigned int i;
+    struct stat ss;
+    char buf[1024], *cp;
+    time_t t;
+    int n, u;
 
     if(diskCacheRoot == NULL || 
        diskCacheRoot->length <= 0 || diskCacheRoot->string[0] != '/')
         return;
 
+    /* Entries are examined in place; removing an entry moves another
+       one into its slot. */
+    i = 0;
+    while(diskIndexReady() && i < diskIndex->capacity) {
+        updateCurrentTime();
+        entry = &diskIndexEntries[i];
+        if(entry->hash == 0) {
+            i++;
+            continue;
+        }
+        t = DISK_INDEX_UNTIME(entry->access);
+
+        if(entry->segment != DISK_INDEX_FILE) {
+            records++;
+            if(t >= 0 && t < current_time.tv_sec - diskCacheUnlinkTime) {
+                segmentKill(i);
+                killed++;
+                continue;
+            }
+            i++;
+            continue;
+        }
+
+        files++;
+        total += entry->size;
+        n = urlFilename(buf, 1024,
+                        diskIndexHeap + entry->offset, entry->key_size);
+        if(n < 0) {
+            left += entry->size;
+            i++;
+            continue;
+        }
+
+        if(t < 0) {
+            rc = stat(buf, &ss);
+            t = rc < 0 ? current_time.tv_sec : ss.st_mtime;
+        }
+
+        if(t < current_time.tv_sec - diskCacheUnlinkTime) {
+            considered++;
+            rc = unlink(buf);
+            if(rc < 0 && errno != ENOENT) {
+                do_log_error(L_ERROR, errno, "Couldn't unlink %s",
+                             scrub(buf));
+                left += entry->size;
+                i++;
+                continue;
+            }
+            unlinked++;
+            diskIndexRemove(i);
+            cp = strrchr(buf, '/');
+            if(cp) {
+                *cp = '\0';
+                if(rmdir(buf) >= 0) {
+                    dirs++;
+                    rmdirs++;
+                }
+            }
+            continue;
+        }
+
+        if(entry->size > diskCacheTruncateSize &&
+           t < current_time.tv_sec - diskCacheTruncateTime) {
+            rc = stat(buf, &ss);
+            if(rc < 0) {
+                diskIndexRemove(i);
+                continue;
+            }
+            u = unlinked;
+            left += expireFile(buf, &ss, &considered, &unlinked, &truncated);
+            if(unlinked > u) {
+                diskIndexRemove(i);
+                continue;
+            }
+            entry->size = MIN(entry->size, diskCacheTruncateSize);
+            i++;
+            continue;
+        }
+
+        left += entry->size;
+        i++;
+    }
+
+    /* Without diskCacheIndex, or if another instance holds the index,
+       we need to look at all files. */
+    if(diskIndexReady() && diskIndexFiles)
+        goto done;
+
     fts_argv[0] = diskCacheRoot->string;
     fts_argv[1] = NULL;
     fts = fts_open(fts_argv, FTS_LOGICAL, NULL);
@@ -2443,12 +4575,12 @@ expireDiskObjects()
         do_log_error(L_ERROR, errno, "Couldn't fts_open disk cache");
     } else {
         while(1) {
-            gettimeofday(&current_time, NULL);
+            updateCurrentTime();
 
             fe = fts_read(fts);
             if(!fe) break;
 
-            if(fe->fts_info == FTS_D)
+            if(fe->fts_info == FTS_D || isInternalPath(fe->fts_path))
                 continue;
 
             if(fe->fts_info == FTS_DP || fe->fts_info == FTS_DC ||
@@ -2489,11 +4621,14 @@ expireDiskObjects()
         fts_close(fts);
     }
 
+ done:
     printf("Disk cache purged.\n");
     printf("%d files, %d considered, %d removed, %d truncated "
            "(%ldkB -> %ldkB).\n",
            files, considered, unlinked, truncated, total/1024, left/1024);
     printf("%d directories, %d removed.\n", dirs, rmdirs);
+    if(records > 0)
+        printf("%d segment records, %d removed.\n", records, killed);
     return;
 }
 
@@ -2511,6 +4646,12 @@ initDiskcache()
     return;
 }
 
+void
+closeDiskcache()
+{
+    return;
+}
+
 int
 writeoutToDisk(ObjectPtr object, int upto, int max)
 {
@@ -2535,6 +4676,24 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     return 0;
 }
 
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+    return 0;
+}
+
+int
+diskEntryMaySendfile(ObjectPtr object)
+{
+    return 0;
+}
+
+int
+diskEntrySendfileFd(ObjectPtr object, int offset, off_t *position)
+{
+    return -1;
+}
+
 int
 revalidateDiskEntry(ObjectPtr object)
 {
@@ -58,10 +58,14 @@ extern int maxDiskCacheEntrySize;
 
 void preinitDiskcache(void);
 void initDiskcache(void);
+void closeDiskcache(void);
 int destroyDiskEntry(ObjectPtr object, int);
 int diskEntrySize(ObjectPtr object);
 ObjectPtr objectGetFromDisk(ObjectPtr);
 int objectFillFromDisk(ObjectPtr object, int offset, int chunks);
+int objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks);
+int diskEntryMaySendfile(ObjectPtr object);
+int diskEntrySendfileFd(ObjectPtr object, int offset, off_t *position);
 int writeoutMetadata(ObjectPtr object);
 int writeoutToDisk(ObjectPtr object, int upto, int max);
 void dirtyDiskEntry(ObjectPtr object);
@@ -24,15 +24,46 @@ THE SOFTWARE.
 
 #ifdef HAVE_FORK
 static volatile sig_atomic_t exitFlag = 0;
+/* Like exitFlag, but only set by signals, which are forwarded to the
+   workers. */
+static volatile sig_atomic_t signalFlag = 0;
 #else
 static int exitFlag = 0;
 #endif
 static int in_signalCondition = 0;
 
-static TimeEventHandlerPtr timeEventQueue;
-static TimeEventHandlerPtr timeEventQueueLast;
+/* Time events are kept in a binary heap ordered by key, which is never
+   later than the time at which the event is due.  Postponing an event
+   only updates its time; it is moved when its key comes up. */
+static TimeEventHandlerPtr *timeEventHeap = NULL;
+static int timeEventHeapSize = 0;
+static int timeEventNum = 0;
+static unsigned int timeEventSerial = 0;
+
+/* Event handlers are allocated and freed at a high rate; keep them in
+   pools sized for the common payloads. */
+static PoolRec timeEventPool =
+    POOL_INITIALIZER("time events",
+                     sizeof(TimeEventHandlerRec) - 1 + 4 * sizeof(void*));
+#ifdef HAVE_IO_URING
+static PoolRec fdEventPool =
+    POOL_INITIALIZER("fd events",
+                     sizeof(FdEventHandlerRec) - 1 +
+                     sizeof(UringStreamRequestRec));
+#else
+static PoolRec fdEventPool =
+    POOL_INITIALIZER("fd events",
+                     sizeof(FdEventHandlerRec) - 1 + sizeof(StreamRequestRec));
+#endif
+static PoolRec conditionHandlerPool =
+    POOL_INITIALIZER("condition handlers",
+                     sizeof(ConditionHandlerRec) - 1 + 4 * sizeof(void*));
 
+/* Wall-clock time, for HTTP dates and freshness computations, and
+   monotonic time, for time events.  Both are only updated once per
+   iteration of the event loop. */
 struct timeval current_time;
+struct timeval current_monotime;
 struct timeval null_time = {0,0};
 
 static int fdEventSize = 0;
@@ -43,6 +74,78 @@ int diskIsClean = 1;
 
 static int fds_invalid = 0;
 
+/* Maps a file descriptor to its index in poll_fds, so that we never
+   need to scan the whole array.  The serial is bumped whenever an
+   index is allocated, which allows epoll to detect stale events. */
+typedef struct _FdSlot {
+    int index;
+    unsigned int serial;
+#ifdef HAVE_IO_URING
+    short armed;
+    unsigned int armed_serial;
+#endif
+} FdSlotRec, *FdSlotPtr;
+
+static FdSlotPtr fdSlots = NULL;
+static int fdSlotsSize = 0;
+static unsigned int fdSerial = 0;
+
+#ifdef HAVE_EPOLL
+int useEpoll = 1;
+static int epoll_fd = -1;
+static struct epoll_event *epoll_events = NULL;
+static int epoll_events_size = 0;
+#endif
+
+#ifdef HAVE_IO_URING
+/* With io_uring, stream I/O, accepts and connects are submitted as
+   requests in their own right, and their handlers are called when they
+   complete.  Other handlers use one-shot poll requests.  Requests are
+   queued as handlers are registered, and submitted together with the
+   wait. */
+int useIoUring = 0;
+static int uring_fd = -1;
+static void *uring_sq_ptr = NULL, *uring_cq_ptr = NULL;
+static size_t uring_sq_size = 0, uring_cq_size = 0;
+static struct io_uring_sqe *uring_sqes = NULL;
+static size_t uring_sqes_size = 0;
+static unsigned *uring_sq_head, *uring_sq_tail, *uring_sq_array;
+static unsigned *uring_cq_head, *uring_cq_tail;
+static unsigned uring_sq_mask, uring_sq_entries, uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+static unsigned uring_sq_local_tail;
+#define URING_ENTRIES 4096
+#define URING_IGNORE 0xFFFFFFFFULL
+static int uringInit(void);
+#endif
+
+/* Latency statistics for event handlers, kept as log-linear histograms
+   with four buckets per power of two microseconds. */
+#define PROBE_BUCKETS 128
+#define PROBE_HASH_SIZE 64
+
+typedef struct _HandlerStatistics {
+    void *key;
+    const char *name;
+    int kind;
+    unsigned long count;
+    long long total;
+    int max;
+    unsigned int buckets[PROBE_BUCKETS];
+    struct _HandlerStatistics *next;
+} HandlerStatisticsRec, *HandlerStatisticsPtr;
+
+int handlerStatistics = 0;
+int slowHandlerThreshold = 0;
+static HandlerStatisticsPtr handlerStatisticsTable[PROBE_HASH_SIZE];
+static int handlerStatisticsCount = 0;
+
+int numWorkers = 1;
+#ifdef HAVE_FORK
+static pid_t *workers = NULL;
+static int workersNum = 0;
+#endif
+
 static inline int
 timeval_cmp(struct timeval *t1, struct timeval *t2)
 {
@@ -77,6 +180,290 @@ timeval_minus_usec(const struct timeval *s1, const struct timeval *s2)
     return (s1->tv_sec - s2->tv_sec) * 1000000 + s1->tv_usec - s2->tv_usec;
 }
 
+long long
+probeTime()
+{
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) >= 0)
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Returns 0 if we're not interested in timing handlers. */
+long long
+eventProbeStart()
+{
+    if(!handlerStatistics && slowHandlerThreshold <= 0)
+        return 0;
+    return probeTime();
+}
+
+static int
+probeBucket(unsigned int usec)
+{
+    int b = 0;
+    while(usec >= 8) {
+        usec >>= 1;
+        b++;
+    }
+    return b * 4 + usec;
+}
+
+static unsigned int
+probeBucketMax(int i)
+{
+    if(i < 8)
+        return i;
+    return ((unsigned int)(i % 4 + 5) << (i / 4 - 1)) - 1;
+}
+
+static const char *
+probeKindName(int kind)
+{
+    switch(kind) {
+    case EVENT_PROBE_FD: return "fd";
+    case EVENT_PROBE_TIME: return "time";
+    case EVENT_PROBE_CONDITION: return "condition";
+    default: return "function";
+    }
+}
+
+static const char *
+probeName(HandlerStatisticsPtr stats, char *buf, int n)
+{
+#ifdef HAVE_DLADDR
+    Dl_info info;
+#endif
+    if(stats->name)
+        return stats->name;
+#ifdef HAVE_DLADDR
+    if(dladdr(stats->key, &info)) {
+        if(info.dli_sname)
+            return info.dli_sname;
+        /* Static symbols are not exported; print something suitable
+           for addr2line -f. */
+        snprintf(buf, n, "%s+0x%lx",
+                 info.dli_fname && strrchr(info.dli_fname, '/') ?
+                 strrchr(info.dli_fname, '/') + 1 : "polipo",
+                 (unsigned long)((char*)stats->key - (char*)info.dli_fbase));
+        return buf;
+    }
+#endif
+    snprintf(buf, n, "0x%lx", (unsigned long)stats->key);
+    return buf;
+}
+
+void
+eventProbeEnd(long long start, void *key, const char *name, int kind)
+{
+    HandlerStatisticsPtr stats;
+    long long d;
+    int usec, h;
+
+    if(start == 0)
+        return;
+
+    d = probeTime() - start;
+    usec = d < 0 ? 0 : d > INT_MAX ? INT_MAX : (int)d;
+
+    if(slowHandlerThreshold > 0 && usec >= slowHandlerThreshold * 1000) {
+        char buf[40];
+        HandlerStatisticsRec tmp;
+        tmp.key = key;
+        tmp.name = name;
+        do_log(L_WARN, "Slow %s handler %s: %d.%03d ms.\n",
+               probeKindName(kind), probeName(&tmp, buf, 40),
+               usec / 1000, usec % 1000);
+    }
+
+    if(!handlerStatistics)
+        return;
+
+    h = ((unsigned long)key >> 4) % PROBE_HASH_SIZE;
+    stats = handlerStatisticsTable[h];
+    while(stats) {
+        if(stats->key == key && stats->kind == kind)
+            break;
+        stats = stats->next;
+    }
+    if(stats == NULL) {
+        stats = calloc(1, sizeof(HandlerStatisticsRec));
+        if(stats == NULL)
+            return;
+        stats->key = key;
+        stats->name = name;
+        stats->kind = kind;
+        stats->next = handlerStatisticsTable[h];
+        handlerStatisticsTable[h] = stats;
+        handlerStatisticsCount++;
+    }
+
+    stats->count++;
+    stats->total += usec;
+    if(usec > stats->max)
+        stats->max = usec;
+    stats->buckets[probeBucket(usec)]++;
+}
+
+static unsigned int
+probePercentile(HandlerStatisticsPtr stats, double q)
+{
+    unsigned long n = 0, target = (unsigned long)(q * stats->count + 0.5);
+    int i;
+
+    if(target < 1)
+        target = 1;
+    for(i = 0; i < PROBE_BUCKETS; i++) {
+        n += stats->buckets[i];
+        if(n >= target)
+            return MIN(probeBucketMax(i), (unsigned int)stats->max);
+    }
+    return stats->max;
+}
+
+static int
+statisticsCmp(const void *a, const void *b)
+{
+    HandlerStatisticsPtr s1 = *(HandlerStatisticsPtr*)a;
+    HandlerStatisticsPtr s2 = *(HandlerStatisticsPtr*)b;
+    if(s1->total > s2->total)
+        return -1;
+    else if(s1->total < s2->total)
+        return 1;
+    return 0;
+}
+
+void
+listHandlerStatistics(FILE *out)
+{
+    HandlerStatisticsPtr stats, *all;
+    int i, n;
+    char buf[40];
+    const char *name;
+
+    fprintf(out, "<!DOCTYPE HTML PUBLIC "
+            "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+            "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+            "<html><head>\n"
+            "<title>Event handlers</title>\n"
+            "</head><body>\n"
+            "<h1>Event handlers</h1>\n");
+
+    if(!handlerStatistics)
+        fprintf(out, "<p>Statistics are not being collected; "
+                "set handlerStatistics to enable them.</p>\n");
+
+    all = malloc(MAX(handlerStatisticsCount, 1) *
+                 sizeof(HandlerStatisticsPtr));
+    if(all == NULL) {
+        fprintf(out, "<p>Couldn't allocate statistics.</p>\n");
+        goto done;
+    }
+    n = 0;
+    for(i = 0; i < PROBE_HASH_SIZE; i++) {
+        stats = handlerStatisticsTable[i];
+        while(stats && n < handlerStatisticsCount) {
+            all[n++] = stats;
+            stats = stats->next;
+        }
+    }
+    qsort(all, n, sizeof(HandlerStatisticsPtr), statisticsCmp);
+
+    alternatingHttpStyle(out, "handlers");
+    fprintf(out, "<table id=handlers>\n");
+    fprintf(out, "<thead><tr><th>Handler</th>"
+            "<th>Kind</th>"
+            "<th>Calls</th>"
+            "<th>Total</th>"
+            "<th>Mean</th>"
+            "<th>50%%</th>"
+            "<th>99%%</th>"
+            "<th>99.9%%</th>"
+            "<th>Max</th>"
+            "</tr></thead>\n");
+    fprintf(out, "<tbody>\n");
+    for(i = 0; i < n; i++) {
+        stats = all[i];
+        fprintf(out, "<tr class=\"%s\">", i % 2 == 0 ? "even" : "odd");
+        fprintf(out, "<td>");
+        name = probeName(stats, buf, 40);
+        htmlPrint(out, (char*)name, strlen(name));
+        fprintf(out, "</td><td>%s</td><td>%lu</td><td>%.3f</td>",
+                probeKindName(stats->kind), stats->count,
+                (double)stats->total / 1000000.0);
+        fprintf(out, "<td>%.3f</td><td>%.3f</td><td>%.3f</td>"
+                "<td>%.3f</td><td>%.3f</td></tr>\n",
+                (double)stats->total / stats->count / 1000.0,
+                probePercentile(stats, 0.5) / 1000.0,
+                probePercentile(stats, 0.99) / 1000.0,
+                probePercentile(stats, 0.999) / 1000.0,
+                stats->max / 1000.0);
+    }
+    fprintf(out, "</tbody>\n");
+    fprintf(out, "</table>\n");
+    fprintf(out, "<p>Total time is in seconds, other times in "
+            "milliseconds.</p>\n");
+    free(all);
+
+ done:
+    fprintf(out, "<p><a href=\"/polipo/\">back</a></p>");
+    fprintf(out, "</body></html>\n");
+}
+
+void
+preinitEvents()
+{
+#ifdef HAVE_EPOLL
+    CONFIG_VARIABLE(useEpoll, CONFIG_BOOLEAN,
+                    "Use epoll rather than poll for event notification.");
+#endif
+#ifdef HAVE_IO_URING
+    CONFIG_VARIABLE(useIoUring, CONFIG_BOOLEAN,
+                    "Use io_uring for network I/O.");
+#endif
+    CONFIG_VARIABLE_SETTABLE(handlerStatistics, CONFIG_BOOLEAN,
+                             configIntSetter,
+                             "Keep latency statistics for event handlers.");
+    CONFIG_VARIABLE_SETTABLE(slowHandlerThreshold, CONFIG_INT,
+                             configIntSetter,
+                             "Log event handlers slower than this (in ms).");
+#ifdef HAVE_FORK
+    CONFIG_VARIABLE(numWorkers, CONFIG_INT,
+                    "Number of worker processes sharing the proxy port.");
+#endif
+}
+
+void
+updateCurrentTime()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    int rc;
+
+    rc = clock_gettime(CLOCK_REALTIME, &ts);
+    if(rc >= 0) {
+        current_time.tv_sec = ts.tv_sec;
+        current_time.tv_usec = ts.tv_nsec / 1000;
+    } else {
+        gettimeofday(&current_time, NULL);
+    }
+
+    rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    if(rc >= 0) {
+        current_monotime.tv_sec = ts.tv_sec;
+        current_monotime.tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#else
+    gettimeofday(&current_time, NULL);
+#endif
+    current_monotime = current_time;
+}
+
 #ifdef HAVE_FORK
 static void
 sigexit(int signo)
@@ -87,6 +474,7 @@ sigexit(int signo)
         exitFlag = 2;
     else
         exitFlag = 3;
+    signalFlag = exitFlag;
 }
 #endif
 
@@ -134,13 +522,36 @@ initEvents()
     sigaction(SIGUSR2, &sa, NULL);
 #endif
 
-    timeEventQueue = NULL;
-    timeEventQueueLast = NULL;
+    timeEventHeap = NULL;
+    timeEventHeapSize = 0;
+    timeEventNum = 0;
     fdEventSize = 0;
     fdEventNum = 0;
     poll_fds = NULL;
     fdEvents = NULL;
     fdEventsLast = NULL;
+    fdSlots = NULL;
+    fdSlotsSize = 0;
+
+#ifdef HAVE_IO_URING
+    uring_fd = -1;
+    if(useIoUring)
+        uringInit();
+#endif
+
+#ifdef HAVE_EPOLL
+    epoll_fd = -1;
+#ifdef HAVE_IO_URING
+    if(useEpoll && uring_fd < 0) {
+#else
+    if(useEpoll) {
+#endif
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0)
+            do_log_error(L_WARN, errno,
+                         "Couldn't create epoll instance, using poll");
+    }
+#endif
 }
 
 void
@@ -180,6 +591,28 @@ uninitEvents(void)
     sa.sa_flags = 0;
     sigaction(SIGUSR2, &sa, NULL);
 #endif
+
+#ifdef HAVE_EPOLL
+    /* We're in a child.  Drop our copies of the parent's fds, lest they
+       remain registered with its epoll instance after it closes them. */
+    if(epoll_fd >= 0) {
+        int i;
+        for(i = 0; i < fdEventNum; i++)
+            close(poll_fds[i].fd);
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    /* The rings are shared with the parent; don't touch them. */
+    if(uring_fd >= 0) {
+        int i;
+        for(i = 0; i < fdEventNum; i++)
+            close(poll_fds[i].fd);
+        close(uring_fd);
+        uring_fd = -1;
+    }
+#endif
 }
 
 #ifdef HAVE_FORK
@@ -198,57 +631,123 @@ interestingSignals(sigset_t *ss)
 void
 timeToSleep(struct timeval *time)
 {
-    if(!timeEventQueue) {
+    if(timeEventNum == 0) {
         time->tv_sec = ~0L;
         time->tv_usec = ~0L;
     } else {
-        *time = timeEventQueue->time;
+        *time = timeEventHeap[0]->key;
+    }
+}
+
+static inline int
+timeEventBefore(TimeEventHandlerPtr e1, TimeEventHandlerPtr e2)
+{
+    int c = timeval_cmp(&e1->key, &e2->key);
+    if(c != 0)
+        return c < 0;
+    /* Events with the same key run in the order they were queued. */
+    return (int)(e1->serial - e2->serial) < 0;
+}
+
+static inline void
+timeEventHeapSet(int i, TimeEventHandlerPtr event)
+{
+    timeEventHeap[i] = event;
+    event->index = i;
+}
+
+static void
+timeEventHeapUp(int i)
+{
+    TimeEventHandlerPtr event = timeEventHeap[i];
+
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(!timeEventBefore(event, timeEventHeap[parent]))
+            break;
+        timeEventHeapSet(i, timeEventHeap[parent]);
+        i = parent;
+    }
+    timeEventHeapSet(i, event);
+}
+
+static void
+timeEventHeapDown(int i)
+{
+    TimeEventHandlerPtr event = timeEventHeap[i];
+
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= timeEventNum)
+            break;
+        if(child + 1 < timeEventNum &&
+           timeEventBefore(timeEventHeap[child + 1], timeEventHeap[child]))
+            child++;
+        if(!timeEventBefore(timeEventHeap[child], event))
+            break;
+        timeEventHeapSet(i, timeEventHeap[child]);
+        i = child;
+    }
+    timeEventHeapSet(i, event);
+}
+
+static void
+dequeueTimeEvent(TimeEventHandlerPtr event)
+{
+    int i = event->index;
+
+    assert(i >= 0 && i < timeEventNum && timeEventHeap[i] == event);
+    timeEventNum--;
+    if(i < timeEventNum) {
+        timeEventHeapSet(i, timeEventHeap[timeEventNum]);
+        if(i > 0 && timeEventBefore(timeEventHeap[i],
+                                    timeEventHeap[(i - 1) / 2]))
+            timeEventHeapUp(i);
+        else
+            timeEventHeapDown(i);
     }
+    event->index = -1;
 }
 
 static TimeEventHandlerPtr
 enqueueTimeEvent(TimeEventHandlerPtr event)
 {
-    TimeEventHandlerPtr otherevent;
-
-    /* We try to optimise two cases -- the event happens very soon, or
-       it happens after most of the other events. */
-    if(timeEventQueue == NULL ||
-       timeval_cmp(&event->time, &timeEventQueue->time) < 0) {
-        /* It's the first event */
-        event->next = timeEventQueue;
-        event->previous = NULL;
-        if(timeEventQueue) {
-            timeEventQueue->previous = event;
-        } else {
-            timeEventQueueLast = event;
-        }
-        timeEventQueue = event;
-    } else if(timeval_cmp(&event->time, &timeEventQueueLast->time) >= 0) {
-        /* It's the last one */
-        event->next = NULL;
-        event->previous = timeEventQueueLast;
-        timeEventQueueLast->next = event;
-        timeEventQueueLast = event;
-    } else {
-        /* Walk from the end */
-        otherevent = timeEventQueueLast;
-        while(otherevent->previous &&
-              timeval_cmp(&event->time, &otherevent->previous->time) < 0) {
-            otherevent = otherevent->previous;
-        }
-        event->next = otherevent;
-        event->previous = otherevent->previous;
-        if(otherevent->previous) {
-            otherevent->previous->next = event;
-        } else {
-            timeEventQueue = event;
-        }
-        otherevent->previous = event;
+    if(timeEventNum >= timeEventHeapSize) {
+        TimeEventHandlerPtr *new_heap;
+        int new_size = 2 * timeEventHeapSize + 16;
+        new_heap = realloc(timeEventHeap,
+                           new_size * sizeof(TimeEventHandlerPtr));
+        if(new_heap == NULL)
+            return NULL;
+        timeEventHeap = new_heap;
+        timeEventHeapSize = new_size;
     }
+
+    event->key = event->time;
+    event->serial = timeEventSerial++;
+    timeEventHeapSet(timeEventNum, event);
+    timeEventNum++;
+    timeEventHeapUp(timeEventNum - 1);
     return event;
 }
 
+static void
+timeEventWhen(struct timeval *when, int seconds)
+{
+    /* Immediate events are due now rather than at time zero, so that
+       they queue behind the timers that are already due. */
+    *when = current_monotime;
+    if(seconds > 0)
+        when->tv_sec += seconds;
+}
+
+static void
+freeTimeEvent(TimeEventHandlerPtr event)
+{
+    poolFree(&timeEventPool, event,
+             sizeof(TimeEventHandlerRec) - 1 + event->dsize);
+}
+
 TimeEventHandlerPtr
 scheduleTimeEvent(int seconds,
                   int (*handler)(TimeEventHandlerPtr), int dsize, void *data)
@@ -256,15 +755,9 @@ scheduleTimeEvent(int seconds,
     struct timeval when;
     TimeEventHandlerPtr event;
 
-    if(seconds >= 0) {
-        when = current_time;
-        when.tv_sec += seconds;
-    } else {
-        when.tv_sec = 0;
-        when.tv_usec = 0;
-    }
+    timeEventWhen(&when, seconds);
 
-    event = malloc(sizeof(TimeEventHandlerRec) - 1 + dsize);
+    event = poolAlloc(&timeEventPool, sizeof(TimeEventHandlerRec) - 1 + dsize);
     if(event == NULL) {
         do_log(L_ERROR, "Couldn't allocate time event handler -- "
                "discarding all objects.\n");
@@ -273,6 +766,7 @@ scheduleTimeEvent(int seconds,
     }
 
     event->time = when;
+    event->dsize = dsize;
     event->handler = handler;
     /* Let the compiler optimise the common case */
     if(dsize == sizeof(void*))
@@ -280,27 +774,461 @@ scheduleTimeEvent(int seconds,
     else if(dsize > 0)
         memcpy(event->data, data, dsize);
 
-    return enqueueTimeEvent(event);
+    if(enqueueTimeEvent(event) == NULL) {
+        do_log(L_ERROR, "Couldn't grow time event queue -- "
+               "discarding all objects.\n");
+        freeTimeEvent(event);
+        exitFlag = 2;
+        return NULL;
+    }
+    return event;
+}
+
+void
+rescheduleTimeEvent(TimeEventHandlerPtr event, int seconds)
+{
+    timeEventWhen(&event->time, seconds);
+    /* Postponing is the common case, and is done lazily. */
+    if(timeval_cmp(&event->time, &event->key) < 0) {
+        event->key = event->time;
+        timeEventHeapUp(event->index);
+    }
 }
 
 void
 cancelTimeEvent(TimeEventHandlerPtr event)
 {
-    if(event == timeEventQueue)
-        timeEventQueue = event->next;
-    if(event == timeEventQueueLast)
-        timeEventQueueLast = event->previous;
-    if(event->next)
-        event->next->previous = event->previous;
-    if(event->previous)
-        event->previous->next = event->next;
-    free(event);
+    dequeueTimeEvent(event);
+    freeTimeEvent(event);
 }
 
+static FdSlotPtr
+fdSlot(int fd)
+{
+    if(fd < 0)
+        return NULL;
+
+    if(fd >= fdSlotsSize) {
+        FdSlotPtr new_fdSlots;
+        int new_size = MAX(fd + 1, 2 * fdSlotsSize);
+        int j;
+
+        new_fdSlots = realloc(fdSlots, new_size * sizeof(FdSlotRec));
+        if(!new_fdSlots)
+            return NULL;
+        for(j = fdSlotsSize; j < new_size; j++) {
+            new_fdSlots[j].index = -1;
+            new_fdSlots[j].serial = 0;
+#ifdef HAVE_IO_URING
+            new_fdSlots[j].armed = 0;
+            new_fdSlots[j].armed_serial = 0;
+#endif
+        }
+        fdSlots = new_fdSlots;
+        fdSlotsSize = new_size;
+    }
+    return &fdSlots[fd];
+}
+
+static inline int
+findFdEventNum(int fd)
+{
+    if(fd < 0 || fd >= fdSlotsSize)
+        return -1;
+    return fdSlots[fd].index;
+}
+
+#ifdef HAVE_EPOLL
+static int
+epollControl(int op, int fd, int events)
+{
+    struct epoll_event ev;
+    int rc;
+
+    memset(&ev, 0, sizeof(ev));
+    if(events & POLLIN)
+        ev.events |= EPOLLIN;
+    if(events & POLLOUT)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = ((unsigned long long)fdSlots[fd].serial << 32) |
+        (unsigned int)fd;
+
+    rc = epoll_ctl(epoll_fd, op, fd, &ev);
+    /* The kernel silently drops closed fds from the set, and a new fd
+       may have been given the same number since. */
+    if(rc < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    else if(rc < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    return rc;
+}
+
+static int
+epollRevents(unsigned int events)
+{
+    int revents = 0;
+    if(events & EPOLLIN)
+        revents |= POLLIN;
+    if(events & EPOLLOUT)
+        revents |= POLLOUT;
+    if(events & EPOLLERR)
+        revents |= POLLERR;
+    if(events & EPOLLHUP)
+        revents |= POLLHUP;
+    return revents;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+static int
+uringEnter(unsigned to_submit, unsigned min_complete, unsigned flags,
+           void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, uring_fd, to_submit, min_complete,
+                   flags, arg, argsz);
+}
+
+static void
+uringUnmap()
+{
+    if(uring_sqes)
+        munmap(uring_sqes, uring_sqes_size);
+    if(uring_cq_ptr && uring_cq_ptr != uring_sq_ptr)
+        munmap(uring_cq_ptr, uring_cq_size);
+    if(uring_sq_ptr)
+        munmap(uring_sq_ptr, uring_sq_size);
+    uring_sqes = NULL;
+    uring_sq_ptr = uring_cq_ptr = NULL;
+}
+
+static int
+uringInit()
+{
+    struct io_uring_params p;
+    unsigned required;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(fd < 0) {
+        do_log_error(L_WARN, errno, "Couldn't set up io_uring");
+        return -1;
+    }
+
+    required = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if((p.features & required) != required) {
+        do_log(L_WARN, "Kernel io_uring is too old, not using it.\n");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    uring_fd = fd;
+
+    uring_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        uring_sq_size = uring_cq_size = MAX(uring_sq_size, uring_cq_size);
+
+    uring_sq_ptr = mmap(NULL, uring_sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(uring_sq_ptr == MAP_FAILED) {
+        uring_sq_ptr = NULL;
+        goto fail;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        uring_cq_ptr = uring_sq_ptr;
+    } else {
+        uring_cq_ptr = mmap(NULL, uring_cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(uring_cq_ptr == MAP_FAILED) {
+            uring_cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    uring_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring_sqes = mmap(NULL, uring_sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(uring_sqes == MAP_FAILED) {
+        uring_sqes = NULL;
+        goto fail;
+    }
+
+    uring_sq_head = (unsigned*)((char*)uring_sq_ptr + p.sq_off.head);
+    uring_sq_tail = (unsigned*)((char*)uring_sq_ptr + p.sq_off.tail);
+    uring_sq_array = (unsigned*)((char*)uring_sq_ptr + p.sq_off.array);
+    uring_sq_mask = *(unsigned*)((char*)uring_sq_ptr + p.sq_off.ring_mask);
+    uring_sq_entries = p.sq_entries;
+    uring_cq_head = (unsigned*)((char*)uring_cq_ptr + p.cq_off.head);
+    uring_cq_tail = (unsigned*)((char*)uring_cq_ptr + p.cq_off.tail);
+    uring_cq_mask = *(unsigned*)((char*)uring_cq_ptr + p.cq_off.ring_mask);
+    uring_cqes =
+        (struct io_uring_cqe*)((char*)uring_cq_ptr + p.cq_off.cqes);
+    uring_sq_local_tail = *uring_sq_tail;
+    return 1;
+
+ fail:
+    do_log_error(L_WARN, errno, "Couldn't map io_uring");
+    uringUnmap();
+    close(fd);
+    uring_fd = -1;
+    return -1;
+}
+
+/* Submit whatever has been queued, and optionally wait. */
+static int
+uringSubmit(unsigned min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+
+    __atomic_store_n(uring_sq_tail, uring_sq_local_tail, __ATOMIC_RELEASE);
+    to_submit =
+        uring_sq_local_tail - __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    if(min_complete > 0 && timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+    }
+    if(to_submit == 0 && min_complete == 0)
+        return 0;
+    return uringEnter(to_submit, min_complete,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *
+uringGetSqe()
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, i;
+
+    head = __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE);
+    if(uring_sq_local_tail - head >= uring_sq_entries) {
+        if(uringSubmit(0, 0) < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't submit to io_uring");
+            return NULL;
+        }
+        head = __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE);
+        if(uring_sq_local_tail - head >= uring_sq_entries)
+            return NULL;
+    }
+
+    i = uring_sq_local_tail & uring_sq_mask;
+    sqe = &uring_sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    uring_sq_array[i] = i;
+    uring_sq_local_tail++;
+    return sqe;
+}
+
+/* Poll requests are tagged with the fd and the serial of the request,
+   completion requests with a pointer to the handler and the low bit
+   set. */
+static inline unsigned long long
+uringUserData(int fd, unsigned int serial)
+{
+    return ((unsigned long long)serial << 32) | ((unsigned int)fd << 1);
+}
+
+static inline unsigned long long
+uringEventData(FdEventHandlerPtr event)
+{
+    return (unsigned long long)(uintptr_t)event | 1;
+}
+
+/* Make sure that the poll request for fd matches its handlers.  We
+   leave a request alone if it asks for more events than needed; any
+   spurious wakeups will cause it to be trimmed. */
+static int
+uringArm(int fd)
+{
+    FdSlotPtr slot = &fdSlots[fd];
+    struct io_uring_sqe *sqe;
+    int events;
+
+    events = slot->index >= 0 ?
+        poll_fds[slot->index].events & (POLLIN | POLLOUT) : 0;
+
+    if(slot->armed) {
+        if(slot->index >= 0 && (events & ~slot->armed) == 0)
+            return 1;
+        sqe = uringGetSqe();
+        if(sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uringUserData(fd, slot->armed_serial);
+        sqe->user_data = URING_IGNORE;
+        slot->armed = 0;
+    }
+
+    if(events) {
+        sqe = uringGetSqe();
+        if(sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        slot->armed = events;
+        slot->armed_serial = ++fdSerial;
+        sqe->user_data = uringUserData(fd, slot->armed_serial);
+    }
+    return 1;
+}
+
+/* Ask the kernel to cancel the request of a completion handler.  The
+   handler is only called when the request itself completes, since
+   until then the kernel may still be using its buffers. */
+static void
+uringCancel(FdEventHandlerPtr event)
+{
+    struct io_uring_sqe *sqe;
+
+    if(event->uring & URING_CANCELLING)
+        return;
+    event->uring |= URING_CANCELLING;
+    sqe = uringGetSqe();
+    if(sqe == NULL) {
+        do_log(L_ERROR, "Couldn't cancel request on fd %d.\n", event->fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uringEventData(event);
+    sqe->user_data = URING_IGNORE;
+}
+#endif
+
+#ifdef HAVE_FORK
+static void
+resetEventsAfterFork()
+{
+#ifdef HAVE_EPOLL
+    /* The epoll instance is shared with our parent, so get our own. */
+    if(epoll_fd >= 0) {
+        int i, rc;
+        close(epoll_fd);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0) {
+            do_log_error(L_WARN, errno,
+                         "Couldn't create epoll instance, using poll");
+            return;
+        }
+        for(i = 0; i < fdEventNum; i++) {
+            rc = epollControl(EPOLL_CTL_ADD, poll_fds[i].fd,
+                              poll_fds[i].events);
+            if(rc < 0)
+                do_log_error(L_ERROR, errno,
+                             "Couldn't register fd %d", poll_fds[i].fd);
+        }
+    }
+#endif
+#ifdef HAVE_IO_URING
+    /* Likewise for the rings, which are shared memory.  Completion
+       requests are only submitted once the workers are running, so
+       there are none to carry over. */
+    if(uring_fd >= 0) {
+        int fd;
+        uringUnmap();
+        close(uring_fd);
+        uring_fd = -1;
+        if(uringInit() < 0) {
+            do_log(L_ERROR, "Couldn't set up io_uring in worker.\n");
+            exit(1);
+        }
+        for(fd = 0; fd < fdSlotsSize; fd++) {
+            fdSlots[fd].armed = 0;
+            if(fdSlots[fd].index >= 0)
+                uringArm(fd);
+        }
+    }
+#endif
+}
+
+/* Fork n - 1 additional copies of ourselves, each of which runs its own
+   event loop, with its own memory cache and its own listening socket.
+   The original process remains a worker, and forwards signals to the
+   others.  Returns the index of the worker we are. */
+int
+startWorkers(int n)
+{
+    int i;
+    pid_t pid;
+
+    if(n <= 1)
+        return 0;
+
+    workers = calloc(n - 1, sizeof(pid_t));
+    if(workers == NULL) {
+        do_log(L_ERROR, "Couldn't allocate workers.\n");
+        return 0;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for(i = 1; i < n; i++) {
+        pid = fork();
+        if(pid < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't fork worker");
+            break;
+        }
+        if(pid == 0) {
+            free(workers);
+            workers = NULL;
+            workersNum = 0;
+#ifdef PR_SET_PDEATHSIG
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            resetEventsAfterFork();
+            return i;
+        }
+        workers[workersNum++] = pid;
+    }
+    return 0;
+}
+
+static void
+signalWorkers(int flag)
+{
+    int i, rc, status;
+
+    for(i = 0; i < workersNum; i++)
+        kill(workers[i],
+             flag == 1 ? SIGUSR1 : flag == 2 ? SIGUSR2 : SIGTERM);
+
+    if(flag >= 3) {
+        for(i = 0; i < workersNum; i++) {
+            do {
+                rc = waitpid(workers[i], &status, 0);
+            } while(rc < 0 && errno == EINTR);
+        }
+        workersNum = 0;
+    }
+}
+#else
+int
+startWorkers(int n)
+{
+    if(n > 1)
+        do_log(L_WARN, "Cannot run multiple workers on this platform.\n");
+    return 0;
+}
+#endif
+
 int
 allocateFdEventNum(int fd)
 {
     int i;
+    FdSlotPtr slot;
+
+    slot = fdSlot(fd);
+    if(!slot)
+        return -1;
+
     if(fdEventNum < fdEventSize) {
         i = fdEventNum;
         fdEventNum++;
@@ -333,6 +1261,8 @@ allocateFdEventNum(int fd)
     poll_fds[i].revents = 0;
     fdEvents[i] = NULL;
     fdEventsLast[i] = NULL;
+    slot->index = i;
+    slot->serial = ++fdSerial;
     fds_invalid = 1;
     return i;
 }
@@ -340,13 +1270,27 @@ allocateFdEventNum(int fd)
 void
 deallocateFdEventNum(int i)
 {
-    if(i < fdEventNum - 1) {
-        memmove(&poll_fds[i], &poll_fds[i + 1], 
-                (fdEventNum - i - 1) * sizeof(struct pollfd));
-        memmove(&fdEvents[i], &fdEvents[i + 1],
-                (fdEventNum - i - 1) * sizeof(FdEventHandlerPtr));
-        memmove(&fdEventsLast[i], &fdEventsLast[i + 1],
-                (fdEventNum - i - 1) * sizeof(FdEventHandlerPtr));
+    int last = fdEventNum - 1;
+
+#ifdef HAVE_EPOLL
+    /* This fails harmlessly if the fd has already been closed. */
+    if(epoll_fd >= 0)
+        epollControl(EPOLL_CTL_DEL, poll_fds[i].fd, 0);
+#endif
+
+    fdSlots[poll_fds[i].fd].index = -1;
+#ifdef HAVE_IO_URING
+    /* A pending poll request holds a reference to the file, so it
+       must be cancelled even if the fd has been closed. */
+    if(uring_fd >= 0)
+        uringArm(poll_fds[i].fd);
+#endif
+    /* Order doesn't matter, so fill the hole with the last entry. */
+    if(i < last) {
+        poll_fds[i] = poll_fds[last];
+        fdEvents[i] = fdEvents[last];
+        fdEventsLast[i] = fdEventsLast[last];
+        fdSlots[poll_fds[i].fd].index = i;
     }
     fdEventNum--;
     fds_invalid = 1;
@@ -358,7 +1302,7 @@ makeFdEvent(int fd, int poll_events,
 {
     FdEventHandlerPtr event;
 
-    event = malloc(sizeof(FdEventHandlerRec) - 1 + dsize);
+    event = poolAlloc(&fdEventPool, sizeof(FdEventHandlerRec) - 1 + dsize);
     if(event == NULL) {
         do_log(L_ERROR, "Couldn't allocate fd event handler -- "
                "discarding all objects.\n");
@@ -367,6 +1311,12 @@ makeFdEvent(int fd, int poll_events,
     }
     event->fd = fd;
     event->poll_events = poll_events;
+    event->dsize = dsize;
+#ifdef HAVE_IO_URING
+    event->uring = 0;
+    event->status = 0;
+    event->result = 0;
+#endif
     event->handler = handler;
     /* Let the compiler optimise the common cases */
     if(dsize == sizeof(void*))
@@ -378,23 +1328,65 @@ makeFdEvent(int fd, int poll_events,
     return event;
 }
 
+void
+freeFdEvent(FdEventHandlerPtr event)
+{
+    poolFree(&fdEventPool, event, sizeof(FdEventHandlerRec) - 1 + event->dsize);
+}
+
 FdEventHandlerPtr
 registerFdEventHelper(FdEventHandlerPtr event)
 {
-    int i;
+    int i, events;
     int fd = event->fd;
+    int allocated = 0;
 
-    for(i = 0; i < fdEventNum; i++)
-        if(poll_fds[i].fd == fd)
-            break;
-
-    if(i >= fdEventNum)
+    i = findFdEventNum(fd);
+    if(i < 0) {
         i = allocateFdEventNum(fd);
+        allocated = 1;
+    }
     if(i < 0) {
-        free(event);
+        freeFdEvent(event);
         return NULL;
     }
 
+    events = poll_fds[i].events;
+#ifdef HAVE_IO_URING
+    /* Completion handlers don't need the fd to be polled. */
+    if(!(event->uring & URING_COMPLETION))
+#endif
+        events |= event->poll_events;
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0 && (allocated || events != poll_fds[i].events)) {
+        int rc;
+        rc = epollControl(allocated ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                          fd, events);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't register fd %d", fd);
+            if(allocated)
+                deallocateFdEventNum(i);
+            freeFdEvent(event);
+            return NULL;
+        }
+    }
+#endif
+
+#ifdef HAVE_IO_URING
+    if(uring_fd >= 0) {
+        int old_events = poll_fds[i].events;
+        poll_fds[i].events = events;
+        if(uringArm(fd) < 0) {
+            do_log(L_ERROR, "Couldn't register fd %d.\n", fd);
+            poll_fds[i].events = old_events;
+            if(allocated)
+                deallocateFdEventNum(i);
+            freeFdEvent(event);
+            return NULL;
+        }
+    }
+#endif
+
     event->next = NULL;
     event->previous = fdEventsLast[i];
     if(fdEvents[i] == NULL) {
@@ -403,7 +1395,7 @@ registerFdEventHelper(FdEventHandlerPtr event)
         fdEventsLast[i]->next = event;
     }
     fdEventsLast[i] = event;
-    poll_fds[i].events |= event->poll_events;
+    poll_fds[i].events = events;
 
     return event;
 }
@@ -421,12 +1413,52 @@ registerFdEvent(int fd, int poll_events,
     return registerFdEventHelper(event);
 }
 
+#ifdef HAVE_IO_URING
+int
+uringActive()
+{
+    return uring_fd >= 0;
+}
+
+/* Register a handler that submits its own requests with fdCompletionSqe
+   rather than waiting for the fd to become ready.  The handler is called
+   when the request completes, with its result in event->result; if it
+   returns 0, it must have submitted a new request.  Pokes are delivered
+   once the request has been cancelled. */
+FdEventHandlerPtr
+registerFdCompletion(FdEventHandlerPtr event)
+{
+    event->uring |= URING_COMPLETION;
+    return registerFdEventHelper(event);
+}
+
+/* Returns a submission queue entry for the caller to fill in, or NULL
+   if the ring is full. */
+struct io_uring_sqe *
+fdCompletionSqe(FdEventHandlerPtr event)
+{
+    struct io_uring_sqe *sqe;
+
+    assert((event->uring & (URING_COMPLETION | URING_INFLIGHT)) ==
+           URING_COMPLETION);
+    sqe = uringGetSqe();
+    if(sqe == NULL)
+        return NULL;
+    sqe->user_data = uringEventData(event);
+    event->uring |= URING_INFLIGHT;
+    return sqe;
+}
+#endif
+
 static int
 recomputePollEvents(FdEventHandlerPtr event) 
 {
     int pe = 0;
     while(event) {
-        pe |= event->poll_events;
+#ifdef HAVE_IO_URING
+        if(!(event->uring & URING_COMPLETION))
+#endif
+            pe |= event->poll_events;
         event = event->next;
     }
     return pe | POLLERR | POLLHUP | POLLNVAL;
@@ -451,13 +1483,26 @@ unregisterFdEventI(FdEventHandlerPtr event, int i)
         event->next->previous = event->previous;
     }
 
-    free(event);
+#ifdef HAVE_IO_URING
+    /* The kernel may still be using the iovec in the event; free it
+       when the request completes. */
+    if(event->uring & URING_INFLIGHT) {
+        uringCancel(event);
+        event->uring |= URING_ORPHAN;
+    } else
+#endif
+    freeFdEvent(event);
 
     if(fdEvents[i] == NULL) {
         deallocateFdEventNum(i);
     } else {
-        poll_fds[i].events = recomputePollEvents(fdEvents[i]) | 
+        int events = recomputePollEvents(fdEvents[i]) |
             POLLERR | POLLHUP | POLLNVAL;
+#ifdef HAVE_EPOLL
+        if(epoll_fd >= 0 && events != poll_fds[i].events)
+            epollControl(EPOLL_CTL_MOD, poll_fds[i].fd, events);
+#endif
+        poll_fds[i].events = events;
     }
 }
 
@@ -466,13 +1511,10 @@ unregisterFdEvent(FdEventHandlerPtr event)
 {
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == event->fd) {
-            unregisterFdEventI(event, i);
-            return;
-        }
-    }
-    abort();
+    i = findFdEventNum(event->fd);
+    if(i < 0)
+        abort();
+    unregisterFdEventI(event, i);
 }
 
 void
@@ -480,18 +1522,30 @@ runTimeEventQueue()
 {
     TimeEventHandlerPtr event;
     int done;
-
-    while(timeEventQueue && 
-          timeval_cmp(&timeEventQueue->time, &current_time) <= 0) {
-        event = timeEventQueue;
-        timeEventQueue = event->next;
-        if(timeEventQueue)
-            timeEventQueue->previous = NULL;
-        else
-            timeEventQueueLast = NULL;
+    long long start;
+    /* Events scheduled by the handlers run at the next iteration, so
+       that a handler that reschedules itself cannot starve I/O.  Since
+       they are never due before the events that were already queued,
+       we can stop at the first one. */
+    unsigned int serial = timeEventSerial;
+
+    while(timeEventNum > 0 &&
+          timeval_cmp(&timeEventHeap[0]->key, &current_monotime) <= 0 &&
+          (int)(timeEventHeap[0]->serial - serial) < 0) {
+        event = timeEventHeap[0];
+        if(timeval_cmp(&event->time, &event->key) > 0) {
+            /* The event has been postponed; move it now.  It keeps its
+               serial, so it still runs now if it is due. */
+            event->key = event->time;
+            timeEventHeapDown(0);
+            continue;
+        }
+        dequeueTimeEvent(event);
+        start = eventProbeStart();
         done = event->handler(event);
+        eventProbeEnd(start, (void*)event->handler, NULL, EVENT_PROBE_TIME);
         assert(done);
-        free(event);
+        freeTimeEvent(event);
     }
 }
 
@@ -500,6 +1554,12 @@ findEventHelper(int revents, FdEventHandlerPtr events)
 {
     FdEventHandlerPtr event = events;
     while(event) {
+#ifdef HAVE_IO_URING
+        if(event->uring & URING_COMPLETION) {
+            event = event->next;
+            continue;
+        }
+#endif
         if(revents & event->poll_events)
             return event;
         event = event->next;
@@ -554,17 +1614,23 @@ pokeFdEventHandler(TimeEventHandlerPtr tevent)
     FdEventHandlerPtr event, next;
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == fd)
-            break;
-    }
-
-    if(i >= fdEventNum)
+    i = findFdEventNum(fd);
+    if(i < 0)
         return 1;
 
     event = fdEvents[i];
     while(event) {
         next = event->next;
+#ifdef HAVE_IO_URING
+        if((event->poll_events & what) && (event->uring & URING_INFLIGHT)) {
+            /* The handler will get the status when the request has
+               been cancelled. */
+            if(!(event->uring & URING_CANCELLING)) {
+                event->status = status;
+                uringCancel(event);
+            }
+        } else
+#endif
         if(event->poll_events & what) {
             done = event->handler(status, event);
             if(done) {
@@ -604,13 +1670,27 @@ workToDo()
     struct timeval sleep_time;
     int rc;
 
-    if(exitFlag)
+    if(exitFlag || objectNotificationsPending())
         return 1;
 
     timeToSleep(&sleep_time);
-    gettimeofday(&current_time, NULL);
-    if(timeval_cmp(&sleep_time, &current_time) <= 0)
+    updateCurrentTime();
+    if(timeval_cmp(&sleep_time, &current_monotime) <= 0)
         return 1;
+#ifdef HAVE_IO_URING
+    if(uring_fd >= 0) {
+        rc = uringSubmit(0, 0);
+        if(rc >= 0)
+            rc = *uring_cq_head !=
+                __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+    } else
+#endif
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0) {
+        struct epoll_event ev;
+        rc = epoll_wait(epoll_fd, &ev, 1, 0);
+    } else
+#endif
     rc = poll(poll_fds, fdEventNum, 0);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't poll");
@@ -618,20 +1698,189 @@ workToDo()
     }
     return(rc >= 1);
 }
-    
+
+static int
+pollEvents(int timeout)
+{
+#ifdef HAVE_IO_URING
+    if(uring_fd >= 0) {
+        int rc;
+        unsigned head = *uring_cq_head;
+        unsigned tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+        rc = uringSubmit(head == tail && timeout != 0 ? 1 : 0, timeout);
+        if(rc < 0 && errno != ETIME)
+            return -1;
+        tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+        return tail - head;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0) {
+        if(epoll_events_size < fdEventSize) {
+            struct epoll_event *new_epoll_events;
+            new_epoll_events = realloc(epoll_events,
+                                       fdEventSize *
+                                       sizeof(struct epoll_event));
+            /* If this fails, we'll simply get fewer events per call. */
+            if(new_epoll_events) {
+                epoll_events = new_epoll_events;
+                epoll_events_size = fdEventSize;
+            }
+        }
+        if(epoll_events_size <= 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return epoll_wait(epoll_fd, epoll_events, epoll_events_size,
+                          timeout);
+    }
+#endif
+    return poll(poll_fds, fdEventNum, timeout);
+}
+
+/* Attribute the time spent in the generic stream handlers to whoever
+   requested the I/O. */
+static void *
+fdEventKey(FdEventHandlerPtr event)
+{
+    if(event->handler == do_scheduled_stream)
+        return (void*)((StreamRequestPtr)&event->data)->handler;
+    else if(event->handler == do_scheduled_accept)
+        return (void*)((AcceptRequestPtr)&event->data)->handler;
+    else if(event->handler == do_scheduled_connect)
+        return (void*)((ConnectRequestPtr)&event->data)->handler;
+#ifdef HAVE_IO_URING
+    else if(event->handler == do_uring_stream)
+        return (void*)((StreamRequestPtr)&event->data)->handler;
+    else if(event->handler == do_uring_accept)
+        return (void*)((AcceptRequestPtr)&event->data)->handler;
+    else if(event->handler == do_uring_connect)
+        return (void*)((ConnectRequestPtr)&event->data)->handler;
+#endif
+    return (void*)event->handler;
+}
+
+/* Returns true if the fd tables have been modified. */
+static int
+dispatchFdEvent(int i, int revents)
+{
+    FdEventHandlerPtr event;
+    int done;
+    long long start;
+    void *key = NULL;
+
+    event = findEvent(revents, fdEvents[i]);
+    if(!event)
+        return 0;
+    start = eventProbeStart();
+    if(start)
+        key = fdEventKey(event);
+    done = event->handler(0, event);
+    eventProbeEnd(start, key, NULL, EVENT_PROBE_FD);
+    if(done) {
+        if(fds_invalid)
+            unregisterFdEvent(event);
+        else
+            unregisterFdEventI(event, i);
+    }
+    if(fds_invalid) {
+        fds_invalid = 0;
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+static void
+uringComplete(FdEventHandlerPtr event, int res)
+{
+    int status = 0, done;
+    long long start;
+    void *key = NULL;
+
+    event->uring &= ~URING_INFLIGHT;
+    if(event->uring & URING_ORPHAN) {
+        freeFdEvent(event);
+        return;
+    }
+    if(event->uring & URING_CANCELLING) {
+        status = event->status;
+        event->uring &= ~URING_CANCELLING;
+    }
+    event->result = res;
+    start = eventProbeStart();
+    if(start)
+        key = fdEventKey(event);
+    done = event->handler(status, event);
+    eventProbeEnd(start, key, NULL, EVENT_PROBE_FD);
+    if(done)
+        unregisterFdEvent(event);
+    else
+        assert(event->uring & URING_INFLIGHT);
+}
+
+static void
+uringDispatch()
+{
+    unsigned head = *uring_cq_head;
+    unsigned tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail) {
+        struct io_uring_cqe *cqe = &uring_cqes[head & uring_cq_mask];
+        unsigned long long user_data = cqe->user_data;
+        int res = cqe->res;
+        int fd, j;
+        FdSlotPtr slot;
+
+        head++;
+        __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+
+        if(user_data == URING_IGNORE)
+            continue;
+        if(user_data & 1) {
+            uringComplete((FdEventHandlerPtr)(uintptr_t)(user_data & ~1ULL),
+                          res);
+            continue;
+        }
+        fd = (int)((user_data & 0xFFFFFFFF) >> 1);
+        if(fd < 0 || fd >= fdSlotsSize)
+            continue;
+        slot = &fdSlots[fd];
+        /* Stale completion of a request that has been cancelled. */
+        if(!slot->armed || slot->armed_serial != (user_data >> 32))
+            continue;
+        slot->armed = 0;
+        j = slot->index;
+        if(j >= 0 && res > 0)
+            dispatchFdEvent(j, res);
+        if(slot->index >= 0 && !slot->armed)
+            uringArm(fd);
+    }
+}
+#endif
+
 void
 eventLoop()
 {
     struct timeval sleep_time, timeout;
-    int rc, i, done, n;
-    FdEventHandlerPtr event;
+    int rc, i, n;
     int fd0;
 
-    gettimeofday(&current_time, NULL);
+    updateCurrentTime();
 
     while(1) {
     again:
+        /* Run the notifications deferred by the last batch of events
+           before we sleep. */
+        flushObjectNotifications();
+
         if(exitFlag) {
+#ifdef HAVE_FORK
+            /* The workers must go away with us, whatever the reason. */
+            if(signalFlag || exitFlag >= 3)
+                signalWorkers(exitFlag >= 3 ? 3 : signalFlag);
+            signalFlag = 0;
+#endif
             if(exitFlag < 3)
                 reopenLog();
             if(exitFlag >= 2) {
@@ -646,28 +1895,27 @@ eventLoop()
             exitFlag = 0;
         }
 
+        /* The clock was read when we last woke up, and not since; at
+           worst, we run time events late by the time it took to
+           dispatch the last batch of fd events. */
         timeToSleep(&sleep_time);
         if(sleep_time.tv_sec == -1) {
-            rc = poll(poll_fds, fdEventNum, 
-                      diskIsClean ? -1 : idleTime * 1000);
-        } else if(timeval_cmp(&sleep_time, &current_time) <= 0) {
+            rc = pollEvents(diskIsClean ? -1 : idleTime * 1000);
+        } else if(timeval_cmp(&sleep_time, &current_monotime) <= 0) {
             runTimeEventQueue();
-            continue;
-        } else {
-            gettimeofday(&current_time, NULL);
-            if(timeval_cmp(&sleep_time, &current_time) <= 0) {
-                runTimeEventQueue();
+            /* Check for I/O before running the events that the
+               handlers scheduled. */
+            rc = pollEvents(0);
+            if(rc == 0)
                 continue;
-            } else {
-                int t;
-                timeval_minus(&timeout, &sleep_time, &current_time);
-                t = timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
-                rc = poll(poll_fds, fdEventNum,
-                          diskIsClean ? t : MIN(idleTime * 1000, t));
-            }
+        } else {
+            int t;
+            timeval_minus(&timeout, &sleep_time, &current_monotime);
+            t = timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
+            rc = pollEvents(diskIsClean ? t : MIN(idleTime * 1000, t));
         }
 
-        gettimeofday(&current_time, NULL);
+        updateCurrentTime();
 
         if(rc < 0) {
             if(errno == EINTR) {
@@ -688,15 +1936,36 @@ eventLoop()
         if(rc == 0) {
             if(!diskIsClean) {
                 timeToSleep(&sleep_time);
-                if(timeval_cmp(&sleep_time, &current_time) > 0)
+                if(timeval_cmp(&sleep_time, &current_monotime) > 0)
                     writeoutObjects(0);
             }
             continue;
         }
 
-        /* Rather than tracking all changes to the in-memory cache, we
-           assume that something changed whenever we see any activity. */
-        diskIsClean = 0;
+#ifdef HAVE_IO_URING
+        if(uring_fd >= 0) {
+            uringDispatch();
+            continue;
+        }
+#endif
+
+#ifdef HAVE_EPOLL
+        if(epoll_fd >= 0) {
+            /* Since epoll only returns ready fds, there is no need to
+               start again after the tables have been modified; we
+               just skip events for fds that have been reallocated. */
+            for(i = 0; i < rc; i++) {
+                int fd = (int)(epoll_events[i].data.u64 & 0xFFFFFFFF);
+                unsigned int serial =
+                    (unsigned int)(epoll_events[i].data.u64 >> 32);
+                int j = findFdEventNum(fd);
+                if(j < 0 || fdSlots[fd].serial != serial)
+                    continue;
+                dispatchFdEvent(j, epollRevents(epoll_events[i].events));
+            }
+            continue;
+        }
+#endif
 
         fd0 = 
             (current_time.tv_usec ^ (current_time.tv_usec >> 16)) % fdEventNum;
@@ -707,20 +1976,8 @@ eventLoop()
                 break;
             if(poll_fds[j].revents) {
                 n--;
-                event = findEvent(poll_fds[j].revents, fdEvents[j]);
-                if(!event)
-                    continue;
-                done = event->handler(0, event);
-                if(done) {
-                    if(fds_invalid)
-                        unregisterFdEvent(event);
-                    else
-                        unregisterFdEventI(event, j);
-                }
-                if(fds_invalid) {
-                    fds_invalid = 0;
+                if(dispatchFdEvent(j, poll_fds[j].revents))
                     goto again;
-                } 
             }
         }
     }
@@ -743,6 +2000,13 @@ makeCondition(void)
     return condition;
 }
 
+static void
+freeConditionHandler(ConditionHandlerPtr handler)
+{
+    poolFree(&conditionHandlerPool, handler,
+             sizeof(ConditionHandlerRec) - 1 + handler->dsize);
+}
+
 ConditionHandlerPtr
 conditionWait(ConditionPtr condition,
               int (*handler)(int, ConditionHandlerPtr),
@@ -752,11 +2016,13 @@ conditionWait(ConditionPtr condition,
 
     assert(!in_signalCondition);
 
-    chandler = malloc(sizeof(ConditionHandlerRec) - 1 + dsize);
+    chandler = poolAlloc(&conditionHandlerPool,
+                         sizeof(ConditionHandlerRec) - 1 + dsize);
     if(!chandler)
         return NULL;
 
     chandler->condition = condition;
+    chandler->dsize = dsize;
     chandler->handler = handler;
     /* Let the compiler optimise the common case */
     if(dsize == sizeof(void*))
@@ -786,7 +2052,7 @@ unregisterConditionHandler(ConditionHandlerPtr handler)
     if(handler->previous)
         handler->previous->next = handler->next;
 
-    free(handler);
+    freeConditionHandler(handler);
 }
 
 void 
@@ -803,6 +2069,7 @@ signalCondition(ConditionPtr condition)
 {
     ConditionHandlerPtr handler;
     int done;
+    long long start;
 
     assert(!in_signalCondition);
     in_signalCondition++;
@@ -810,7 +2077,10 @@ signalCondition(ConditionPtr condition)
     handler = condition->handlers;
     while(handler) {
         ConditionHandlerPtr next = handler->next;
+        start = eventProbeStart();
         done = handler->handler(0, handler);
+        eventProbeEnd(start, (void*)handler->handler, NULL,
+                      EVENT_PROBE_CONDITION);
         if(done) {
             if(handler == condition->handlers)
                 condition->handlers = next;
@@ -820,7 +2090,7 @@ signalCondition(ConditionPtr condition)
                 handler->previous->next = next;
             else
                 condition->handlers = next;
-            free(handler);
+            freeConditionHandler(handler);
         }
         handler = next;
     }
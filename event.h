@@ -21,12 +21,17 @@ THE SOFTWARE.
 */
 
 extern struct timeval current_time;
+extern struct timeval current_monotime;
 extern struct timeval null_time;
 extern int diskIsClean;
+extern int numWorkers;
 
 typedef struct _TimeEventHandler {
     struct timeval time;
-    struct _TimeEventHandler *previous, *next;
+    struct timeval key;
+    int index;
+    unsigned int serial;
+    int dsize;
     int (*handler)(struct _TimeEventHandler*);
     char data[1];
 } TimeEventHandlerRec, *TimeEventHandlerPtr;
@@ -34,14 +39,29 @@ typedef struct _TimeEventHandler {
 typedef struct _FdEventHandler {
     short fd;
     short poll_events;
+    int dsize;
+#ifdef HAVE_IO_URING
+    short uring;
+    int status;
+    int result;
+#endif
     struct _FdEventHandler *previous, *next;
     int (*handler)(int, struct _FdEventHandler*);
     char data[1];
 } FdEventHandlerRec, *FdEventHandlerPtr;
 
+#ifdef HAVE_IO_URING
+/* FdEventHandler->uring */
+#define URING_COMPLETION 1      /* called on completion, not readiness */
+#define URING_INFLIGHT 2        /* the kernel owns the request */
+#define URING_CANCELLING 4      /* status holds the poked status */
+#define URING_ORPHAN 8          /* unregistered, free on completion */
+#endif
+
 typedef struct _ConditionHandler {
     struct _Condition *condition;
     struct _ConditionHandler *previous, *next;
+    int dsize;
     int (*handler)(int, struct _ConditionHandler*);
     char data[1];
 } ConditionHandlerRec, *ConditionHandlerPtr;
@@ -50,11 +70,14 @@ typedef struct _Condition {
     ConditionHandlerPtr handlers;
 } ConditionRec, *ConditionPtr;
 
+void updateCurrentTime(void);
+void preinitEvents(void);
 void initEvents(void);
 void uninitEvents(void);
 #ifdef HAVE_FORK
 void interestingSignals(sigset_t *ss);
 #endif
+int startWorkers(int n);
 
 TimeEventHandlerPtr scheduleTimeEvent(int seconds,
                                       int (*handler)(TimeEventHandlerPtr),
@@ -62,6 +85,7 @@ TimeEventHandlerPtr scheduleTimeEvent(int seconds,
 
 int timeval_minus_usec(const struct timeval *s1, const struct timeval *s2)
      ATTRIBUTE((pure));
+void rescheduleTimeEvent(TimeEventHandlerPtr event, int seconds);
 void cancelTimeEvent(TimeEventHandlerPtr);
 int allocateFdEventNum(int fd);
 void deallocateFdEventNum(int i);
@@ -74,8 +98,14 @@ FdEventHandlerPtr registerFdEvent(int fd, int poll_events,
                                   int (*handler)(int, FdEventHandlerPtr),
                                   int dsize, void *data);
 FdEventHandlerPtr registerFdEventHelper(FdEventHandlerPtr event);
+void freeFdEvent(FdEventHandlerPtr event);
 void unregisterFdEvent(FdEventHandlerPtr event);
 void pokeFdEvent(int fd, int status, int what);
+#ifdef HAVE_IO_URING
+int uringActive(void);
+FdEventHandlerPtr registerFdCompletion(FdEventHandlerPtr event);
+struct io_uring_sqe *fdCompletionSqe(FdEventHandlerPtr event);
+#endif
 int workToDo(void);
 void eventLoop(void);
 ConditionPtr makeCondition(void);
@@ -88,3 +118,13 @@ conditionWait(ConditionPtr condition,
 void unregisterConditionHandler(ConditionHandlerPtr);
 void abortConditionHandler(ConditionHandlerPtr);
 void polipoExit(void);
+
+#define EVENT_PROBE_FD 0
+#define EVENT_PROBE_TIME 1
+#define EVENT_PROBE_CONDITION 2
+#define EVENT_PROBE_FUNCTION 3
+
+long long probeTime(void);
+long long eventProbeStart(void);
+void eventProbeEnd(long long start, void *key, const char *name, int kind);
+void listHandlerStatistics(FILE *out);
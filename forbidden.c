@@ -419,8 +419,13 @@ urlIsMatched(char *url, int length, DomainPtr *domains, regex_t *regex)
         }
     }
 
-    if(regex)
-        return !regexec(regex, url, 0, NULL, 0);
+    if(regex) {
+        long long start = eventProbeStart();
+        int rc = regexec(regex, url, 0, NULL, 0);
+        eventProbeEnd(start, (void*)urlIsMatched, "urlIsMatched regexec",
+                      EVENT_PROBE_FUNCTION);
+        return !rc;
+    }
 
     return 0;
 }
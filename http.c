@@ -252,6 +252,13 @@ httpSetTimeout(HTTPConnectionPtr connection, int secs)
 {
     TimeEventHandlerPtr new;
 
+    /* This is called on every read and write, so avoid reallocating
+       the time event. */
+    if(connection->timeout && secs > 0) {
+        rescheduleTimeEvent(connection->timeout, secs);
+        return 1;
+    }
+
     if(connection->timeout)
         cancelTimeEvent(connection->timeout);
     connection->timeout = NULL;
@@ -557,11 +564,16 @@ htmlPrint(FILE *out, char *s, int slen)
     }
 }
 
+static PoolRec connectionPool =
+    POOL_INITIALIZER("connections", sizeof(HTTPConnectionRec));
+static PoolRec requestPool =
+    POOL_INITIALIZER("requests", sizeof(HTTPRequestRec));
+
 HTTPConnectionPtr
 httpMakeConnection()
 {
     HTTPConnectionPtr connection;
-    connection = malloc(sizeof(HTTPConnectionRec));
+    connection = poolAlloc(&connectionPool, sizeof(HTTPConnectionRec));
     if(connection == NULL)
         return NULL;
     connection->flags = 0;
@@ -600,7 +612,13 @@ httpDestroyConnection(HTTPConnectionPtr connection)
     httpConnectionDestroyReqbuf(connection);
     assert(!connection->timeout);
     assert(!connection->server);
-    free(connection);
+    httpFreeConnection(connection);
+}
+
+void
+httpFreeConnection(HTTPConnectionPtr connection)
+{
+    poolFree(&connectionPool, connection, sizeof(HTTPConnectionRec));
 }
 
 void
@@ -633,7 +651,7 @@ HTTPRequestPtr
 httpMakeRequest()
 {
     HTTPRequestPtr request;
-    request = malloc(sizeof(HTTPRequestRec));
+    request = poolAlloc(&requestPool, sizeof(HTTPRequestRec));
     if(request == NULL)
         return NULL;
     request->flags = 0;
@@ -672,7 +690,7 @@ httpDestroyRequest(HTTPRequestPtr request)
     releaseAtom(request->error_headers);
     assert(request->request == NULL);
     assert(request->next == NULL);
-    free(request);
+    poolFree(&requestPool, request, sizeof(HTTPRequestRec));
 }
 
 void
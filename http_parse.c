@@ -40,6 +40,11 @@ static AtomPtr atomConnection, atomProxyConnection, atomContentLength,
     atomSetCookie, atomCookie, atomCookie2,
     atomXPolipoDate, atomXPolipoAccess, atomXPolipoLocation, 
     atomXPolipoBodyOffset;
+/* Not interpreted by the parser, but common enough to be worth
+   recognising in knownHeaderAtom. */
+static AtomPtr atomAccept, atomAcceptCharset, atomAcceptEncoding,
+    atomAcceptLanguage, atomAcceptRanges, atomContentLanguage,
+    atomLocation, atomServer, atomUserAgent;
 
 AtomPtr atomContentType, atomContentEncoding;
 
@@ -108,6 +113,15 @@ initHttpParser()
     A(atomXPolipoAccess, "x-polipo-access");
     A(atomXPolipoLocation, "x-polipo-location");
     A(atomXPolipoBodyOffset, "x-polipo-body-offset");
+    A(atomAccept, "accept");
+    A(atomAcceptCharset, "accept-charset");
+    A(atomAcceptEncoding, "accept-encoding");
+    A(atomAcceptLanguage, "accept-language");
+    A(atomAcceptRanges, "accept-ranges");
+    A(atomContentLanguage, "content-language");
+    A(atomLocation, "location");
+    A(atomServer, "server");
+    A(atomUserAgent, "user-agent");
 #undef A
     return;
 
@@ -566,6 +580,224 @@ parseHeaderLine(const char *restrict buf, int start,
     return i;
 }
 
+/* Compare buf with the lowercase string s, ignoring case in buf. */
+static inline int
+headerNameIs(const char *restrict buf, const char *s, int n)
+{
+    int i;
+    char c;
+
+    for(i = 0; i < n; i++) {
+        c = buf[i];
+        if(c >= 'A' && c <= 'Z')
+            c |= 0x20;
+        if(c != s[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Map a header name to one of the atoms above without lowercasing and
+   interning it.  Returns NULL for headers that we don't know about.
+   The switches only narrow down the candidates; H compares the whole
+   name, since some lengths have a single candidate. */
+static AtomPtr
+knownHeaderAtom(const char *restrict buf, int n)
+{
+#define H(atom, string) \
+    if(headerNameIs(buf, string, n)) return retainAtom(atom)
+    switch(n) {
+    case 2:
+        H(atomTE, "te");
+        break;
+    case 3:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAge, "age");
+            break;
+        case 'v':
+            H(atomVia, "via");
+            break;
+        }
+        break;
+    case 4:
+        switch(buf[0] | 0x20) {
+        case 'd':
+            H(atomDate, "date");
+            break;
+        case 'e':
+            H(atomETag, "etag");
+            break;
+        case 'h':
+            H(atomHost, "host");
+            break;
+        case 'v':
+            H(atomVary, "vary");
+            break;
+        }
+        break;
+    case 5:
+        H(atomRange, "range");
+        break;
+    case 6:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAccept, "accept");
+            break;
+        case 'c':
+            H(atomCookie, "cookie");
+            break;
+        case 'e':
+            H(atomExpect, "expect");
+            break;
+        case 'p':
+            H(atomPragma, "pragma");
+            break;
+        case 's':
+            H(atomServer, "server");
+            break;
+        }
+        break;
+    case 7:
+        switch(buf[0] | 0x20) {
+        case 'c':
+            H(atomCookie2, "cookie2");
+            break;
+        case 'e':
+            H(atomExpires, "expires");
+            break;
+        case 'r':
+            H(atomReferer, "referer");
+            break;
+        case 't':
+            H(atomTrailer, "trailer");
+            break;
+        }
+        break;
+    case 8:
+        switch(buf[0] | 0x20) {
+        case 'i':
+            H(atomIfRange, "if-range");
+            H(atomIfMatch, "if-match");
+            break;
+        case 'l':
+            H(atomLocation, "location");
+            break;
+        }
+        break;
+    case 10:
+        switch(buf[0] | 0x20) {
+        case 'c':
+            H(atomConnection, "connection");
+            break;
+        case 'k':
+            H(atomKeepAlive, "keep-alive");
+            break;
+        case 's':
+            H(atomSetCookie, "set-cookie");
+            break;
+        case 'u':
+            H(atomUserAgent, "user-agent");
+            break;
+        }
+        break;
+    case 12:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAcceptRange, "accept-range");
+            break;
+        case 'c':
+            H(atomContentType, "content-type");
+            break;
+        }
+        break;
+    case 13:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAuthorization, "authorization");
+            H(atomAcceptRanges, "accept-ranges");
+            break;
+        case 'c':
+            H(atomCacheControl, "cache-control");
+            H(atomContentRange, "content-range");
+            break;
+        case 'i':
+            H(atomIfNoneMatch, "if-none-match");
+            break;
+        case 'l':
+            H(atomLastModified, "last-modified");
+            break;
+        case 'x':
+            H(atomXPolipoDate, "x-polipo-date");
+            break;
+        }
+        break;
+    case 14:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAcceptCharset, "accept-charset");
+            break;
+        case 'c':
+            H(atomContentLength, "content-length");
+            break;
+        }
+        break;
+    case 15:
+        switch(buf[0] | 0x20) {
+        case 'a':
+            H(atomAcceptEncoding, "accept-encoding");
+            H(atomAcceptLanguage, "accept-language");
+            break;
+        case 'x':
+            H(atomXPolipoAccess, "x-polipo-access");
+            break;
+        }
+        break;
+    case 16:
+        switch(buf[0] | 0x20) {
+        case 'c':
+            H(atomContentEncoding, "content-encoding");
+            H(atomContentLanguage, "content-language");
+            break;
+        case 'p':
+            H(atomProxyConnection, "proxy-connection");
+            break;
+        }
+        break;
+    case 17:
+        switch(buf[0] | 0x20) {
+        case 'i':
+            H(atomIfModifiedSince, "if-modified-since");
+            break;
+        case 't':
+            H(atomTransferEncoding, "transfer-encoding");
+            break;
+        case 'x':
+            H(atomXPolipoLocation, "x-polipo-location");
+            break;
+        }
+        break;
+    case 18:
+        H(atomProxyAuthenticate, "proxy-authenticate");
+        break;
+    case 19:
+        switch(buf[0] | 0x20) {
+        case 'i':
+            H(atomIfUnmodifiedSince, "if-unmodified-since");
+            break;
+        case 'p':
+            H(atomProxyAuthorization, "proxy-authorization");
+            break;
+        }
+        break;
+    case 20:
+        H(atomXPolipoBodyOffset, "x-polipo-body-offset");
+        break;
+    }
+#undef H
+    return NULL;
+}
+
 int
 findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return) 
 {
@@ -817,7 +1049,9 @@ httpParseHeaders(int client, AtomPtr url,
         if(name_start < 0)
             continue;
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
+        name = knownHeaderAtom(buf + name_start, name_end - name_start);
+        if(name == NULL)
+            name = internAtomLowerN(buf + name_start, name_end - name_start);
 
         if(name == atomConnection) {
             j = getNextTokenInList(buf, value_start, 
@@ -881,8 +1115,10 @@ httpParseHeaders(int client, AtomPtr url,
                 goto fail;
         }
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
-        
+        name = knownHeaderAtom(buf + name_start, name_end - name_start);
+        if(name == NULL)
+            name = internAtomLowerN(buf + name_start, name_end - name_start);
+
         if(name == atomProxyConnection) {
             j = getNextTokenInList(buf, value_start, 
                                    &token_start, &token_end, NULL, NULL,
@@ -34,6 +34,12 @@ int useTemporarySourceAddress = 1;
 
 AtomPtr proxyOutgoingAddress = NULL;
 
+#ifdef HAVE_IO_URING
+static int streamSubmit(FdEventHandlerPtr event, int poll);
+static int connectSubmit(FdEventHandlerPtr event, int poll);
+static int acceptSubmit(FdEventHandlerPtr event, int poll);
+#endif
+
 void
 preinitIo()
 {
@@ -162,6 +168,9 @@ schedule_stream(int operation, int fd, int offset,
                 void *data)
 {
     StreamRequestRec request;
+#ifdef HAVE_IO_URING
+    UringStreamRequestRec ur;
+#endif
     FdEventHandlerPtr event;
     int done;
 
@@ -195,6 +204,17 @@ schedule_stream(int operation, int fd, int offset,
     }
     request.handler = handler;
     request.data = data;
+#ifdef HAVE_IO_URING
+    if(uringActive()) {
+        ur.request = request;
+        ur.polling = 0;
+        event = makeFdEvent(fd,
+                            (operation & IO_MASK) == IO_WRITE ?
+                            POLLOUT : POLLIN,
+                            do_uring_stream,
+                            sizeof(UringStreamRequestRec), &ur);
+    } else
+#endif
     event = makeFdEvent(fd, 
                         (operation & IO_MASK) == IO_WRITE ?
                         POLLOUT : POLLIN, 
@@ -207,9 +227,9 @@ schedule_stream(int operation, int fd, int offset,
     }
 
     if(!(operation & IO_NOTNOW)) {
-        done = event->handler(0, event);
+        done = do_scheduled_stream(0, event);
         if(done) {
-            free(event);
+            freeFdEvent(event);
             return NULL;
         }
     } 
@@ -218,34 +238,42 @@ schedule_stream(int operation, int fd, int offset,
         assert(hlen == 0 && !(operation & IO_CHUNKED));
         done = (*handler)(0, event, &request);
         if(done) {
-            free(event);
+            freeFdEvent(event);
             return NULL;
         }
     }
+#ifdef HAVE_IO_URING
+    if(event->handler == do_uring_stream) {
+        event = registerFdCompletion(event);
+        if(event == NULL)
+            return NULL;
+        done = streamSubmit(event, 0);
+        if(done) {
+            unregisterFdEvent(event);
+            return NULL;
+        }
+        return event;
+    }
+#endif
     event = registerFdEventHelper(event);
     return event;
 }
 
 static const char *endChunkTrailer = "\r\n0\r\n\r\n";
 
-int
-do_scheduled_stream(int status, FdEventHandlerPtr event)
+/* Fill in iov with what remains to be done of request, and return the
+   number of entries used or a negative error code. */
+static int
+streamRequestIov(StreamRequestPtr request, struct iovec *iov,
+                 char *chunk_header)
 {
-    StreamRequestPtr request = (StreamRequestPtr)&event->data;
-    int rc, done, i;
-    struct iovec iov[6];
+    int i;
     int chunk_header_len;
-    char chunk_header[10];
     int len12 = request->len + request->len2;
     int len123 = 
         request->len + request->len2 + 
         ((request->operation & IO_BUF3) ? request->u.b.len3 : 0);
 
-    if(status) {
-        done = request->handler(status, event, request);
-        return done;
-    }
-
     i = 0;
 
     if(request->offset < 0) {
@@ -283,10 +311,8 @@ do_scheduled_stream(int status, FdEventHandlerPtr event)
            (request->operation & IO_BUF_LOCATION)) {
             assert(*request->u.l.buf_location == NULL);
             request->buf = *request->u.l.buf_location = get_chunk();
-            if(request->buf == NULL) {
-                done = request->handler(-ENOMEM, event, request);
-                return done;
-            }
+            if(request->buf == NULL)
+                return -ENOMEM;
         }
         if(request->offset <= 0) {
             iov[i].iov_base = request->buf;
@@ -352,6 +378,52 @@ do_scheduled_stream(int status, FdEventHandlerPtr event)
     }
 
     assert(i > 0);
+    return i;
+}
+
+/* Account for the result of a read or write, which is either a byte
+   count or a negative error code. */
+static int
+streamRequestResult(int rc, FdEventHandlerPtr event, StreamRequestPtr request)
+{
+    int done;
+
+    if(rc > 0) {
+        request->offset += rc;
+        if(request->offset < 0) return 0;
+        done = request->handler(0, event, request);
+        return done;
+    } else if(rc == 0 || rc == -EPIPE) {
+        done = request->handler(1, event, request);
+    } else if(rc == -EAGAIN || rc == -EINTR) {
+        return 0;
+    } else if(rc == -EFAULT || rc == -EBADF) {
+        abort();
+    } else {
+        done = request->handler(rc, event, request);
+    }
+    assert(done);
+    return done;
+}
+
+int
+do_scheduled_stream(int status, FdEventHandlerPtr event)
+{
+    StreamRequestPtr request = (StreamRequestPtr)&event->data;
+    int rc, done, i;
+    struct iovec iov[6];
+    char chunk_header[10];
+
+    if(status) {
+        done = request->handler(status, event, request);
+        return done;
+    }
+
+    i = streamRequestIov(request, iov, chunk_header);
+    if(i < 0) {
+        done = request->handler(i, event, request);
+        return done;
+    }
 
     if((request->operation & IO_MASK) == IO_WRITE) {
         if(i > 1) 
@@ -365,24 +437,78 @@ do_scheduled_stream(int status, FdEventHandlerPtr event)
             rc = READ(request->fd, iov[0].iov_base, iov[0].iov_len);
     }
 
-    if(rc > 0) {
-        request->offset += rc;
-        if(request->offset < 0) return 0;
-        done = request->handler(0, event, request);
+    return streamRequestResult(rc < 0 ? -errno : rc, event, request);
+}
+
+#ifdef HAVE_IO_URING
+/* Submit the rest of a stream request, or a poll for the fd if poll is
+   true.  Returns 1 if the request has been completed with an error. */
+static int
+streamSubmit(FdEventHandlerPtr event, int poll)
+{
+    UringStreamRequestPtr ur = (UringStreamRequestPtr)&event->data;
+    StreamRequestPtr request = &ur->request;
+    struct io_uring_sqe *sqe;
+    int write = (request->operation & IO_MASK) == IO_WRITE;
+    int i = 0, done;
+
+    if(!poll) {
+        i = streamRequestIov(request, ur->iov, ur->chunk_header);
+        if(i < 0) {
+            done = request->handler(i, event, request);
+            assert(done);
+            return done;
+        }
+    }
+
+    sqe = fdCompletionSqe(event);
+    if(sqe == NULL) {
+        done = request->handler(-ENOMEM, event, request);
+        assert(done);
         return done;
-    } else if(rc == 0 || errno == EPIPE) {
-        done = request->handler(1, event, request);
-    } else if(errno == EAGAIN || errno == EINTR) {
-        return 0;
-    } else if(errno == EFAULT || errno == EBADF) {
-        abort();
+    }
+    sqe->fd = request->fd;
+    if(poll) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = write ? POLLOUT : POLLIN;
     } else {
-        done = request->handler(-errno, event, request);
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long)ur->iov;
+        sqe->len = i;
     }
-    assert(done);
-    return done;
+    ur->polling = poll;
+    return 0;
 }
 
+int
+do_uring_stream(int status, FdEventHandlerPtr event)
+{
+    UringStreamRequestPtr ur = (UringStreamRequestPtr)&event->data;
+    StreamRequestPtr request = &ur->request;
+    int rc = event->result;
+    int done;
+
+    if(status) {
+        done = request->handler(status, event, request);
+        if(done)
+            return done;
+        if(rc == -ECANCELED)
+            rc = -EAGAIN;
+    }
+
+    if(ur->polling)
+        return streamSubmit(event, 0);
+    /* Older kernels don't poll nonblocking fds by themselves. */
+    if(rc == -EAGAIN)
+        return streamSubmit(event, 1);
+
+    done = streamRequestResult(rc, event, request);
+    if(done)
+        return done;
+    return streamSubmit(event, 0);
+}
+#endif
+
 int
 streamRequestDone(StreamRequestPtr request)
 {
@@ -478,6 +604,9 @@ do_connect(AtomPtr addr, int index, int port,
            void *data)
 {
     ConnectRequestRec request;
+#ifdef HAVE_IO_URING
+    UringConnectRequestRec ur;
+#endif
     FdEventHandlerPtr event;
     int done, fd, af;
 
@@ -514,6 +643,28 @@ do_connect(AtomPtr addr, int index, int port,
         return NULL;
     }
 
+#ifdef HAVE_IO_URING
+    if(uringActive()) {
+        ur.request = request;
+        ur.polling = 0;
+        event = makeFdEvent(fd, POLLIN | POLLOUT, do_uring_connect,
+                            sizeof(UringConnectRequestRec), &ur);
+        if(event)
+            event = registerFdCompletion(event);
+        if(event == NULL) {
+            done = (*handler)(-ENOMEM, NULL, &request);
+            assert(done);
+            return NULL;
+        }
+        done = connectSubmit(event, 0);
+        if(done) {
+            unregisterFdEvent(event);
+            return NULL;
+        }
+        return event;
+    }
+#endif
+
     /* POLLIN is apparently needed on Windows */
     event = registerFdEvent(fd, POLLIN | POLLOUT,
                             do_scheduled_connect,
@@ -532,33 +683,23 @@ do_connect(AtomPtr addr, int index, int port,
     return event;
 }
 
-int
-do_scheduled_connect(int status, FdEventHandlerPtr event)
+/* Fill in the address to connect to, switching to a socket of the
+   right family if needed.  Returns the length of the address, or a
+   negative error code. */
+static int
+connectAddress(ConnectRequestPtr request, struct sockaddr_storage *sa)
 {
-    ConnectRequestPtr request = (ConnectRequestPtr)&event->data;
     AtomPtr addr = request->addr;
-    int done;
-    int rc;
     HostAddressPtr host;
-    struct sockaddr_in servaddr;
+    struct sockaddr_in *servaddr = (struct sockaddr_in*)sa;
 #ifdef HAVE_IPv6
-    struct sockaddr_in6 servaddr6;
+    struct sockaddr_in6 *servaddr6 = (struct sockaddr_in6*)sa;
 #endif
 
     assert(addr->length > 0 && addr->string[0] == DNS_A);
     assert(addr->length % sizeof(HostAddressRec) == 1);
     assert(request->index < (addr->length - 1) / sizeof(HostAddressRec));
 
-    if(status) {
-        done = request->handler(status, event, request);
-        if(done) {
-            releaseAtom(addr);
-            request->addr = NULL;
-            return 1;
-        }
-        return 0;
-    }
-
  again:
     host = (HostAddressPtr)&addr->string[1 + 
                                          request->index * 
@@ -578,72 +719,178 @@ do_scheduled_connect(int status, FdEventHandlerPtr event)
                 }
             }
             request->fd = -1;
-            done = request->handler(-errno, event, request);
-            assert(done);
-            return 1;
+            return -errno;
         }
         if(newfd != request->fd) {
             request->fd = dup2(newfd, request->fd);
             CLOSE(newfd);
-            if(request->fd < 0) {
-                done = request->handler(-errno, event, request);
-                assert(done);
-                return 1;
-            }
+            if(request->fd < 0)
+                return -errno;
         }
         request->af = host->af;
     }
     switch(host->af) {
     case 4:
-        memset(&servaddr, 0, sizeof(servaddr));
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(request->port);
-        memcpy(&servaddr.sin_addr, &host->data, sizeof(struct in_addr));
-        rc = connect(request->fd,
-                     (struct sockaddr*)&servaddr, sizeof(servaddr));
-        break;
+        memset(servaddr, 0, sizeof(*servaddr));
+        servaddr->sin_family = AF_INET;
+        servaddr->sin_port = htons(request->port);
+        memcpy(&servaddr->sin_addr, &host->data, sizeof(struct in_addr));
+        return sizeof(*servaddr);
     case 6:
 #ifdef HAVE_IPv6
-        memset(&servaddr6, 0, sizeof(servaddr6));
-        servaddr6.sin6_family = AF_INET6;
-        servaddr6.sin6_port = htons(request->port);
-        memcpy(&servaddr6.sin6_addr, &host->data, sizeof(struct in6_addr));
-        rc = connect(request->fd,
-                     (struct sockaddr*)&servaddr6, sizeof(servaddr6));
+        memset(servaddr6, 0, sizeof(*servaddr6));
+        servaddr6->sin6_family = AF_INET6;
+        servaddr6->sin6_port = htons(request->port);
+        memcpy(&servaddr6->sin6_addr, &host->data, sizeof(struct in6_addr));
+        return sizeof(*servaddr6);
 #else
-        rc = -1;
-        errno = EAFNOSUPPORT;
+        return -EAFNOSUPPORT;
 #endif
-        break;
     default:
         abort();
     }
-        
-    if(rc >= 0 || errno == EISCONN) {
-        done = request->handler(1, event, request);
+}
+
+/* Move on to the next address after a failure.  Returns 0 if we've
+   tried them all. */
+static int
+connectNext(ConnectRequestPtr request)
+{
+    int n = request->addr->length / sizeof(HostAddressRec);
+    if((request->index + 1) % n != request->firstindex) {
+        request->index = (request->index + 1) % n;
+        return 1;
+    }
+    return 0;
+}
+
+static int
+connectDone(int status, FdEventHandlerPtr event, ConnectRequestPtr request)
+{
+    int done;
+
+    done = request->handler(status, event, request);
+    assert(done);
+    releaseAtom(request->addr);
+    request->addr = NULL;
+    return 1;
+}
+
+int
+do_scheduled_connect(int status, FdEventHandlerPtr event)
+{
+    ConnectRequestPtr request = (ConnectRequestPtr)&event->data;
+    AtomPtr addr = request->addr;
+    int done;
+    int rc;
+    struct sockaddr_storage sa;
+
+    if(status) {
+        done = request->handler(status, event, request);
+        if(done) {
+            releaseAtom(addr);
+            request->addr = NULL;
+            return 1;
+        }
+        return 0;
+    }
+
+ again:
+    rc = connectAddress(request, &sa);
+    if(rc < 0) {
+        done = request->handler(rc, event, request);
         assert(done);
-        releaseAtom(request->addr);
-        request->addr = NULL;
         return 1;
     }
+    rc = connect(request->fd, (struct sockaddr*)&sa, rc);
+        
+    if(rc >= 0 || errno == EISCONN)
+        return connectDone(1, event, request);
 
     if(errno == EINPROGRESS || errno == EINTR) {
         return 0;
     } else if(errno == EFAULT || errno == EBADF) {
         abort();
     } else {
-        int n = request->addr->length / sizeof(HostAddressRec);
-        if((request->index + 1) % n != request->firstindex) {
-            request->index = (request->index + 1) % n;
+        if(connectNext(request))
             goto again;
+        return connectDone(-errno, event, request);
+    }
+}
+
+#ifdef HAVE_IO_URING
+static int
+connectSubmit(FdEventHandlerPtr event, int poll)
+{
+    UringConnectRequestPtr ur = (UringConnectRequestPtr)&event->data;
+    ConnectRequestPtr request = &ur->request;
+    struct io_uring_sqe *sqe;
+    int len = 0, done;
+
+    if(!poll) {
+        len = connectAddress(request, &ur->addr);
+        if(len < 0) {
+            done = request->handler(len, event, request);
+            assert(done);
+            return 1;
         }
-        done = request->handler(-errno, event, request);
-        assert(done);
-        releaseAtom(request->addr);
-        request->addr = NULL;
-        return 1;
+    }
+
+    sqe = fdCompletionSqe(event);
+    if(sqe == NULL)
+        return connectDone(-ENOMEM, event, request);
+    sqe->fd = request->fd;
+    if(poll) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+    } else {
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (unsigned long)&ur->addr;
+        sqe->off = len;
+    }
+    ur->polling = poll;
+    return 0;
+}
+
+int
+do_uring_connect(int status, FdEventHandlerPtr event)
+{
+    UringConnectRequestPtr ur = (UringConnectRequestPtr)&event->data;
+    ConnectRequestPtr request = &ur->request;
+    int rc = event->result;
+    int done;
+
+    if(status) {
+        done = request->handler(status, event, request);
+        if(done) {
+            releaseAtom(request->addr);
+            request->addr = NULL;
+            return 1;
+        }
+        if(rc == -ECANCELED)
+            rc = -EINPROGRESS;
+    }
+
+    /* After a poll, connecting again yields the outcome. */
+    if(ur->polling)
+        return connectSubmit(event, 0);
+
+    if(rc >= 0 || rc == -EISCONN)
+        return connectDone(1, event, request);
+
+    if(rc == -EINPROGRESS || rc == -EALREADY || rc == -EAGAIN) {
+        return connectSubmit(event, 1);
+    } else if(rc == -EINTR) {
+        return connectSubmit(event, 0);
+    } else if(rc == -EFAULT || rc == -EBADF) {
+        abort();
+    } else {
+        if(connectNext(request))
+            return connectSubmit(event, 0);
+        return connectDone(rc, event, request);
     }
 }
+#endif
 
 FdEventHandlerPtr
 do_accept(int fd,
@@ -670,11 +917,27 @@ schedule_accept(int fd,
 {
     FdEventHandlerPtr event;
     AcceptRequestRec request;
+#ifdef HAVE_IO_URING
+    UringAcceptRequestRec ur;
+#endif
     int done;
 
     request.fd = fd;
     request.handler = handler;
     request.data = data;
+#ifdef HAVE_IO_URING
+    if(uringActive()) {
+        ur.request = request;
+        ur.polling = 0;
+        event = makeFdEvent(fd, POLLIN, do_uring_accept, sizeof(ur), &ur);
+        if(event)
+            event = registerFdCompletion(event);
+        if(event && acceptSubmit(event, 0)) {
+            unregisterFdEvent(event);
+            return NULL;
+        }
+    } else
+#endif
     event = registerFdEvent(fd, POLLIN, 
                             do_scheduled_accept, sizeof(request), &request);
     if(!event) {
@@ -708,6 +971,64 @@ do_scheduled_accept(int status, FdEventHandlerPtr event)
     return done;
 }
 
+#ifdef HAVE_IO_URING
+static int
+acceptSubmit(FdEventHandlerPtr event, int poll)
+{
+    UringAcceptRequestPtr ur = (UringAcceptRequestPtr)&event->data;
+    AcceptRequestPtr request = &ur->request;
+    struct io_uring_sqe *sqe;
+    int done;
+
+    sqe = fdCompletionSqe(event);
+    if(sqe == NULL) {
+        done = request->handler(-ENOMEM, event, request);
+        assert(done);
+        return done;
+    }
+    sqe->fd = request->fd;
+    if(poll) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+    } else {
+        sqe->opcode = IORING_OP_ACCEPT;
+    }
+    ur->polling = poll;
+    return 0;
+}
+
+int
+do_uring_accept(int status, FdEventHandlerPtr event)
+{
+    UringAcceptRequestPtr ur = (UringAcceptRequestPtr)&event->data;
+    AcceptRequestPtr request = &ur->request;
+    int rc = event->result;
+    int done;
+
+    if(status) {
+        done = request->handler(status, event, request);
+        if(done) {
+            /* The connection may have been accepted meanwhile. */
+            if(!ur->polling && rc >= 0)
+                CLOSE(rc);
+            return done;
+        }
+        if(rc == -ECANCELED)
+            rc = -EAGAIN;
+    }
+
+    if(ur->polling)
+        return acceptSubmit(event, 0);
+    if(rc == -EAGAIN)
+        return acceptSubmit(event, 1);
+
+    done = request->handler(rc, event, request);
+    if(done)
+        return done;
+    return acceptSubmit(event, 0);
+}
+#endif
+
 FdEventHandlerPtr
 create_listener(char *address, int port,
                 int (*handler)(int, FdEventHandlerPtr, AcceptRequestPtr),
@@ -756,6 +1077,16 @@ create_listener(char *address, int port,
     if(rc < 0) do_log_error(L_WARN, errno, "Couldn't set SO_REUSEADDR");
 #endif
 
+#ifdef SO_REUSEPORT
+    /* Each worker has its own listening socket, and the kernel
+       distributes incoming connections among them. */
+    if(numWorkers > 1) {
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                        (char *)&one, sizeof(one));
+        if(rc < 0) do_log_error(L_WARN, errno, "Couldn't set SO_REUSEPORT");
+    }
+#endif
+
     if(inet6) {
 #ifdef HAVE_IPv6
         rc = setV6only(fd, 0);
@@ -80,6 +80,30 @@ typedef struct _AcceptRequest {
     void *data;
 } AcceptRequestRec, *AcceptRequestPtr;
 
+#ifdef HAVE_IO_URING
+/* With io_uring, the kernel holds on to the iovec, the chunk header
+   and the address after we've submitted, so they live in the event
+   after the request.  Polling is set while we wait for readiness,
+   which happens with kernels that don't poll nonblocking fds. */
+typedef struct _UringStreamRequest {
+    StreamRequestRec request;
+    struct iovec iov[6];
+    char chunk_header[10];
+    int polling;
+} UringStreamRequestRec, *UringStreamRequestPtr;
+
+typedef struct _UringConnectRequest {
+    ConnectRequestRec request;
+    struct sockaddr_storage addr;
+    int polling;
+} UringConnectRequestRec, *UringConnectRequestPtr;
+
+typedef struct _UringAcceptRequest {
+    AcceptRequestRec request;
+    int polling;
+} UringAcceptRequestRec, *UringAcceptRequestPtr;
+#endif
+
 void preinitIo();
 void initIo();
 
@@ -120,6 +144,9 @@ schedule_stream(int operation, int fd, int offset,
                 void *data);
 
 int do_scheduled_stream(int, FdEventHandlerPtr);
+#ifdef HAVE_IO_URING
+int do_uring_stream(int, FdEventHandlerPtr);
+#endif
 int streamRequestDone(StreamRequestPtr);
 
 FdEventHandlerPtr
@@ -128,6 +155,9 @@ do_connect(struct _Atom *addr, int index, int port,
            void *data);
 
 int do_scheduled_connect(int, FdEventHandlerPtr event);
+#ifdef HAVE_IO_URING
+int do_uring_connect(int, FdEventHandlerPtr event);
+#endif
 
 FdEventHandlerPtr
 do_accept(int fd,
@@ -140,6 +170,9 @@ schedule_accept(int fd,
                 void* data);
 
 int do_scheduled_accept(int, FdEventHandlerPtr event);
+#ifdef HAVE_IO_URING
+int do_uring_accept(int, FdEventHandlerPtr event);
+#endif
 
 FdEventHandlerPtr
 create_listener(char *address, int port,
@@ -128,6 +128,50 @@ serversList(FILE *out, char *dummy)
     listServers(out);
 }
 
+static void
+handlersList(FILE *out, char *dummy)
+{
+    listHandlerStatistics(out);
+}
+
+static void
+poolsList(FILE *out, char *dummy)
+{
+    PoolPtr pool;
+    int i = 0;
+
+    fprintf(out, "<!DOCTYPE HTML PUBLIC "
+            "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+            "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+            "<html><head>\n"
+            "<title>Memory pools</title>\n"
+            "</head><body>\n"
+            "<h1>Memory pools</h1>\n");
+    alternatingHttpStyle(out, "pools");
+    fprintf(out, "<table id=pools>\n");
+    fprintf(out, "<thead><tr><th>Pool</th>"
+            "<th>Block size</th>"
+            "<th>In use</th>"
+            "<th>Peak</th>"
+            "<th>Slabs</th>"
+            "<th>Oversize</th>"
+            "</tr></thead>\n");
+    fprintf(out, "<tbody>\n");
+    for(pool = pools; pool; pool = pool->next) {
+        fprintf(out, "<tr class=\"%s\">", i % 2 == 0 ? "even" : "odd");
+        fprintf(out, "<td>");
+        htmlPrint(out, pool->name, strlen(pool->name));
+        fprintf(out, "</td><td>%d</td><td>%d</td><td>%d</td>"
+                "<td>%d</td><td>%d</td></tr>\n",
+                pool->size, pool->used, pool->peak, pool->slabs, pool->large);
+        i++;
+    }
+    fprintf(out, "</tbody>\n");
+    fprintf(out, "</table>\n");
+    fprintf(out, "<p><a href=\"/polipo/\">back</a></p>");
+    fprintf(out, "</body></html>\n");
+}
+
 static int
 matchUrl(char *base, ObjectPtr object)
 {
@@ -182,12 +226,16 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<p><a href=\"status?\">Status report</a>.</p>\n"
                      "<p><a href=\"config?\">Current configuration</a>.</p>\n"
                      "<p><a href=\"servers?\">Known servers</a>.</p>\n"
+                     "<p><a href=\"handlers?\">Event handlers</a>.</p>\n"
+                     "<p><a href=\"pools?\">Memory pools</a>.</p>\n"
 #ifndef NO_DISK_CACHE
                      "<p><a href=\"index?\">Disk cache index</a>.</p>\n"
 #endif
                      "</body></html>\n");
         object->length = object->size;
     } else if(matchUrl("/polipo/status", object)) {
+        int atom_buckets, atom_longest;
+        atomTableStatistics(&atom_buckets, &atom_longest);
         objectPrintf(object, 0,
                      "<!DOCTYPE HTML PUBLIC "
                      "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
@@ -199,8 +247,15 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<p>The %s proxy on %s:%d is %s.</p>\n"
                      "<p>There are %d public and %d private objects "
                      "currently in memory using %d KB in %d chunks "
-                     "(%d KB allocated).</p>\n"
-                     "<p>There are %d atoms.</p>"
+                     "(%d KB allocated).  Object structures use %d KB; "
+                     "the object index has %d buckets, and %lu objects "
+                     "were inserted into an occupied bucket.  %d objects "
+                     "are waiting to be written out to disk.</p>\n"
+                     "<p>The replacement policy is %s; %lu of %lu "
+                     "requests (%.1f%%) found their object in memory.</p>\n"
+                     "<p>There are %d atoms in %d buckets; the longest "
+                     "chain has %d atoms, and lookups walk %.2f atoms "
+                     "on average.</p>"
                      "<p><form method=POST action=\"/polipo/status?\">"
                      "<input type=submit name=\"init-forbidden\" "
                      "value=\"Read forbidden file\"></form>\n"
@@ -228,7 +283,15 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      publicObjectCount, privateObjectCount,
                      used_chunks * CHUNK_SIZE / 1024, used_chunks,
                      totalChunkArenaSize() / 1024,
-                     used_atoms);
+                     objectMemory / 1024, 1 << log2ObjectHashTableSize,
+                     objectHashCollisions, dirtyObjectCount,
+                     objectReplacementPolicy->string,
+                     objectHits, objectLookups,
+                     objectLookups ?
+                     100.0 * objectHits / objectLookups : 0.0,
+                     used_atoms, atom_buckets, atom_longest,
+                     atomLookups ?
+                     (double)atomChainSteps / atomLookups : 0.0);
         object->expires = current_time.tv_sec;
         object->length = object->size;
     } else if(matchUrl("/polipo/config", object)) {
@@ -282,6 +345,12 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
         }
         fillSpecialObject(object, serversList, NULL);
         object->expires = current_time.tv_sec + 2;
+    } else if(matchUrl("/polipo/handlers", object)) {
+        fillSpecialObject(object, handlersList, NULL);
+        object->expires = current_time.tv_sec + 2;
+    } else if(matchUrl("/polipo/pools", object)) {
+        fillSpecialObject(object, poolsList, NULL);
+        object->expires = current_time.tv_sec + 2;
     } else {
         abortObject(object, 404, internAtom("Not found"));
     }
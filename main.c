@@ -45,12 +45,14 @@ main(int argc, char **argv)
     int i;
     int rc;
     int expire = 0, printConfig = 0;
+    int worker;
 
     initAtoms();
     CONFIG_VARIABLE(daemonise, CONFIG_BOOLEAN, "Run as a daemon");
     CONFIG_VARIABLE(pidFile, CONFIG_ATOM, "File with pid of running daemon.");
 
     preinitChunks();
+    preinitEvents();
     preinitLog();
     preinitObject();
     preinitIo();
@@ -138,6 +140,7 @@ main(int argc, char **argv)
     initDiskcache();
     initForbidden();
     initSocks();
+    initMemoryPressure();
 
     if(printConfig) {
         printConfigVariables(stdout, 0);
@@ -146,6 +149,7 @@ main(int argc, char **argv)
 
     if(expire) {
         expireDiskObjects();
+        closeDiskcache();
         exit(0);
     }
 
@@ -157,15 +161,24 @@ main(int argc, char **argv)
         writePid(pidFile->string);
     }
 
+#ifndef SO_REUSEPORT
+    if(numWorkers > 1) {
+        do_log(L_WARN, "SO_REUSEPORT not available, using a single worker.\n");
+        numWorkers = 1;
+    }
+#endif
+    worker = startWorkers(numWorkers);
+
     listener = create_listener(proxyAddress->string, 
                                proxyPort, httpAccept, NULL);
     if(!listener) {
-        if(pidFile) unlink(pidFile->string);
+        if(pidFile && worker == 0) unlink(pidFile->string);
         exit(1);
     }
 
     eventLoop();
+    closeDiskcache();
 
-    if(pidFile) unlink(pidFile->string);
+    if(pidFile && worker == 0) unlink(pidFile->string);
     return 0;
 }
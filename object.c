@@ -26,8 +26,106 @@ int mindlesslyCacheVary = 0;
 int objectHashTableSize = 0;
 int log2ObjectHashTableSize;
 
-static ObjectPtr object_list = NULL;
-static ObjectPtr object_list_end = NULL;
+/* Public objects are kept in one or three queues, ordered from most
+   to least recently used.  With the LRU policy, all objects live in
+   the probation queue.  With TinyLFU, new objects enter a small
+   window queue; when the window overflows, its oldest object is
+   admitted to the head of the probation queue if it has been accessed
+   more often than the oldest object already there, and is otherwise
+   put at the tail of probation, where it will be the first to be
+   discarded.  A hit in probation promotes an object to the protected
+   queue, which holds at most 80% of the objects outside the window.
+   Access frequencies are estimated with a count-min sketch.
+
+   Objects are discarded from the tail of probation first, then from
+   the window and finally from the protected queue, so a one-off scan
+   only flushes the window and probation.
+
+   With GDSF (Greedy-Dual-Size-Frequency), all objects live in the
+   probation queue, which is only used for writing out.  Objects are
+   discarded in increasing order of L + F * C / S, where F is the
+   sketch frequency, C the estimated cost of fetching the object
+   again, S its size, and L the priority of the last object
+   discarded, recorded in the object whenever it is accessed.  Small,
+   popular objects from slow servers are therefore kept longest. */
+
+#define OBJECT_WINDOW 0
+#define OBJECT_PROBATION 1
+#define OBJECT_PROTECTED 2
+
+#define POLICY_LRU 0
+#define POLICY_TINYLFU 1
+#define POLICY_GDSF 2
+
+static const char *policyNames[] = {"lru", "tinylfu", "gdsf"};
+
+/* Fetch cost assumed when the server's statistics are unknown: 100ms
+   round-trip and 100kB/s. */
+#define DEFAULT_FETCH_RTT 100000
+#define DEFAULT_FETCH_RATE 100000
+
+typedef struct _ObjectQueue {
+    ObjectPtr first, last;
+    int count;
+} ObjectQueueRec, *ObjectQueuePtr;
+
+static ObjectQueueRec objectQueues[3];
+
+AtomPtr objectReplacementPolicy = NULL;
+static int policy = POLICY_LRU;
+unsigned long objectLookups = 0, objectHits = 0;
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15
+
+static unsigned char *sketch = NULL;
+static int log2SketchWidth;
+static int sketchAdditions;
+static const unsigned int sketchMultipliers[SKETCH_DEPTH] =
+    {0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU};
+
+typedef struct _Victim {
+    float priority;
+    ObjectPtr object;
+} VictimRec, *VictimPtr;
+
+/* With GDSF, the public objects are kept in a binary heap ordered by
+   the priority they had when they were last touched or released,
+   which is when their size and cost change.  The objects that the
+   current sweep has considered but kept are moved just past the end
+   of the heap, and are put back when the phase ends. */
+static VictimPtr victims = NULL;
+static int victimsSize = 0, numVictims = 0, numDeferred = 0;
+static float gdsfInflation = 0.0;
+
+/* Objects are discarded in three phases: full chunks of large objects
+   are written out and released, unused objects are discarded, and,
+   if memory is critically short, holes are punched in the remaining
+   objects.  Unless all objects are being discarded, a call does at
+   most maxDiscardTime milliseconds of work, and the sweep is resumed
+   at the next iteration of the event loop.
+
+   discardCursor is the next object to consider.  If it is removed
+   from the queues by anything else, queueUnlink moves it along, and
+   discardRestart causes the phase to restart from lastObject. */
+
+#define DISCARD_IDLE 0
+#define DISCARD_WRITEOUT 1
+#define DISCARD_PRIVATISE 2
+#define DISCARD_PUNCH 3
+
+static int discardPhase = DISCARD_IDLE;
+static ObjectPtr discardCursor = NULL;
+static int discardRestart;
+/* Chunks released by the current sweep. */
+static int discardReleased;
+static int inDiscardObjects = 0;
+
+/* Public objects that may have data or metadata that is not on disk,
+   in the order in which they were modified.  Idle writeout only
+   considers these, and diskIsClean is set when the list is empty. */
+static ObjectPtr dirtyFirst = NULL, dirtyLast = NULL;
+int dirtyObjectCount = 0;
 
 int objectExpiryScheduled;
 
@@ -35,12 +133,38 @@ int publicObjectCount;
 int privateObjectCount;
 int cacheIsShared = 1;
 int publicObjectLowMark = 0, objectHighMark = 2048;
+int objectMemoryHighMark = 0;
+/* Memory used by object structures, keys and chunk arrays. */
+int objectMemory = 0;
+
+/* Public objects are indexed by a chained hash table.  Each object
+   remembers its full hash, so that walking a chain rarely needs to
+   compare keys.
+
+   The table doubles when it holds more than two objects per bucket and
+   halves when it holds fewer than one per eight buckets, but never
+   shrinks below its initial size.  As for atoms, resizing is
+   incremental: a few buckets of the old table are moved whenever an
+   object is made public or private, and buckets of the old table below
+   objectRehashIndex are empty. */
+
+#define OBJECT_REHASH_STEP 8
 
 static ObjectPtr *objectHashTable;
+static ObjectPtr *oldObjectHashTable = NULL;
+static int log2OldObjectHashTableSize;
+static int objectRehashIndex;
+static int minLog2ObjectHashTableSize;
+static unsigned long long objectHashKey[2];
+/* Number of insertions into an occupied bucket; these used to evict
+   the bucket's previous occupant. */
+unsigned long objectHashCollisions = 0;
+static PoolRec objectPool = POOL_INITIALIZER("objects", sizeof(ObjectRec));
 int maxExpiresAge = (30 * 24 + 1) * 3600;
 int maxAge = (14 * 24 + 1) * 3600;
 float maxAgeFraction = 0.1;
 int maxNoModifiedAge = 23 * 60;
+int maxDiscardTime = 5;
 int maxWriteoutWhenIdle = 64 * 1024;
 int maxObjectsWhenIdle = 32;
 int idleTime = 20;
@@ -51,6 +175,9 @@ preinitObject()
 {
     CONFIG_VARIABLE_SETTABLE(idleTime, CONFIG_TIME, configIntSetter,
                              "Time to remain idle before writing out.");
+    CONFIG_VARIABLE_SETTABLE(maxDiscardTime, CONFIG_INT, configIntSetter,
+                             "Time to spend discarding objects at a time "
+                             "(in ms, 0 = unlimited).");
     CONFIG_VARIABLE_SETTABLE(maxWriteoutWhenIdle, CONFIG_INT, configIntSetter,
                              "Amount of data to write at a time when idle.");
     CONFIG_VARIABLE_SETTABLE(maxObjectsWhenIdle, CONFIG_INT, configIntSetter,
@@ -62,9 +189,16 @@ preinitObject()
                              configIntSetter,
                              "If true, mindlessly cache negotiated objects.");
     CONFIG_VARIABLE(objectHashTableSize, CONFIG_INT,
-                    "Size of the object hash table (0 = auto).");
+                    "Initial size of the object hash table (0 = auto).");
     CONFIG_VARIABLE(objectHighMark, CONFIG_INT,
                     "High object count mark.");
+    CONFIG_VARIABLE_SETTABLE(objectMemoryHighMark, CONFIG_INT,
+                             configIntSetter,
+                             "High mark for object memory "
+                             "(0 = use objectHighMark).");
+    CONFIG_VARIABLE(objectReplacementPolicy, CONFIG_ATOM_LOWER,
+                    "Replacement policy for objects "
+                    "(lru, tinylfu or gdsf).");
     CONFIG_VARIABLE(publicObjectLowMark, CONFIG_INT,
                     "Low object count mark (0 = auto).");
     CONFIG_VARIABLE_SETTABLE(maxExpiresAge, CONFIG_TIME, configIntSetter,
@@ -82,7 +216,7 @@ preinitObject()
 void
 initObject()
 {
-    int q;
+    int i, q;
     if(objectHighMark < 16) {
         objectHighMark = 16;
         do_log(L_WARN, "Impossibly low objectHighMark -- setting to %d.\n",
@@ -98,20 +232,55 @@ initObject()
                    "setting to %d.\n", publicObjectLowMark);
     }
 
-    q = 1;
-    if(objectHashTableSize <= objectHighMark / 2 ||
-       objectHashTableSize > objectHighMark * 1024) {
-        if(objectHashTableSize != 0) q = 0;
-        objectHashTableSize = objectHighMark * 16;
+    if(objectHashTableSize <= 0)
+        objectHashTableSize = 1024;
+    if(objectHashTableSize < 16 || objectHashTableSize > (1 << 24)) {
+        objectHashTableSize = objectHashTableSize < 16 ? 16 : (1 << 24);
+        do_log(L_WARN, "Suspicious objectHashTableSize value -- "
+               "setting to %d.\n", objectHashTableSize);
     }
     log2ObjectHashTableSize = log2_ceil(objectHashTableSize);
     objectHashTableSize = 1 << log2ObjectHashTableSize;
-    if(!q)
-        do_log(L_WARN, "Suspicious objectHashTableSize value -- "
-               "setting to %d.\n", objectHashTableSize);
+    minLog2ObjectHashTableSize = log2ObjectHashTableSize;
+
+    policy = -1;
+    if(objectReplacementPolicy == NULL) {
+        policy = POLICY_LRU;
+    } else {
+        for(i = 0; i < 3; i++) {
+            if(strcmp(objectReplacementPolicy->string, policyNames[i]) == 0)
+                policy = i;
+        }
+        if(policy < 0) {
+            do_log(L_WARN, "Unknown objectReplacementPolicy %s -- "
+                   "using lru.\n", objectReplacementPolicy->string);
+            policy = POLICY_LRU;
+        }
+    }
+    if(objectReplacementPolicy == NULL ||
+       strcmp(objectReplacementPolicy->string, policyNames[policy]) != 0) {
+        releaseAtom(objectReplacementPolicy);
+        objectReplacementPolicy = internAtom(policyNames[policy]);
+    }
 
-    object_list = NULL;
-    object_list_end = NULL;
+    if(policy != POLICY_LRU) {
+        /* Enough counters for a few times the expected number of
+           objects, assuming roughly 256 bytes of metadata per object
+           when limiting by memory. */
+        int n = objectMemoryHighMark > 0 ?
+            objectMemoryHighMark / 256 : objectHighMark;
+        log2SketchWidth = log2_ceil(MAX(n, 1024)) + 1;
+        if(log2SketchWidth > 24)
+            log2SketchWidth = 24;
+        sketch = calloc(SKETCH_DEPTH << log2SketchWidth, 1);
+        if(sketch == NULL) {
+            do_log(L_ERROR, "Couldn't allocate frequency sketch.\n");
+            exit(1);
+        }
+        sketchAdditions = 0;
+    }
+
+    memset(objectQueues, 0, sizeof(objectQueues));
     publicObjectCount = 0;
     privateObjectCount = 0;
     objectHashTable = calloc(1 << log2ObjectHashTableSize,
@@ -120,40 +289,506 @@ initObject()
         do_log(L_ERROR, "Couldn't allocate object hash table.\n");
         exit(1);
     }
+    randomBytes(objectHashKey, sizeof(objectHashKey));
+}
+
+static inline unsigned int
+objectHash(int type, const void *key, int key_size)
+{
+    return (unsigned int)sipHash(objectHashKey, key, key_size) ^
+        (type * 0x9E3779B9U);
+}
+
+static ObjectPtr *
+objectBucket(unsigned int h)
+{
+    if(oldObjectHashTable) {
+        int i = h & ((1 << log2OldObjectHashTableSize) - 1);
+        if(i >= objectRehashIndex)
+            return &oldObjectHashTable[i];
+    }
+    return &objectHashTable[h & ((1 << log2ObjectHashTableSize) - 1)];
+}
+
+static void
+objectRehashStep(int n)
+{
+    ObjectPtr object, next, *bucket;
+
+    while(n > 0 && objectRehashIndex < (1 << log2OldObjectHashTableSize)) {
+        object = oldObjectHashTable[objectRehashIndex];
+        while(object) {
+            next = object->hash_next;
+            bucket = &objectHashTable[object->hash &
+                                      ((1 << log2ObjectHashTableSize) - 1)];
+            object->hash_next = *bucket;
+            *bucket = object;
+            object = next;
+        }
+        oldObjectHashTable[objectRehashIndex] = NULL;
+        objectRehashIndex++;
+        n--;
+    }
+
+    if(objectRehashIndex >= (1 << log2OldObjectHashTableSize)) {
+        free(oldObjectHashTable);
+        oldObjectHashTable = NULL;
+    }
+}
+
+static void
+maybeResizeObjectTable()
+{
+    ObjectPtr *table;
+    int log2size;
+
+    if(oldObjectHashTable) {
+        objectRehashStep(OBJECT_REHASH_STEP);
+        return;
+    }
+
+    if(publicObjectCount > 2 << log2ObjectHashTableSize &&
+       log2ObjectHashTableSize < 24)
+        log2size = log2ObjectHashTableSize + 1;
+    else if(publicObjectCount < (1 << log2ObjectHashTableSize) / 8 &&
+            log2ObjectHashTableSize > minLog2ObjectHashTableSize)
+        log2size = log2ObjectHashTableSize - 1;
+    else
+        return;
+
+    table = calloc(1 << log2size, sizeof(ObjectPtr));
+    if(table == NULL) {
+        do_log(L_WARN, "Couldn't resize object hash table.\n");
+        return;
+    }
+    oldObjectHashTable = objectHashTable;
+    log2OldObjectHashTableSize = log2ObjectHashTableSize;
+    objectRehashIndex = 0;
+    objectHashTable = table;
+    log2ObjectHashTableSize = log2size;
+    objectHashTableSize = 1 << log2size;
+}
+
+static inline unsigned char *
+sketchCounter(int row, unsigned int h)
+{
+    return &sketch[(row << log2SketchWidth) +
+                   ((h * sketchMultipliers[row]) >> (32 - log2SketchWidth))];
+}
+
+static void
+sketchIncrement(unsigned int h)
+{
+    int i;
+    unsigned char *c;
+
+    if(sketch == NULL)
+        return;
+
+    for(i = 0; i < SKETCH_DEPTH; i++) {
+        c = sketchCounter(i, h);
+        if(*c < SKETCH_MAX)
+            (*c)++;
+    }
+
+    /* Age the counters, so that old popularity is forgotten. */
+    if(++sketchAdditions >= 10 << log2SketchWidth) {
+        for(i = 0; i < SKETCH_DEPTH << log2SketchWidth; i++)
+            sketch[i] >>= 1;
+        sketchAdditions /= 2;
+    }
+}
+
+static int
+sketchFrequency(unsigned int h)
+{
+    int i, f = SKETCH_MAX;
+    unsigned char *c;
+
+    for(i = 0; i < SKETCH_DEPTH; i++) {
+        c = sketchCounter(i, h);
+        if(*c < f)
+            f = *c;
+    }
+    return f;
+}
+
+static ObjectPtr previousObject(ObjectPtr object);
+
+static void
+queueUnlink(ObjectPtr object)
+{
+    ObjectQueuePtr queue = &objectQueues[object->queue];
+
+    if(object == discardCursor && !discardRestart)
+        discardCursor = previousObject(object);
+
+    if(object->previous)
+        object->previous->next = object->next;
+    else
+        queue->first = object->next;
+    if(object->next)
+        object->next->previous = object->previous;
+    else
+        queue->last = object->previous;
+    object->previous = NULL;
+    object->next = NULL;
+    queue->count--;
+}
+
+static void
+queueInsert(int q, ObjectPtr object, int last)
+{
+    ObjectQueuePtr queue = &objectQueues[q];
+
+    object->queue = q;
+    if(last) {
+        object->next = NULL;
+        object->previous = queue->last;
+        if(queue->last)
+            queue->last->next = object;
+        else
+            queue->first = object;
+        queue->last = object;
+    } else {
+        object->previous = NULL;
+        object->next = queue->first;
+        if(queue->first)
+            queue->first->previous = object;
+        else
+            queue->last = object;
+        queue->first = object;
+    }
+    queue->count++;
+}
+
+/* Estimated time, in microseconds, to fetch size bytes from a server
+   with the given round-trip time and rate; negative values mean
+   unknown. */
+int
+objectFetchCost(int rtt, int rate, int size)
+{
+    double cost;
+    if(rtt < 0)
+        rtt = DEFAULT_FETCH_RTT;
+    if(rate <= 0)
+        rate = DEFAULT_FETCH_RATE;
+    cost = rtt + (double)MAX(size, 0) * 1000000.0 / rate;
+    return cost >= INT_MAX ? INT_MAX : (int)cost;
+}
+
+static float
+gdsfPriority(ObjectPtr object)
+{
+    int size = object->size + sizeof(ObjectRec) + object->key_size;
+    int cost = object->cost > 0 ?
+        object->cost : objectFetchCost(-1, -1, object->size);
+
+    return object->inflation +
+        (float)sketchFrequency(object->hash) * cost / size;
+}
+
+static inline void
+victimSet(int i, float priority, ObjectPtr object)
+{
+    victims[i].priority = priority;
+    victims[i].object = object;
+    object->victim = i;
+}
+
+static void
+victimUp(int i)
+{
+    VictimRec victim = victims[i];
+
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(victims[parent].priority <= victim.priority)
+            break;
+        victimSet(i, victims[parent].priority, victims[parent].object);
+        i = parent;
+    }
+    victimSet(i, victim.priority, victim.object);
+}
+
+static void
+victimDown(int i)
+{
+    VictimRec victim = victims[i];
+
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= numVictims)
+            break;
+        if(child + 1 < numVictims &&
+           victims[child + 1].priority < victims[child].priority)
+            child++;
+        if(victims[child].priority >= victim.priority)
+            break;
+        victimSet(i, victims[child].priority, victims[child].object);
+        i = child;
+    }
+    victimSet(i, victim.priority, victim.object);
+}
+
+static void
+victimFix(int i)
+{
+    if(i > 0 && victims[i].priority < victims[(i - 1) / 2].priority)
+        victimUp(i);
+    else
+        victimDown(i);
+}
+
+/* Make sure that victimInsert cannot fail. */
+static int
+victimReserve()
+{
+    if(numVictims + numDeferred >= victimsSize) {
+        int n = 2 * victimsSize + 64;
+        VictimPtr new_victims = realloc(victims, n * sizeof(VictimRec));
+        if(new_victims == NULL) {
+            do_log(L_ERROR, "Couldn't allocate victim heap.\n");
+            return -1;
+        }
+        victims = new_victims;
+        victimsSize = n;
+    }
+    return 1;
+}
+
+static void
+victimInsert(ObjectPtr object)
+{
+    assert(numVictims + numDeferred < victimsSize);
+    if(numDeferred > 0)
+        victimSet(numVictims + numDeferred,
+                  victims[numVictims].priority, victims[numVictims].object);
+    victimSet(numVictims, gdsfPriority(object), object);
+    numVictims++;
+    victimUp(numVictims - 1);
+}
+
+static void
+victimRemove(ObjectPtr object)
+{
+    int i = object->victim, last = numVictims + numDeferred - 1;
+
+    assert(i >= 0 && i <= last && victims[i].object == object);
+    if(i >= numVictims) {
+        if(i < last)
+            victimSet(i, victims[last].priority, victims[last].object);
+        numDeferred--;
+    } else {
+        numVictims--;
+        if(i < numVictims) {
+            victimSet(i, victims[numVictims].priority,
+                      victims[numVictims].object);
+            victimFix(i);
+        }
+        if(numDeferred > 0)
+            victimSet(numVictims, victims[last].priority, victims[last].object);
+    }
+    object->victim = -1;
+}
+
+/* Recompute the priority of an object after it has been used. */
+static void
+victimUpdate(ObjectPtr object)
+{
+    int i = object->victim;
+
+    victims[i].priority = gdsfPriority(object);
+    if(i < numVictims)
+        victimFix(i);
+}
+
+/* Move an object that the sweep has considered out of the heap. */
+static void
+victimDefer(ObjectPtr object)
+{
+    int i = object->victim;
+    VictimRec victim;
+
+    if(i >= numVictims)
+        return;
+    victim = victims[i];
+    numVictims--;
+    if(i < numVictims) {
+        victimSet(i, victims[numVictims].priority, victims[numVictims].object);
+        victimFix(i);
+    }
+    victimSet(numVictims, victim.priority, victim.object);
+    numDeferred++;
+}
+
+static void
+victimsRestore()
+{
+    ObjectPtr object;
+
+    while(numDeferred > 0) {
+        object = victims[numVictims].object;
+        numDeferred--;
+        victimSet(numVictims, gdsfPriority(object), object);
+        numVictims++;
+        victimUp(numVictims - 1);
+    }
+}
+
+/* Objects in the order in which they should be discarded.  With GDSF,
+   unused objects are discarded from the top of the heap, and moving
+   past an object defers it until the end of the phase. */
+
+static ObjectPtr
+lastObject()
+{
+    if(policy == POLICY_GDSF && discardPhase == DISCARD_PRIVATISE)
+        return numVictims > 0 ? victims[0].object : NULL;
+    if(objectQueues[OBJECT_PROBATION].last)
+        return objectQueues[OBJECT_PROBATION].last;
+    if(objectQueues[OBJECT_WINDOW].last)
+        return objectQueues[OBJECT_WINDOW].last;
+    return objectQueues[OBJECT_PROTECTED].last;
+}
+
+static ObjectPtr
+previousObject(ObjectPtr object)
+{
+    if(policy == POLICY_GDSF && discardPhase == DISCARD_PRIVATISE) {
+        victimDefer(object);
+        return numVictims > 0 ? victims[0].object : NULL;
+    }
+    if(object->previous)
+        return object->previous;
+    switch(object->queue) {
+    case OBJECT_PROBATION:
+        if(objectQueues[OBJECT_WINDOW].last)
+            return objectQueues[OBJECT_WINDOW].last;
+        /* fall through */
+    case OBJECT_WINDOW:
+        return objectQueues[OBJECT_PROTECTED].last;
+    default:
+        return NULL;
+    }
+}
+
+/* Objects from most to least recently used, in the opposite order. */
+
+static ObjectPtr
+firstObject()
+{
+    if(objectQueues[OBJECT_PROTECTED].first)
+        return objectQueues[OBJECT_PROTECTED].first;
+    if(objectQueues[OBJECT_WINDOW].first)
+        return objectQueues[OBJECT_WINDOW].first;
+    return objectQueues[OBJECT_PROBATION].first;
+}
+
+static ObjectPtr
+nextObject(ObjectPtr object)
+{
+    if(object->next)
+        return object->next;
+    switch(object->queue) {
+    case OBJECT_PROTECTED:
+        if(objectQueues[OBJECT_WINDOW].first)
+            return objectQueues[OBJECT_WINDOW].first;
+        /* fall through */
+    case OBJECT_WINDOW:
+        return objectQueues[OBJECT_PROBATION].first;
+    default:
+        return NULL;
+    }
+}
+
+/* Move the oldest objects out of the window once it exceeds 1% of the
+   public objects, and keep the protected queue below 80% of the rest. */
+static void
+objectBalanceQueues()
+{
+    ObjectPtr candidate, victim;
+    int main_count;
+
+    while(objectQueues[OBJECT_WINDOW].count >
+          MAX(publicObjectCount / 100, 1)) {
+        candidate = objectQueues[OBJECT_WINDOW].last;
+        victim = objectQueues[OBJECT_PROBATION].last;
+        queueUnlink(candidate);
+        queueInsert(OBJECT_PROBATION, candidate,
+                    victim != NULL &&
+                    sketchFrequency(candidate->hash) <=
+                    sketchFrequency(victim->hash));
+    }
+
+    main_count = objectQueues[OBJECT_PROBATION].count +
+        objectQueues[OBJECT_PROTECTED].count;
+    while(objectQueues[OBJECT_PROTECTED].count > main_count * 4 / 5) {
+        victim = objectQueues[OBJECT_PROTECTED].last;
+        queueUnlink(victim);
+        queueInsert(OBJECT_PROBATION, victim, 0);
+    }
+}
+
+static void
+objectTouch(ObjectPtr object)
+{
+    int q = object->queue;
+
+    sketchIncrement(object->hash);
+    object->inflation = gdsfInflation;
+    if(policy == POLICY_TINYLFU && q == OBJECT_PROBATION)
+        q = OBJECT_PROTECTED;
+    queueUnlink(object);
+    queueInsert(q, object, 0);
+    if(policy == POLICY_TINYLFU)
+        objectBalanceQueues();
+    else if(policy == POLICY_GDSF)
+        victimUpdate(object);
+}
+
+/* When objectMemoryHighMark is set, it replaces objectHighMark, and
+   half of it replaces publicObjectLowMark. */
+
+static int
+objectHighMarkReached()
+{
+    if(objectMemoryHighMark > 0)
+        return objectMemory >= objectMemoryHighMark;
+    return publicObjectCount + privateObjectCount >= objectHighMark;
+}
+
+static int
+objectLowMarkExceeded(int strict)
+{
+    if(objectMemoryHighMark > 0)
+        return strict ? objectMemory > objectMemoryHighMark / 2 :
+            objectMemory >= objectMemoryHighMark / 2;
+    return strict ? publicObjectCount > publicObjectLowMark :
+        publicObjectCount >= publicObjectLowMark;
 }
 
 ObjectPtr
 findObject(int type, const void *key, int key_size)
 {
-    int h;
+    unsigned int h;
     ObjectPtr object;
 
     if(key_size >= 50000)
         return NULL;
 
-    h = hash(type, key, key_size, log2ObjectHashTableSize);
-    object = objectHashTable[h];
+    h = objectHash(type, key, key_size);
+    object = *objectBucket(h);
+    while(object) {
+        if(object->hash == h && object->type == type &&
+           object->key_size == key_size &&
+           memcmp(object->key, key, key_size) == 0)
+            break;
+        object = object->hash_next;
+    }
     if(!object)
         return NULL;
-    if(object->type != type || object->key_size != key_size ||
-       memcmp(object->key, key, key_size) != 0) {
-        return NULL;
-    }
-    if(object->next)
-        object->next->previous = object->previous;
-    if(object->previous)
-        object->previous->next = object->next;
-    if(object_list == object)
-        object_list = object->next;
-    if(object_list_end == object)
-        object_list_end = object->previous;
-    object->previous = NULL;
-    object->next = object_list;
-    if(object_list)
-        object_list->previous = object;
-    object_list = object;
-    if(!object_list_end)
-        object_list_end = object;
+    objectTouch(object);
     return retainObject(object);
 }
 
@@ -161,8 +796,7 @@ ObjectPtr
 makeObject(int type, const void *key, int key_size, int public, int fromdisk,
            RequestFunction request, void* request_closure)
 {
-    ObjectPtr object;
-    int h;
+    ObjectPtr object, *bucket;
 
     object = findObject(type, key, key_size);
     if(object != NULL) {
@@ -172,16 +806,17 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
             privatiseObject(object, 0);
     }
 
-    if(publicObjectCount + privateObjectCount >= objectHighMark) {
-        if(!objectExpiryScheduled)
-            discardObjects(0, 0);
-        if(publicObjectCount + privateObjectCount >= objectHighMark) {
+    if(objectHighMarkReached()) {
+        discardObjects(0, 0);
+        if(objectHighMarkReached()) {
             return NULL;
         }
     }
 
-    if(publicObjectCount >= publicObjectLowMark && 
-       !objectExpiryScheduled) {
+    if(public && policy == POLICY_GDSF && victimReserve() < 0)
+        return NULL;
+
+    if(objectLowMarkExceeded(0) && !objectExpiryScheduled) {
         TimeEventHandlerPtr event;
         event = scheduleTimeEvent(-1, discardObjectsHandler, 0, NULL);
         if(event)
@@ -190,7 +825,7 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
             do_log(L_ERROR, "Couldn't schedule object expiry.\n");
     }
 
-    object = malloc(sizeof(ObjectRec));
+    object = poolAlloc(&objectPool, sizeof(ObjectRec));
     if(object == NULL)
         return NULL;
 
@@ -199,7 +834,7 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->request_closure = request_closure;
     object->key = malloc(key_size + 1);
     if(object->key == NULL) {
-        free(object);
+        poolFree(&objectPool, object, sizeof(ObjectRec));
         return NULL;
     }
     memcpy(object->key, key, key_size);
@@ -208,27 +843,34 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->key[key_size] = '\0';
     object->key_size = key_size;
     object->flags = (public?OBJECT_PUBLIC:0) | OBJECT_INITIAL;
+    objectMemory += sizeof(ObjectRec) + key_size + 1;
     if(public) {
-        h = hash(object->type, object->key, object->key_size, 
-                 log2ObjectHashTableSize);
-        if(objectHashTable[h]) {
-            writeoutToDisk(objectHashTable[h], objectHashTable[h]->size, -1);
-            privatiseObject(objectHashTable[h], 0);
-            assert(!objectHashTable[h]);
+        maybeResizeObjectTable();
+        object->hash = objectHash(type, key, key_size);
+        bucket = objectBucket(object->hash);
+        if(*bucket)
+            objectHashCollisions++;
+        object->hash_next = *bucket;
+        *bucket = object;
+        sketchIncrement(object->hash);
+        object->inflation = gdsfInflation;
+        if(policy == POLICY_TINYLFU) {
+            queueInsert(OBJECT_WINDOW, object, 0);
+            objectBalanceQueues();
+        } else {
+            queueInsert(OBJECT_PROBATION, object, 0);
         }
-        objectHashTable[h] = object;
-        object->next = object_list;
-        object->previous = NULL;
-        if(object_list)
-            object_list->previous = object;
-        object_list = object;
-        if(!object_list_end)
-            object_list_end = object;
     } else {
+        object->hash = 0;
+        object->inflation = 0.0;
+        object->hash_next = NULL;
         object->next = NULL;
         object->previous = NULL;
     }
     object->abort_data = NULL;
+    object->dirty_next = NULL;
+    object->dirty_previous = NULL;
+    object->cost = 0;
     object->code = 0;
     object->message = NULL;
     initCondition(&object->condition);
@@ -249,10 +891,14 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->size = 0;
     object->requestor = NULL;
     object->disk_entry = NULL;
-    if(object->flags & OBJECT_PUBLIC)
+    object->victim = -1;
+    if(object->flags & OBJECT_PUBLIC) {
         publicObjectCount++;
-    else
+        if(policy == POLICY_GDSF)
+            victimInsert(object);
+    } else {
         privateObjectCount++;
+    }
     object->refcount = 1;
 
     if(public && fromdisk)
@@ -268,10 +914,50 @@ objectMetadataChanged(ObjectPtr object, int revalidate)
     } else {
         object->flags &= ~OBJECT_DISK_ENTRY_COMPLETE;
         dirtyDiskEntry(object);
+        dirtyObject(object);
     }
     return;
 }
 
+void
+dirtyObject(ObjectPtr object)
+{
+    if((object->flags & (OBJECT_PUBLIC | OBJECT_LOCAL | OBJECT_DIRTY |
+                         OBJECT_DISK_ENTRY_COMPLETE)) != OBJECT_PUBLIC)
+        return;
+
+    object->flags |= OBJECT_DIRTY;
+    object->dirty_next = NULL;
+    object->dirty_previous = dirtyLast;
+    if(dirtyLast)
+        dirtyLast->dirty_next = object;
+    else
+        dirtyFirst = object;
+    dirtyLast = object;
+    dirtyObjectCount++;
+    diskIsClean = 0;
+}
+
+static void
+cleanObject(ObjectPtr object)
+{
+    if(!(object->flags & OBJECT_DIRTY))
+        return;
+
+    if(object->dirty_previous)
+        object->dirty_previous->dirty_next = object->dirty_next;
+    else
+        dirtyFirst = object->dirty_next;
+    if(object->dirty_next)
+        object->dirty_next->dirty_previous = object->dirty_previous;
+    else
+        dirtyLast = object->dirty_previous;
+    object->dirty_next = NULL;
+    object->dirty_previous = NULL;
+    object->flags &= ~OBJECT_DIRTY;
+    dirtyObjectCount--;
+}
+
 ObjectPtr
 retainObject(ObjectPtr object)
 {
@@ -292,6 +978,8 @@ releaseObject(ObjectPtr object)
                !(object->flags & OBJECT_INPROGRESS));
         if(!(object->flags & OBJECT_PUBLIC))
             destroyObject(object);
+        else if(policy == POLICY_GDSF)
+            victimUpdate(object);
     }
 }
 
@@ -308,6 +996,8 @@ releaseNotifyObject(ObjectPtr object)
                !(object->flags & OBJECT_INPROGRESS));
         if(!(object->flags & OBJECT_PUBLIC))
             destroyObject(object);
+        else if(policy == POLICY_GDSF)
+            victimUpdate(object);
     }
 }
 
@@ -322,6 +1012,56 @@ lockChunk(ObjectPtr object, int i)
     do_log(D_LOCK, "%d\n", object->chunks[i].locked);
 }
 
+/* Move the last chunk of a complete object into a small buffer if it
+   is mostly empty.  This only happens to unlocked chunks, since
+   readers keep the chunk locked while they use its data. */
+static void
+compactChunk(ObjectPtr object, int i)
+{
+    ChunkPtr chunk = &object->chunks[i];
+    char *data;
+
+    if(chunk->locked || chunk->data == NULL ||
+       chunk->size > CHUNK_SIZE / 2 || object->length < 0 ||
+       i * CHUNK_SIZE + chunk->size != object->length)
+        return;
+
+    if(chunk_capacity(chunk->data) < CHUNK_SIZE)
+        return;
+
+    data = get_small_chunk(MAX(chunk->size, 1));
+    if(data == NULL)
+        return;
+    memcpy(data, chunk->data, chunk->size);
+    dispose_chunk(chunk->data);
+    chunk->data = data;
+}
+
+/* Make sure that chunk i of object has a full-size buffer, either by
+   allocating one or by moving the data out of a small buffer. */
+int
+expandChunk(ObjectPtr object, int i)
+{
+    ChunkPtr chunk = &object->chunks[i];
+    char *data;
+
+    if(chunk->data == NULL) {
+        chunk->data = get_chunk();
+        return chunk->data ? 0 : -1;
+    }
+
+    if(chunk_capacity(chunk->data) >= CHUNK_SIZE)
+        return 0;
+
+    data = get_chunk();
+    if(data == NULL)
+        return -1;
+    memcpy(data, chunk->data, chunk->size);
+    dispose_chunk(chunk->data);
+    chunk->data = data;
+    return 0;
+}
+
 void 
 unlockChunk(ObjectPtr object, int i)
 {
@@ -330,6 +1070,8 @@ unlockChunk(ObjectPtr object, int i)
     assert(object->chunks[i].locked > 0);
     object->chunks[i].locked--;
     do_log(D_LOCK, "%d\n", object->chunks[i].locked);
+    if(object->chunks[i].locked == 0)
+        compactChunk(object, i);
 }
 
 int
@@ -353,6 +1095,7 @@ objectSetChunks(ObjectPtr object, int numchunks)
         if(object->chunks == NULL) {
             return -1;
         }
+        objectMemory += n * sizeof(ChunkRec);
         object->numchunks = n;
     } else {
         ChunkPtr newchunks;
@@ -361,6 +1104,7 @@ objectSetChunks(ObjectPtr object, int numchunks)
             return -1;
         memset(newchunks + object->numchunks, 0,
                (n - object->numchunks) * sizeof(ChunkRec));
+        objectMemory += (n - object->numchunks) * sizeof(ChunkRec);
         object->chunks = newchunks;
         object->numchunks = n;
     }
@@ -407,17 +1151,14 @@ objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
 
     lockChunk(object, i);
 
-    if(object->chunks[i].data == NULL) {
-        object->chunks[i].data = get_chunk();
-        if(object->chunks[i].data == NULL)
-            goto fail;
-    }
-
-    if(object->chunks[i].size >= plen) {
+    if(object->chunks[i].data && object->chunks[i].size >= plen) {
         unlockChunk(object, i);
         return 0;
     }
 
+    if(expandChunk(object, i) < 0)
+        goto fail;
+
     if(object->size < offset + plen)
         object->size = offset + plen;
     object->chunks[i].size = plen;
@@ -447,9 +1188,7 @@ objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
 
     lockChunk(object, i);
 
-    if(object->chunks[i].data == NULL)
-        object->chunks[i].data = get_chunk();
-    if(object->chunks[i].data == NULL)
+    if(expandChunk(object, i) < 0)
         goto fail;
 
     if(offset > object->size) {
@@ -485,6 +1224,8 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
     if(len == 0)
         return 1;
 
+    dirtyObject(object);
+
     if(object->length >= 0) {
         if(offset + len > object->length) {
             do_log(L_ERROR, 
@@ -665,15 +1406,18 @@ destroyObject(ObjectPtr object)
             object->chunks[i].size = 0;
         }
         if(object->chunks) free(object->chunks);
+        objectMemory -= sizeof(ObjectRec) + object->key_size + 1 +
+            object->numchunks * sizeof(ChunkRec);
         privateObjectCount--;
-        free(object);
+        poolFree(&objectPool, object, sizeof(ObjectRec));
     }
 }
 
 void
 privatiseObject(ObjectPtr object, int linear) 
 {
-    int i, h;
+    int i;
+    ObjectPtr *bucket;
     if(!(object->flags & OBJECT_PUBLIC)) {
         if(linear)
             object->flags |= OBJECT_LINEAR;
@@ -684,6 +1428,8 @@ privatiseObject(ObjectPtr object, int linear)
         destroyDiskEntry(object, 0);
     object->flags &= ~OBJECT_PUBLIC;
 
+    cleanObject(object);
+
     for(i = 0; i < object->numchunks; i++) {
         if(object->chunks[i].locked)
             break;
@@ -694,24 +1440,21 @@ privatiseObject(ObjectPtr object, int linear)
         }
     }
 
-    h = hash(object->type, object->key, object->key_size, 
-             log2ObjectHashTableSize);
-    assert(objectHashTable[h] == object);
-    objectHashTable[h] = NULL;
+    bucket = objectBucket(object->hash);
+    while(*bucket != object) {
+        assert(*bucket);
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = object->hash_next;
+    object->hash_next = NULL;
 
-    if(object->previous)
-        object->previous->next = object->next;
-    if(object_list == object)
-        object_list = object->next;
-    if(object->next)
-        object->next->previous = object->previous;
-    if(object_list_end == object)
-        object_list_end = object->previous;
-    object->previous = NULL;
-    object->next = NULL;
+    queueUnlink(object);
+    if(policy == POLICY_GDSF)
+        victimRemove(object);
 
     publicObjectCount--;
     privateObjectCount++;
+    maybeResizeObjectTable();
 
     if(object->refcount == 0)
         destroyObject(object);
@@ -767,139 +1510,286 @@ void
 notifyObject(ObjectPtr object) 
 {
     retainObject(object);
+    /* Any deferred notification is now redundant. */
+    object->flags &= ~OBJECT_NOTIFY;
     signalCondition(&object->condition);
     releaseObject(object);
 }
 
+/* Objects with a deferred notification.  Each holds a reference. */
+static ObjectPtr *notifyQueue = NULL;
+static int notifyQueueSize = 0, notifyQueueCount = 0;
+
+/* Notify an object's waiters at the end of the current iteration of
+   the event loop.  When an object being fetched is shared by many
+   clients, this avoids running every client's handler for every
+   single read from the server. */
+void
+notifyObjectLater(ObjectPtr object)
+{
+    if(object->flags & OBJECT_NOTIFY)
+        return;
+
+    if(!object->condition.handlers)
+        return;
+
+    if(notifyQueueCount >= notifyQueueSize) {
+        int n = notifyQueueSize == 0 ? 16 : 2 * notifyQueueSize;
+        ObjectPtr *new_queue = realloc(notifyQueue, n * sizeof(ObjectPtr));
+        if(new_queue == NULL) {
+            notifyObject(object);
+            return;
+        }
+        notifyQueue = new_queue;
+        notifyQueueSize = n;
+    }
+
+    retainObject(object);
+    object->flags |= OBJECT_NOTIFY;
+    notifyQueue[notifyQueueCount++] = object;
+}
+
+int
+objectNotificationsPending()
+{
+    return notifyQueueCount > 0;
+}
+
+int
+flushObjectNotifications()
+{
+    int i, n = 0;
+
+    /* Handlers may defer further notifications, which are then
+       run in the same flush. */
+    for(i = 0; i < notifyQueueCount; i++) {
+        ObjectPtr object = notifyQueue[i];
+        if(object->flags & OBJECT_NOTIFY) {
+            object->flags &= ~OBJECT_NOTIFY;
+            signalCondition(&object->condition);
+            n++;
+        }
+        releaseObject(object);
+    }
+    notifyQueueCount = 0;
+    return n;
+}
+
 int
 discardObjectsHandler(TimeEventHandlerPtr event)
 {
+    objectExpiryScheduled = 0;
     return discardObjects(0, 0);
 }
 
-void
-writeoutObjects(int all)
+static void
+reallyWriteoutObjects(int all)
 {
-    ObjectPtr object = object_list;
+    ObjectPtr object, next;
     int bytes;
     int objects;
     int n;
 
+    if(all) {
+        /* Don't trust the dirty list when asked explicitly. */
+        object = firstObject();
+        while(object) {
+            writeoutToDisk(object, -1, -1);
+            object = nextObject(object);
+        }
+        while(dirtyFirst)
+            cleanObject(dirtyFirst);
+        diskIsClean = 1;
+        return;
+    }
+
     if(diskIsClean) return;
 
     objects = 0;
     bytes = 0;
+    object = dirtyFirst;
     while(object) {
         do {
-            if(!all) {
-                if(objects >= maxObjectsWhenIdle || 
-                   bytes >= maxWriteoutWhenIdle) {
-                    if(workToDo()) return;
-                    objects = 0;
-                    bytes = 0;
-                }
+            if(objects >= maxObjectsWhenIdle ||
+               bytes >= maxWriteoutWhenIdle) {
+                if(workToDo()) return;
+                objects = 0;
+                bytes = 0;
             }
-            n = writeoutToDisk(object, -1, all ? -1 : maxWriteoutWhenIdle);
+            n = writeoutToDisk(object, -1, maxWriteoutWhenIdle);
             bytes += n;
-        } while(!all && n == maxWriteoutWhenIdle);
+        } while(n == maxWriteoutWhenIdle);
         objects++;
-        object = object->next;
+        next = object->dirty_next;
+        cleanObject(object);
+        object = next;
     }
     diskIsClean = 1;
 }
 
-int
-discardObjects(int all, int force)
+void
+writeoutObjects(int all)
 {
-    ObjectPtr object;
-    int i;
-    static int in_discardObjects = 0;
-    TimeEventHandlerPtr event;
+    long long start = eventProbeStart();
+    reallyWriteoutObjects(all);
+    eventProbeEnd(start, (void*)writeoutObjects, "writeoutObjects",
+                  EVENT_PROBE_FUNCTION);
+}
 
-    if(in_discardObjects)
+static int
+discardPhaseActive(int all, int force)
+{
+    switch(discardPhase) {
+    case DISCARD_WRITEOUT:
+        return all || force || used_chunks >= CHUNKS(chunkLowMark);
+    case DISCARD_PRIVATISE:
+        return all || force ||
+            used_chunks - discardReleased > (int)CHUNKS(chunkLowMark) ||
+            used_chunks > CHUNKS(chunkCriticalMark) ||
+            objectLowMarkExceeded(1);
+    case DISCARD_PUNCH:
+        return force || used_chunks > CHUNKS(chunkCriticalMark);
+    default:
         return 0;
+    }
+}
 
-    in_discardObjects = 1;
-    
-    if(all || force || used_chunks >= CHUNKS(chunkHighMark) ||
-       publicObjectCount >= publicObjectLowMark ||
-       publicObjectCount + privateObjectCount >= objectHighMark) {
-        object = object_list_end;
-        while(object && 
-              (all || force || used_chunks >= CHUNKS(chunkLowMark))) {
-            if(force || ((object->flags & OBJECT_PUBLIC) &&
-                         object->numchunks > CHUNKS(chunkLowMark) / 4)) {
-                int j;
-                for(j = 0; j < object->numchunks; j++) {
-                    if(object->chunks[j].locked) {
-                        break;
-                    }
-                    if(object->chunks[j].size < CHUNK_SIZE) {
-                        continue;
-                    }
-                    writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
-                    dispose_chunk(object->chunks[j].data);
-                    object->chunks[j].data = NULL;
-                    object->chunks[j].size = 0;
+static void
+discardStartPhase(int phase)
+{
+    victimsRestore();
+    discardPhase = phase;
+    discardCursor = NULL;
+    discardRestart = 1;
+}
+
+static void
+discardOne(ObjectPtr object, int all, int force)
+{
+    int j;
+
+    switch(discardPhase) {
+    case DISCARD_WRITEOUT:
+        if(object->numchunks > 0)
+            compactChunk(object, object->numchunks - 1);
+        if(force || ((object->flags & OBJECT_PUBLIC) &&
+                     object->numchunks > CHUNKS(chunkLowMark) / 4)) {
+            for(j = 0; j < object->numchunks; j++) {
+                if(object->chunks[j].locked) {
+                    break;
+                }
+                if(object->chunks[j].size < CHUNK_SIZE) {
+                    continue;
                 }
+                writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
+                dispose_chunk(object->chunks[j].data);
+                object->chunks[j].data = NULL;
+                object->chunks[j].size = 0;
             }
-            object = object->previous;
         }
-        
-        i = 0;
-        object = object_list_end;
-        while(object && 
-              (all || force ||
-               used_chunks - i > CHUNKS(chunkLowMark) ||
-               used_chunks > CHUNKS(chunkCriticalMark) ||
-               publicObjectCount > publicObjectLowMark)) {
-            ObjectPtr next_object = object->previous;
-            if(object->refcount == 0) {
-                i += object->numchunks;
-                writeoutToDisk(object, object->size, -1);
-                privatiseObject(object, 0);
-            } else if(all || force) {
-                writeoutToDisk(object, object->size, -1);
-                destroyDiskEntry(object, 0);
+        break;
+    case DISCARD_PRIVATISE:
+        if(object->refcount == 0) {
+            discardReleased += object->numchunks;
+            writeoutToDisk(object, object->size, -1);
+            if(policy == POLICY_GDSF)
+                gdsfInflation = MAX(gdsfInflation,
+                                    victims[object->victim].priority);
+            privatiseObject(object, 0);
+        } else if(all || force) {
+            writeoutToDisk(object, object->size, -1);
+            destroyDiskEntry(object, 0);
+        }
+        break;
+    case DISCARD_PUNCH:
+        if(force || (object->flags & OBJECT_PUBLIC)) {
+            for(j = object->numchunks - 1; j >= 0; j--) {
+                if(object->chunks[j].locked)
+                    continue;
+                if(object->chunks[j].size < CHUNK_SIZE)
+                    continue;
+                writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
+                dispose_chunk(object->chunks[j].data);
+                object->chunks[j].data = NULL;
+                object->chunks[j].size = 0;
             }
-            object = next_object;
         }
+        break;
+    default:
+        abort();
+    }
+}
 
-        object = object_list_end;
-        if(force || used_chunks > CHUNKS(chunkCriticalMark)) {
-            if(used_chunks > CHUNKS(chunkCriticalMark)) {
-                do_log(L_WARN, 
-                       "Short on chunk memory -- "
-                       "attempting to punch holes "
-                       "in the middle of objects.\n");
-            }
-            while(object && 
-                  (force || used_chunks > CHUNKS(chunkCriticalMark))) {
-                if(force || (object->flags & OBJECT_PUBLIC)) {
-                    int j;
-                    for(j = object->numchunks - 1; j >= 0; j--) {
-                        if(object->chunks[j].locked)
-                            continue;
-                        if(object->chunks[j].size < CHUNK_SIZE)
-                            continue;
-                        writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
-                        dispose_chunk(object->chunks[j].data);
-                        object->chunks[j].data = NULL;
-                        object->chunks[j].size = 0;
-                    }
+static int
+reallyDiscardObjects(int all, int force)
+{
+    ObjectPtr object;
+    long long deadline = 0;
+    int done = 0;
+    TimeEventHandlerPtr event;
+
+    if(inDiscardObjects)
+        return 0;
+
+    inDiscardObjects = 1;
+
+    if(all || force) {
+        victimsRestore();
+        discardPhase = DISCARD_IDLE;
+    } else if(maxDiscardTime > 0)
+        deadline = probeTime() + maxDiscardTime * 1000LL;
+
+    if(discardPhase == DISCARD_IDLE &&
+       (all || force || used_chunks >= CHUNKS(chunkHighMark) ||
+        objectLowMarkExceeded(0) || objectHighMarkReached())) {
+        discardStartPhase(DISCARD_WRITEOUT);
+        discardReleased = 0;
+    }
+
+    while(discardPhase != DISCARD_IDLE) {
+        if(discardRestart) {
+            discardCursor = lastObject();
+            discardRestart = 0;
+        }
+        object = discardCursor;
+        if(object == NULL || !discardPhaseActive(all, force)) {
+            if(discardPhase == DISCARD_WRITEOUT) {
+                discardStartPhase(DISCARD_PRIVATISE);
+            } else if(discardPhase == DISCARD_PRIVATISE &&
+                      (force || used_chunks > CHUNKS(chunkCriticalMark))) {
+                if(used_chunks > CHUNKS(chunkCriticalMark)) {
+                    do_log(L_WARN,
+                           "Short on chunk memory -- "
+                           "attempting to punch holes "
+                           "in the middle of objects.\n");
                 }
-                object = object->previous;
+                discardStartPhase(DISCARD_PUNCH);
+            } else {
+                victimsRestore();
+                discardPhase = DISCARD_IDLE;
+                discardCursor = NULL;
+                done = 1;
             }
+            continue;
         }
-        event = scheduleTimeEvent(2, discardObjectsHandler, 0, NULL);
-        if(event) {
-            objectExpiryScheduled = 1;
-        } else {
-            objectExpiryScheduled = 0;
-            do_log(L_ERROR, "Couldn't schedule object expiry.\n");
+        /* Move the cursor first, since object may be discarded. */
+        discardCursor = previousObject(object);
+        discardOne(object, all, force);
+        if(deadline > 0 && probeTime() >= deadline)
+            break;
+    }
+
+    if(discardPhase != DISCARD_IDLE || done) {
+        /* Resume at the next iteration of the event loop if we ran out
+           of time, and check again in a couple of seconds otherwise. */
+        if(!objectExpiryScheduled) {
+            event = scheduleTimeEvent(discardPhase != DISCARD_IDLE ? -1 : 2,
+                                      discardObjectsHandler, 0, NULL);
+            if(event)
+                objectExpiryScheduled = 1;
+            else
+                do_log(L_ERROR, "Couldn't schedule object expiry.\n");
         }
-    } else {
-        objectExpiryScheduled = 0;
     }
 
     if(all) {
@@ -915,13 +1805,23 @@ discardObjects(int all, int force)
                    "%d chunks and %d atoms left.\n",
                    used_chunks, used_atoms);
         }
-        diskIsClean = 1;
+        diskIsClean = (dirtyFirst == NULL);
     }
 
-    in_discardObjects = 0;
+    inDiscardObjects = 0;
     return 1;
 }
 
+int
+discardObjects(int all, int force)
+{
+    long long start = eventProbeStart();
+    int rc = reallyDiscardObjects(all, force);
+    eventProbeEnd(start, (void*)discardObjects, "discardObjects",
+                  EVENT_PROBE_FUNCTION);
+    return rc;
+}
+
 CacheControlRec no_cache_control = {0, -1, -1, -1, -1};
 
 int
@@ -48,6 +48,7 @@ typedef int (*RequestFunction)(struct _Object *, int, int, int,
 typedef struct _Object {
     short refcount;
     unsigned char type;
+    unsigned char queue;
     RequestFunction request;
     void *request_closure;
     char *key;
@@ -75,6 +76,12 @@ typedef struct _Object {
     struct _Condition condition;
     struct _DiskCacheEntry *disk_entry;
     struct _Object *next, *previous;
+    struct _Object *dirty_next, *dirty_previous;
+    struct _Object *hash_next;
+    unsigned int hash;
+    int cost;
+    float inflation;
+    int victim;
 } ObjectRec, *ObjectPtr;
 
 typedef struct _CacheControl {
@@ -98,7 +105,13 @@ extern const time_t time_t_max;
 
 extern int publicObjectLowMark, objectHighMark;
 
+extern int objectMemoryHighMark, objectMemory;
+extern AtomPtr objectReplacementPolicy;
+extern unsigned long objectLookups, objectHits;
+
 extern int log2ObjectHashTableSize;
+extern unsigned long objectHashCollisions;
+extern int dirtyObjectCount;
 
 /* object->type */
 #define OBJECT_HTTP 1
@@ -129,6 +142,12 @@ extern int log2ObjectHashTableSize;
 #define OBJECT_DYNAMIC 1024
 /* Used for synchronisation between client and server. */
 #define OBJECT_MUTATING 2048
+/* A deferred notification is pending */
+#define OBJECT_NOTIFY 4096
+/* The object is on the list of objects to write out */
+#define OBJECT_DIRTY 8192
+/* A disk thread is reading data for the object */
+#define OBJECT_DISK_READING 16384
 
 /* object->cache_control and connection->cache_control */
 /* RFC 2616 14.9 */
@@ -169,16 +188,21 @@ ObjectPtr makeObject(int type, const void *key, int key_size,
                      int (*request)(ObjectPtr, int, int, int, 
                                     struct _HTTPRequest*, void*), void*);
 void objectMetadataChanged(ObjectPtr object, int dirty);
+void dirtyObject(ObjectPtr object);
 ObjectPtr retainObject(ObjectPtr);
 void releaseObject(ObjectPtr);
 int objectSetChunks(ObjectPtr object, int numchunks);
 void lockChunk(ObjectPtr, int);
 void unlockChunk(ObjectPtr, int);
+int expandChunk(ObjectPtr, int);
 void destroyObject(ObjectPtr object);
 void privatiseObject(ObjectPtr object, int linear);
 void abortObject(ObjectPtr object, int code, struct _Atom *message);
 void supersedeObject(ObjectPtr);
 void notifyObject(ObjectPtr);
+void notifyObjectLater(ObjectPtr);
+int flushObjectNotifications(void);
+int objectNotificationsPending(void);
 void releaseNotifyObject(ObjectPtr);
 ObjectPtr objectPartial(ObjectPtr object, int length, struct _Atom *headers);
 int objectHoleSize(ObjectPtr object, int offset)
@@ -188,6 +212,7 @@ int objectHasData(ObjectPtr object, int from, int to)
 int objectAddData(ObjectPtr object, const char *data, int offset, int len);
 void objectPrintf(ObjectPtr object, int offset, const char *format, ...)
      ATTRIBUTE ((format (printf, 3, 4)));
+int objectFetchCost(int rtt, int rate, int size);
 int discardObjectsHandler(TimeEventHandlerPtr);
 void writeoutObjects(int);
 int discardObjects(int all, int force);
@@ -47,6 +47,7 @@ THE SOFTWARE.
 #include <sys/stat.h>
 #ifndef WIN32 /*MINGW*/
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -96,6 +97,21 @@ THE SOFTWARE.
 #define HAVE_SETENV
 #define HAVE_ASPRINTF
 #define HAVE_MEMRCHR
+#ifndef NO_EPOLL
+#define HAVE_EPOLL
+#endif
+#define HAVE_PREADV
+#ifndef NO_SENDFILE
+#define HAVE_SENDFILE
+#endif
+#ifndef NO_HUGE_PAGES
+#define HAVE_HUGE_PAGES
+#endif
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
 #ifdef __GLIBC__
 #define HAVE_FTS
 #endif
@@ -110,6 +126,7 @@ THE SOFTWARE.
 #define HAVE_TM_GMTOFF
 #define HAVE_FTS
 #define HAVE_SETENV
+#define HAVE_PREADV
 #endif
 
 #ifdef __CYGWIN__
@@ -182,6 +199,9 @@ THE SOFTWARE.
 #endif
 #define HAVE_READV_WRITEV
 #define HAVE_FFS
+#ifndef NO_DISK_THREADS
+#define HAVE_DISK_THREADS
+#endif
 #define READ(x, y, z) read(x, y, z)
 #define WRITE(x, y, z) write(x, y, z)
 #define CLOSE(x) close(x)
@@ -203,6 +223,42 @@ THE SOFTWARE.
 #define NO_REDIRECTOR
 #endif
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_DISK_THREADS
+#include <pthread.h>
+#ifdef __linux
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* We need the extended wait arguments, which appeared in Linux 5.11. */
+#if !defined(IORING_FEAT_EXT_ARG) || !defined(__NR_io_uring_enter)
+#undef HAVE_IO_URING
+#endif
+#endif
+
+#ifdef __linux
+#include <sys/prctl.h>
+#endif
+
+/* dladdr moved into libc proper in glibc 2.34. */
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_DLADDR
+#include <dlfcn.h>
+#endif
+
 #include "mingw.h"
 
 #include "ftsimport.h"
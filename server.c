@@ -1224,6 +1224,11 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
             else
                 server->rate = rate;
         }
+        /* Remember what it would cost to fetch the object again. */
+        request->object->cost =
+            objectFetchCost(server->rtt, server->rate,
+                            request->object->length >= 0 ?
+                            request->object->length : request->object->size);
 
         httpDequeueRequest(connection);
         connection->pipelined--;
@@ -1312,7 +1317,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
             unregisterFdEvent(server->idleHandler[i]);
         server->idleHandler[i] = NULL;
         server->connection[i] = NULL;
-        free(connection);
+        httpFreeConnection(connection);
     } else {
         server->persistent += 1;
         if(server->persistent > 0)
@@ -2535,20 +2540,18 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
         /* The order of allocation is important in case we run out of
            memory. */
         lockChunk(object, i);
-        if(object->chunks[i].data == NULL)
-            object->chunks[i].data = get_chunk();
-        if(object->chunks[i].data && object->chunks[i].size >= j) {
+        if(expandChunk(object, i) >= 0 && object->chunks[i].size >= j) {
             if(len + j > CHUNK_SIZE) {
                 lockChunk(object, i + 1);
-                if(object->chunks[i + 1].data == NULL)
-                    object->chunks[i + 1].data = get_chunk();
+                expandChunk(object, i + 1);
                 /* Unless we're grabbing all len of data, we do not
                    want to do an indirect read immediately afterwards. */
                 if(more && len + j <= 2 * CHUNK_SIZE) {
                     if(!connection->buf)
                         connection->buf = get_chunk(); /* checked below */
                 }
-                if(object->chunks[i + 1].data) {
+                if(object->chunks[i + 1].data &&
+                   chunk_capacity(object->chunks[i + 1].data) >= CHUNK_SIZE) {
                     do_stream_3(IO_READ | IO_NOTNOW, connection->fd, j,
                                 object->chunks[i].data, CHUNK_SIZE,
                                 object->chunks[i + 1].data,
@@ -2643,6 +2646,7 @@ httpServerDirectHandlerCommon(int kind, int status,
     }
     connection->offset = end1;
     object->size = MAX(object->size, end1);
+    dirtyObject(object);
     unlockChunk(object, i);
     if(kind == 2) unlockChunk(object, i + 1);
 
@@ -2650,7 +2654,7 @@ httpServerDirectHandlerCommon(int kind, int status,
         connection->len = i * CHUNK_SIZE + srequest->offset - end1;
         return httpServerIndirectHandlerCommon(connection, status);
     } else {
-        notifyObject(object);
+        notifyObjectLater(object);
         if(status) {
             if(connection->te == TE_CHUNKED ||
                (end >= 0 && connection->offset < end)) {
@@ -2725,7 +2729,7 @@ connectionAddData(HTTPConnectionPtr connection, int skip)
             return 1;
         } else {
             if(len > 0)
-                notifyObject(object);
+                notifyObjectLater(object);
             return 0;
         }
     } else if(connection->te == TE_CHUNKED) {
@@ -2784,8 +2788,10 @@ connectionAddData(HTTPConnectionPtr connection, int skip)
         connection->len -= i;
         if(connection->len > 0)
             memmove(connection->buf, connection->buf + i, connection->len);
-        if(i > 0 || connection->chunk_remaining == -2)
+        if(connection->chunk_remaining == -2)
             notifyObject(object);
+        else if(i > 0)
+            notifyObjectLater(object);
         if(connection->chunk_remaining == -2)
             return 1;
         else
@@ -0,0 +1,90 @@
+/* Measures get_chunk and dispose_chunk with every chunk allocated and
+   freed in random order, then under random churn with half the chunks
+   in use.  Run with "make bench"; the optional argument is
+   chunkHighMark in megabytes. */
+
+#include "polipo.h"
+
+/* Normally defined in main.c. */
+AtomPtr configFile = NULL;
+AtomPtr pidFile = NULL;
+int daemonise = 0;
+
+#define ROUNDS 5
+#define CHURN 2000000
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0E9;
+}
+
+int
+main(int argc, char **argv)
+{
+    int n, i, j, r;
+    void **chunks, *tmp;
+    double t, alloc = 0.0, dispose = 0.0, churn;
+
+    initAtoms();
+    preinitChunks();
+    preinitLog();
+    preinitObject();
+    preinitEvents();
+    chunkHighMark = (argc > 1 ? atoi(argv[1]) : 1536) * 1024 * 1024;
+    initLog();
+    initChunks();
+    initObject();
+    initEvents();
+
+    n = CHUNKS(chunkHighMark) - 8;
+    chunks = malloc(n * sizeof(void*));
+    if(chunks == NULL) {
+        fprintf(stderr, "chunk_bench: couldn't allocate %d pointers.\n", n);
+        return 1;
+    }
+    srand(1);
+
+    for(r = 0; r < ROUNDS; r++) {
+        t = now();
+        for(i = 0; i < n; i++) {
+            chunks[i] = get_chunk();
+            if(chunks[i] == NULL) {
+                fprintf(stderr, "chunk_bench: get_chunk failed at %d.\n", i);
+                return 1;
+            }
+        }
+        alloc += now() - t;
+        for(i = n - 1; i > 0; i--) {
+            j = rand() % (i + 1);
+            tmp = chunks[i];
+            chunks[i] = chunks[j];
+            chunks[j] = tmp;
+        }
+        t = now();
+        for(i = 0; i < n; i++)
+            dispose_chunk(chunks[i]);
+        dispose += now() - t;
+        free_chunk_arenas();
+    }
+
+    for(i = 0; i < n; i++)
+        chunks[i] = get_chunk();
+    for(i = 0; i < n; i += 2)
+        dispose_chunk(chunks[i]);
+    t = now();
+    for(r = 0; r < CHURN; r++) {
+        j = (rand() % (n / 2)) * 2 + 1;
+        dispose_chunk(chunks[j]);
+        chunks[j] = get_chunk();
+    }
+    churn = now() - t;
+
+    printf("%d chunks, %d kB mapped\n", n, totalChunkArenaSize() / 1024);
+    printf("get_chunk      %8.1f ns\n", alloc / ROUNDS / n * 1.0E9);
+    printf("dispose_chunk  %8.1f ns\n", dispose / ROUNDS / n * 1.0E9);
+    printf("random churn   %8.1f ns\n", churn / CHURN * 1.0E9);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/* Checks that httpParseHeaders recognises well-known header names, and
+   only those.  Run with "make check". */
+
+#include "polipo.h"
+
+/* Normally defined in main.c. */
+AtomPtr configFile = NULL;
+AtomPtr pidFile = NULL;
+int daemonise = 0;
+
+static int failures = 0;
+
+static void
+check(int ok, const char *what)
+{
+    if(!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int
+parse(const char *buf, AtomPtr *headers, int *te,
+      int *body_offset, HTTPRangePtr range)
+{
+    return httpParseHeaders(1, NULL, buf, 0, NULL, headers, NULL, NULL,
+                            NULL, te, NULL, NULL, NULL, NULL, NULL,
+                            body_offset, NULL, NULL, NULL, range, NULL,
+                            NULL, NULL, NULL);
+}
+
+static int
+hasHeader(AtomPtr headers, const char *line)
+{
+    return headers && strstr(headers->string, line) != NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    AtomPtr headers;
+    HTTPRangeRec range;
+    int rc, te, body_offset;
+
+    initAtoms();
+    preinitHttpParser();
+    initHttpParser();
+
+    /* The real names are interpreted, whatever their case. */
+    headers = NULL;
+    rc = parse("rAnGe: bytes=10-20\r\n"
+               "Transfer-Encoding: chunked\r\n"
+               "X-Polipo-Body-Offset: 5\r\n"
+               "\r\n", &headers, &te, &body_offset, &range);
+    check(rc > 0, "known names: parse");
+    check(range.from == 10 && range.to == 21, "Range");
+    check(te == TE_CHUNKED, "Transfer-Encoding");
+    check(body_offset == 5, "X-Polipo-Body-Offset");
+    if(headers) releaseAtom(headers);
+
+    /* Names that only differ in their first character are not. */
+    headers = NULL;
+    rc = parse("Xange: bytes=10-20\r\n"
+               "Xe: trailers\r\n"
+               "Yransfer-Encoding: chunked\r\n"
+               "Y-Polipo-Body-Offset: 5\r\n"
+               "\r\n", &headers, &te, &body_offset, &range);
+    check(rc > 0, "near misses: parse");
+    check(range.from == -1 && range.to == -1, "Xange taken for Range");
+    check(te == TE_IDENTITY, "Yransfer-Encoding taken for Transfer-Encoding");
+    check(body_offset == -1,
+          "Y-Polipo-Body-Offset taken for X-Polipo-Body-Offset");
+    check(hasHeader(headers, "Xange: bytes=10-20"), "Xange not passed on");
+    check(hasHeader(headers, "Xe: trailers"), "Xe not passed on");
+    check(hasHeader(headers, "Y-Polipo-Body-Offset: 5"),
+          "Y-Polipo-Body-Offset not passed on");
+    if(headers) releaseAtom(headers);
+
+    if(failures > 0) {
+        fprintf(stderr, "%d failure%s.\n", failures, failures > 1 ? "s" : "");
+        return 1;
+    }
+    printf("http_parse_test: all tests passed.\n");
+    return 0;
+}
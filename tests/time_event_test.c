@@ -0,0 +1,66 @@
+/* Checks that runTimeEventQueue runs the timers that are due before
+   the events that their handlers schedule.  Run with "make check". */
+
+#include "polipo.h"
+
+/* Normally defined in main.c. */
+AtomPtr configFile = NULL;
+AtomPtr pidFile = NULL;
+int daemonise = 0;
+
+static int failures = 0;
+static int timerRuns = 0, chainRuns = 0;
+
+static void
+check(int ok, const char *what)
+{
+    if(!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int
+timerHandler(TimeEventHandlerPtr event)
+{
+    timerRuns++;
+    return 1;
+}
+
+/* Like the discard sweep, reschedule ourselves immediately. */
+static int
+chainHandler(TimeEventHandlerPtr event)
+{
+    chainRuns++;
+    scheduleTimeEvent(-1, chainHandler, 0, NULL);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    updateCurrentTime();
+
+    scheduleTimeEvent(-1, chainHandler, 0, NULL);
+    scheduleTimeEvent(0, timerHandler, 0, NULL);
+    runTimeEventQueue();
+    check(chainRuns == 1, "chain didn't run exactly once");
+    check(timerRuns == 1, "due timer starved by an immediate event");
+
+    /* Timers that become due while the chain runs are not held up
+       either. */
+    for(i = 0; i < 3; i++)
+        scheduleTimeEvent(0, timerHandler, 0, NULL);
+    runTimeEventQueue();
+    check(chainRuns == 2, "chain didn't run once per iteration");
+    check(timerRuns == 4, "due timers starved by an immediate event");
+
+    if(failures > 0) {
+        fprintf(stderr, "%d failure%s.\n", failures, failures > 1 ? "s" : "");
+        return 1;
+    }
+    printf("time_event_test: all tests passed.\n");
+    return 0;
+}
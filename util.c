@@ -331,6 +331,88 @@ hash(unsigned int seed, const void *restrict key, int key_size,
     return h & ((1 << hash_size) - 1);
 }
 
+/* SipHash-1-3, a keyed hash that is fast on short inputs and makes it
+   impractical for an attacker who doesn't know the key to construct
+   colliding keys. */
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)                                       \
+    do {                                                                \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;                      \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;                      \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while(0)
+
+static unsigned long long
+sipLoad(const unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+    int i;
+    for(i = n - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+unsigned long long
+sipHash(const unsigned long long *key, const void *data, int len)
+{
+    const unsigned char *p = data;
+    unsigned long long v0, v1, v2, v3, m;
+    int i;
+
+    v0 = key[0] ^ 0x736f6d6570736575ULL;
+    v1 = key[1] ^ 0x646f72616e646f6dULL;
+    v2 = key[0] ^ 0x6c7967656e657261ULL;
+    v3 = key[1] ^ 0x7465646279746573ULL;
+
+    for(i = 0; i + 8 <= len; i += 8) {
+        m = sipLoad(p + i, 8);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = sipLoad(p + i, len - i) | ((unsigned long long)(len & 0xFF) << 56);
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Fill buf with unpredictable bytes, suitable for seeding hash tables. */
+void
+randomBytes(void *buf, int n)
+{
+    unsigned char *p = buf;
+    struct timeval tv;
+    unsigned long long x;
+    int fd, rc = 0, i;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0) {
+        rc = read(fd, buf, n);
+        close(fd);
+    }
+    if(rc == n)
+        return;
+
+    /* No /dev/urandom.  This is not cryptographically strong, but
+       still good enough to avoid trivially predictable seeds. */
+    gettimeofday(&tv, NULL);
+    x = ((unsigned long long)tv.tv_sec << 20) ^ tv.tv_usec ^
+        ((unsigned long long)getpid() << 32) ^
+        (unsigned long long)(unsigned long)buf;
+    for(i = 0; i < n; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        p[i] = (unsigned char)(x >> 56);
+    }
+}
+
 char *
 pstrerror(int e)
 {
@@ -836,3 +918,62 @@ physicalMemory()
     return -1;
 }
 #endif
+
+#define POOL_SLAB_SIZE (16 * 1024)
+#define POOL_ALIGN (2 * sizeof(void*))
+
+PoolPtr pools = NULL;
+
+void *
+poolAlloc(PoolPtr pool, int size)
+{
+    void *block;
+
+    if(!pool->registered) {
+        /* First use -- align the block size and register the pool. */
+        pool->size = (pool->size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+        pool->next = pools;
+        pools = pool;
+        pool->registered = 1;
+    }
+
+    if(size > pool->size) {
+        block = malloc(size);
+        if(block)
+            pool->large++;
+        return block;
+    }
+
+    if(pool->free_list == NULL) {
+        char *slab;
+        int i, n = MAX(POOL_SLAB_SIZE / pool->size, 1);
+        slab = malloc(n * pool->size);
+        if(slab == NULL)
+            return NULL;
+        for(i = n - 1; i >= 0; i--) {
+            *(void**)(slab + i * pool->size) = pool->free_list;
+            pool->free_list = slab + i * pool->size;
+        }
+        pool->slabs++;
+    }
+
+    block = pool->free_list;
+    pool->free_list = *(void**)block;
+    pool->used++;
+    if(pool->used > pool->peak)
+        pool->peak = pool->used;
+    return block;
+}
+
+void
+poolFree(PoolPtr pool, void *block, int size)
+{
+    if(size > pool->size) {
+        free(block);
+        pool->large--;
+        return;
+    }
+    *(void**)block = pool->free_list;
+    pool->free_list = block;
+    pool->used--;
+}
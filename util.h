@@ -63,6 +63,25 @@ typedef struct _IntList {
     IntRangePtr ranges;
 } IntListRec, *IntListPtr;
 
+/* A pool of fixed-size blocks, allocated in slabs and never returned
+   to malloc.  Requests larger than the block size go to malloc. */
+typedef struct _Pool {
+    char *name;
+    int size;
+    int used;
+    int peak;
+    int slabs;
+    int large;
+    int registered;
+    void *free_list;
+    struct _Pool *next;
+} PoolRec, *PoolPtr;
+
+#define POOL_INITIALIZER(name, size) \
+    {name, size, 0, 0, 0, 0, 0, NULL, NULL}
+
+extern PoolPtr pools;
+
 char *strdup_n(const char *restrict buf, int n) ATTRIBUTE ((malloc));
 int snnprintf(char *restrict buf, int n, int len, const char *format, ...)
      ATTRIBUTE ((format (printf, 4, 5)));
@@ -92,6 +111,10 @@ char* sprintf_a(const char *f, ...)
 unsigned int hash(unsigned seed, const void *restrict key, int key_size, 
                   unsigned int hash_size)
      ATTRIBUTE ((pure));
+unsigned long long sipHash(const unsigned long long *key,
+                           const void *data, int len)
+     ATTRIBUTE ((pure));
+void randomBytes(void *buf, int n);
 char *pstrerror(int e);
 time_t mktime_gmt(struct tm *tm) ATTRIBUTE ((pure));
 AtomPtr expandTilde(AtomPtr filename);
@@ -105,3 +128,5 @@ void destroyIntList(IntListPtr list);
 int intListMember(int n, IntListPtr list) ATTRIBUTE ((pure));
 int intListCons(int from, int to, IntListPtr list);
 int physicalMemory(void);
+void *poolAlloc(PoolPtr pool, int size) ATTRIBUTE ((malloc));
+void poolFree(PoolPtr pool, void *block, int size);